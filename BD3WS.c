@@ -9,19 +9,66 @@
 	main: Initializes the program and enters the main accept/response loop.
 ******************************************************************************/
 int main(int argc, char **argv)
+{
+	// Server start up.
+	initialize(argc, argv);
+	//
+
+	// Either supervise a pool of prefork workers or serve clients directly.
+	if (0 < server.number_workers)
+	{
+		supervise_workers();
+	}
+	else
+	{
+		serve_clients();
+	}
+	//
+
+	return 0;
+}
+
+/******************************************************************************
+	serve_clients: Runs the accept/response loop. In prefork mode, each worker 
+process runs this loop against the listening socket inherited from the 
+supervisor.
+******************************************************************************/
+void serve_clients()
 {
 	char buffer[BD3WS_MaxLengthData];
+	sigset_t signals;
+	sigset_t previous_signals;
 	int client = -1;
 
 	memset(buffer, 0, sizeof(buffer));
 
-	// Server start up.
-	initialize(argc, argv);
+	// Control signals are only handled by this thread, so that they interrupt accept().
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR2);
+	//
+
+	// Start this process's send scheduler.
+	pthread_sigmask(SIG_BLOCK, &signals, &previous_signals);
+	scheduler_initialize();
+	pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
 	//
 
 	// Server main loop.
-	while (1)
+	while (!shutdown_requested)
 	{
+		// Hand the listening socket over to a freshly executed binary, then stop accepting.
+		if (upgrade_requested)
+		{
+			upgrade_requested = 0;
+			if (0 == upgrade_server())
+			{
+				break;
+			}
+		}
+		//
+
 		// Accept connection request from client or continue looping.
 		client = accept_client();
 		if (-1 == client)
@@ -31,10 +78,14 @@ int main(int argc, char **argv)
 		//
 
 		// Spawn a thread to handle incoming client request or log the resulting error.
+		pthread_sigmask(SIG_BLOCK, &signals, &previous_signals);
 		if (0 != pthread_create(&(server.clients[client].thread), NULL, handle_client_request, client))
 		{
 			sprintf(buffer, "Error creating thread!\n");
 			log(buffer, STDERR);
+			close(server.clients[client].socket);
+			server.clients[client].socket = -1;
+			server.clients[client].occupied = 0;
 		}
 		else
 		{
@@ -44,749 +95,6402 @@ int main(int argc, char **argv)
 
 			client = -1;
 		}
+		pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
 		//
 	}
 	//
+
+	// Stop accepting and drain in-flight connections.
+	finalize(0);
+	//
 }
 
 /******************************************************************************
-	initialize: Initializes the program by setting up structs and sockets,
-parsing command-line arguments, and listening for client connections.
+	supervise_workers: Forks the configured number of worker processes, each 
+of which runs its own accept loop on the shared listening socket. Workers that 
+exit or crash are replaced, so a fault in one request only costs the 
+connections held by that worker. The shared content cache lives in the 
+supervisor's mapping and therefore survives worker restarts.
 ******************************************************************************/
-void initialize(int argc, char** argv)
+void supervise_workers()
 {
 	char buffer[BD3WS_MaxLengthData];
+	time_t spawn_times[BD3WS_MaxNumberWorkers];
+	pid_t pid = -1;
+	int status = 0;
+	int worker = 0;
 
 	memset(buffer, 0, sizeof(buffer));
 
-	// Open log file, ensuring that its directory exists beforehand.
-	mkdir(BD3WS_LogDirectory, S_IRWXU | S_IRWXG | S_IROTH);
-	log_handle = fopen(BD3WS_Log, "w");
+	// Spawn initial workers.
+	for (worker = 0; worker < server.number_workers; ++worker)
+	{
+		server.workers[worker] = spawn_worker(worker);
+		spawn_times[worker] = time(NULL);
+	}
 	//
 
-	sprintf(buffer, "Initializing...\n");
-	log(buffer, STDOUT);
+	// Replace workers as they exit until shutdown is requested.
+	while (!shutdown_requested)
+	{
+		// Hand the listening socket over to a freshly executed binary, then retire the workers.
+		if (upgrade_requested)
+		{
+			upgrade_requested = 0;
+			if (0 == upgrade_server())
+			{
+				break;
+			}
+		}
+		//
 
-	// Set initial server configuration.
-	memset(&(server.hints), 0, sizeof(server.hints));
-	server.hints.ai_family = AF_UNSPEC;
-	server.hints.ai_socktype = SOCK_STREAM;
-	server.hints.ai_flags = AI_PASSIVE;
-	//
+		pid = waitpid(-1, &status, 0);
+		if (-1 == pid)
+		{
+			// No children left (every fork failed); back off before retrying.
+			if (ECHILD == errno)
+			{
+				sleep(1);
+				for (worker = 0; worker < server.number_workers; ++worker)
+				{
+					if (-1 == server.workers[worker])
+					{
+						server.workers[worker] = spawn_worker(worker);
+						spawn_times[worker] = time(NULL);
+					}
+				}
+			}
+			//
 
-	// Process command-line arguments.
-	process_CLA(argc, argv);
-	//
+			continue;
+		}
 
-	// Extract server connection information.
-	extract_connection_information();
-	//
+		for (worker = 0; worker < server.number_workers; ++worker)
+		{
+			if (pid == server.workers[worker])
+			{
+				break;
+			}
+		}
 
-	// Setup server socket and bind it to a port.
-	setup_socket();
-	//
+		if (worker == server.number_workers)
+		{
+			continue;
+		}
 
-	// Finished with the server information structure.
-	freeaddrinfo(server.info);
+		// Report how the worker went away.
+		if (WIFSIGNALED(status))
+		{
+			sprintf(buffer, "Worker %d (pid %d) terminated by signal %d! Respawning.\n", worker, (int)pid, WTERMSIG(status));
+		}
+		else
+		{
+			sprintf(buffer, "Worker %d (pid %d) exited with status %d! Respawning.\n", worker, (int)pid, WEXITSTATUS(status));
+		}
+		log(buffer, STDERR);
+		//
+
+		// Release the shared cache entries it may have died holding.
+		cache_recover(pid);
+		//
+
+		// Throttle workers that die immediately after being spawned to avoid a fork storm.
+		if (time(NULL) - spawn_times[worker] < 1)
+		{
+			sleep(1);
+		}
+		//
+
+		server.workers[worker] = -1;
+		if (!shutdown_requested)
+		{
+			server.workers[worker] = spawn_worker(worker);
+			spawn_times[worker] = time(NULL);
+		}
+	}
 	//
 
-	// Initialize client occupany states.
-	for (int i = 0; i < BD3WS_MaxNumberClients; ++i)
+	// Ask all workers to drain and reap them. Only workers are waited on, since an upgraded server may also be a child.
+	for (worker = 0; worker < server.number_workers; ++worker)
 	{
-		server.clients[i].occupied = 0;
+		if (0 < server.workers[worker])
+		{
+			kill(server.workers[worker], SIGTERM);
+		}
 	}
-	//
 
-	// Ignore broken pipes.
-	signal(SIGPIPE, SIG_IGN);
+	for (worker = 0; worker < server.number_workers; ++worker)
+	{
+		while (0 < server.workers[worker] && -1 == waitpid(server.workers[worker], NULL, 0) && EINTR == errno)
+		{
+		}
+		server.workers[worker] = -1;
+	}
 	//
 
-	// Begin listening on the socket.
-	listen(server.socket, 3);
-	sprintf(buffer, "Listening on %s:%hu\n", server.ip, server.port);
-	log(buffer, STDOUT);
-	//
+	finalize(0);
 }
 
 /******************************************************************************
-	finalize: Performs program shutdown tasks before exiting.
+	spawn_worker: Forks a single worker process which runs the accept/response 
+loop until it exits. Returns the worker's process ID, or -1 on failure.
 ******************************************************************************/
-void finalize(int exit_code)
+pid_t spawn_worker(int worker)
 {
 	char buffer[BD3WS_MaxLengthData];
+	pid_t pid = -1;
 
 	memset(buffer, 0, sizeof(buffer));
 
-	sprintf(buffer, "Finalizing...\n");
-	log(buffer, STDOUT);
+	pid = fork();
 
-	// Close connection sockets.
-	for (int i = 0; i < BD3WS_MaxNumberClients; ++i)
+	// Child: serve clients. Upgrades and Unix socket paths are the supervisor's business alone.
+	if (0 == pid)
 	{
-		if (-1 != server.clients[i].socket)
+		signal(SIGUSR2, SIG_IGN);
+		for (int i = 0; i < server.number_listeners; ++i)
 		{
-			close(server.clients[i].socket);
+			server.listeners[i].unlink_path[0] = '\0';
 		}
+		serve_clients();
+		exit(0);
 	}
 	//
 
-	// Close server socket.
-	if (-1 != server.socket)
+	if (-1 == pid)
 	{
-		close(server.socket);
+		sprintf(buffer, "Cannot fork worker %d!\n", worker);
+		log(buffer, STDERR);
 	}
-	//
-
-	// Close log file.
-	if (NULL != log_handle)
+	else
 	{
-		fclose(log_handle);
+		sprintf(buffer, "Spawned worker %d (pid %d).\n", worker, (int)pid);
+		log(buffer, STDOUT);
 	}
-	//
 
-	exit(exit_code);
-}	
+	return pid;
+}
 
 /******************************************************************************
-	process_CLA: Parses program command-line arguments.
+	handle_signal: Records a shutdown (SIGINT/SIGTERM) or binary upgrade 
+(SIGUSR2) request. The main loop acts on it once its blocking call has been 
+interrupted.
 ******************************************************************************/
-void process_CLA(int argc, char** argv)
+void handle_signal(int signal_number)
 {
-	char buffer[BD3WS_MaxLengthData];
-
-	memset(buffer, 0, sizeof(buffer));
-
-	// Return address information for the specified hostname and service.
-	if (3 == argc && 0 != getaddrinfo(argv[1], argv[2], &(server.hints), &(server.info)))
+	if (SIGUSR2 == signal_number)
 	{
-		sprintf(buffer, "Cannot get specified address information!\n");
-		log(buffer, STDERR);
-		finalize(1);
+		upgrade_requested = 1;
 	}
-	//
-
-	// Return address information for the default hostname and service.
-	else if (3 > argc && 0 != getaddrinfo(BD3WS_DefaultIP, BD3WS_DefaultPort, &(server.hints), &(server.info)))
+	else
 	{
-		sprintf(buffer, "Cannot get default address information!\n");
-		log(buffer, STDERR);
-		finalize(1);
+		shutdown_requested = 1;
 	}
-	//
-}
-
-/******************************************************************************
-	extract_connection_information: Extracts information pertaining to the 
-server-client connection (server IP address and port, etc.).
-******************************************************************************/
-void extract_connection_information()
-{
-	struct sockaddr_in* address;
-
-	// Extract address and port information and print it out.
-	address = (struct sockaddr_in*)server.info->ai_addr;
-	inet_ntop(server.info->ai_family, &(address->sin_addr), server.ip, sizeof(server.ip));
-	server.port = ntohs(address->sin_port);
-	//
 }
 
 /******************************************************************************
-	setup_socket: Establishes server socket/port pairing to prepare the server 
-to listen for incoming client connections.
+	upgrade_server: Performs a zero-downtime binary upgrade. The binary is 
+re-executed from disk with the upgrade socket path in its environment; the new 
+process connects back over that Unix socket and receives the listening 
+sockets via SCM_RIGHTS. Once the new process acknowledges, this process may stop 
+accepting and drain. The binary path and environment are prepared before 
+forking, since the child of a multithreaded process may only make 
+async-signal-safe calls. Returns 0 on a successful handoff, or -1 if this 
+process should keep serving.
 ******************************************************************************/
-void setup_socket()
+int upgrade_server()
 {
 	char buffer[BD3WS_MaxLengthData];
+	char binary[BD3WS_MaxLengthData];
+	char variable[BD3WS_MaxLengthData];
+	struct sockaddr_un address;
+	struct pollfd handoff_poll;
+	int sockets[BD3WS_MaxNumberListeners];
+	char** environment = NULL;
+	const char* directories = getenv("PATH");
+	unsigned long length = 0;
+	long number_descriptors = sysconf(_SC_OPEN_MAX);
+	int number_variables = 0;
+	int handoff = -1;
+	int connection = -1;
+	char acknowledgement = 0;
+	pid_t pid = -1;
 
 	memset(buffer, 0, sizeof(buffer));
+	memset(binary, 0, sizeof(binary));
+	memset(variable, 0, sizeof(variable));
+	memset(&address, 0, sizeof(address));
+
+	sprintf(buffer, "Upgrading binary \"%s\"...\n", server.arguments[0]);
+	log(buffer, STDOUT);
 
-	// Get a server socket descriptor.
-	if (0 > (server.socket = socket(server.info->ai_family, server.info->ai_socktype, server.info->ai_protocol)))
+	// Listen on the upgrade socket for the new process, and gather the listening sockets to hand over.
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, BD3WS_UpgradeSocket, sizeof(address.sun_path) - 1);
+	unlink(BD3WS_UpgradeSocket);
+	if (-1 == (handoff = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+		|| -1 == bind(handoff, (struct sockaddr*)&address, sizeof(address))
+		|| -1 == listen(handoff, 1))
 	{
-		sprintf(buffer, "Invalid server socket descriptor!\n");
+		char error_buffer[256];
+		sprintf(buffer, "Cannot create upgrade socket! Details: %s\n", strerror_r(errno, error_buffer, 256));
 		log(buffer, STDERR);
-		finalize(1);
+		if (-1 != handoff)
+		{
+			close(handoff);
+		}
+		return -1;
 	}
 	//
 
-	// Set socket options.
-	int optval = 1;
-	setsockopt(server.socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	for (int i = 0; i < server.number_listeners; ++i)
+	{
+		sockets[i] = server.listeners[i].socket;
+	}
 	//
 
-	// Associate socket with port.
-	if (-1 == bind(server.socket, server.info->ai_addr, server.info->ai_addrlen))
+	// Find the binary the way execvp() would (a name without a separator is looked up in PATH).
+	snprintf(binary, sizeof(binary), "%s", server.arguments[0]);
+	for (const char* directory = directories; NULL == strchr(server.arguments[0], '/') && NULL != directory && '\0' != *directory; directory += length + (':' == directory[length]))
 	{
-		sprintf(buffer, "Cannot bind to socket!\n");
-		log(buffer, STDERR);
-		finalize(1);
+		length = strcspn(directory, ":");
+		snprintf(binary, sizeof(binary), "%.*s%s%s", (int)length, directory, (0 == length) ? "" : "/", server.arguments[0]);
+		if (0 == access(binary, X_OK))
+		{
+			break;
+		}
 	}
 	//
-}
-
-/******************************************************************************
-	accept_client: Waits on client requests and sets up server-client 
-connections upon receiving them.
-******************************************************************************/
-int accept_client()
-{
-	char buffer[BD3WS_MaxLengthData];
-	int i = 0;
 
-	memset(buffer, 0, sizeof(buffer));
+	// Build the new process's environment: this one, with the upgrade socket path set.
+	snprintf(variable, sizeof(variable), "%s=%s", BD3WS_UpgradeEnvironment, BD3WS_UpgradeSocket);
+	for (number_variables = 0; NULL != environ[number_variables]; ++number_variables)
+	{
+	}
+	if (NULL == (environment = malloc((number_variables + 2) * sizeof(char*))))
+	{
+		sprintf(buffer, "Binary upgrade failed! Continuing with the current binary.\n");
+		log(buffer, STDERR);
+		close(handoff);
+		unlink(BD3WS_UpgradeSocket);
+		return -1;
+	}
 
-	// Get a connection socket descriptor.
-	for (i = 0; i < BD3WS_MaxNumberClients; ++i)
+	number_variables = 0;
+	for (int i = 0; NULL != environ[i]; ++i)
 	{
-		// Find vacant client.
-		if (0 == server.clients[i].occupied)
+		if (0 != strncmp(environ[i], variable, strlen(BD3WS_UpgradeEnvironment) + 1))
 		{
-			// Secure client structure.
-			server.clients[i].occupied = 1;
-			//
+			environment[number_variables++] = environ[i];
+		}
+	}
+	environment[number_variables++] = variable;
+	environment[number_variables] = NULL;
+	//
 
-			// Wait on client connection.
-			server.clients[i].address_size = sizeof(server.clients[i].address_storage);
-			if (-1 == (server.clients[i].socket = accept(server.socket, (struct sockaddr *)&(server.clients[i].address_storage), &(server.clients[i].address_size))))
+	// Execute the new binary with only the standard streams inherited (closing the rest one by one on kernels without close_range).
+	pid = fork();
+	if (0 == pid)
+	{
+		if (-1 == syscall(SYS_close_range, 3, ~0U, 0))
+		{
+			for (long descriptor = 3; descriptor < number_descriptors; ++descriptor)
 			{
-				sprintf(buffer, "Invalid connection socket descriptor!\n");
-				log(buffer, STDERR);
-				return -1;
+				close(descriptor);
 			}
-			//
-
-			// Indicate successful client acceptance and return newly-occupied index.
-			sprintf(buffer, "Accepted connection request from client.\n");
-			log(buffer, STDOUT);
-			return i;
-			//
 		}
-		//
+		execve(binary, server.arguments, environment);
+		_exit(127);
 	}
+	free(environment);
 	//
 
-	// Return occupied client's index in server's client array.
-	return -1;
-	//
-}
-
-/******************************************************************************
-	handle_client_request: Upon receiving a client request, the server spawns 
-a thread. The thread's main task is to execute this function, which parses 
-incoming client requests and responds to them accordingly. Before returning, 
-connection sockets are closed and client structures are vacated for future 
-tasks.
-******************************************************************************/
-void* handle_client_request(void* client)
-{
-	char file_path[BD3WS_MaxLengthData];
-	char content_type[BD3WS_MaxLengthData];
-
-	memset(file_path, 0, sizeof(file_path));
-	memset(content_type, 0, sizeof(content_type));
-
-	// Receive file data request from client.
-	parse_client_request((int)client, &file_path, &content_type);
+	// Wait for the new process to connect, hand over the listening socket, and wait for its acknowledgement.
+	handoff_poll.fd = handoff;
+	handoff_poll.events = POLLIN;
+	if (-1 == pid
+		|| 1 != poll(&handoff_poll, 1, BD3WS_UpgradeTimeout * 1000)
+		|| -1 == (connection = accept(handoff, NULL, NULL))
+		|| -1 == send_sockets(connection, sockets, server.number_listeners)
+		|| 1 != recv(connection, &acknowledgement, 1, 0))
+	{
+		sprintf(buffer, "Binary upgrade failed! Continuing with the current binary.\n");
+		log(buffer, STDERR);
+		if (0 < pid)
+		{
+			kill(pid, SIGKILL);
+		}
+		if (-1 != connection)
+		{
+			close(connection);
+		}
+		close(handoff);
+		unlink(BD3WS_UpgradeSocket);
+		return -1;
+	}
 	//
 
-	// Send requested file data to client.
-	send_server_response((int)client, &file_path, &content_type);
-	//
+	close(connection);
+	close(handoff);
+	unlink(BD3WS_UpgradeSocket);
 
-	// Close connection socket.
-	if (-1 != server.clients[(int)client].socket)
+	// Unix socket paths now belong to the new process.
+	for (int i = 0; i < server.number_listeners; ++i)
 	{
-		close(server.clients[(int)client].socket);
+		server.listeners[i].unlink_path[0] = '\0';
 	}
 	//
 
-	// Vacate client.
-	server.clients[(int)client].occupied = 0;
-	//
+	sprintf(buffer, "Listening sockets handed over to new process (pid %d). Draining...\n", (int)pid);
+	log(buffer, STDOUT);
+
+	return 0;
 }
 
 /******************************************************************************
-	parse_client_request: Parses incoming client request to determine an
-appropriate server response.
+	receive_listening_sockets: Run by a newly upgraded binary in place of 
+binding its own sockets. Connects to the previous process's upgrade socket, 
+receives its listening sockets, and acknowledges the handoff.
 ******************************************************************************/
-void parse_client_request(int client, char* file_path, char* content_type)
+void receive_listening_sockets(const char* upgrade_socket)
 {
 	char buffer[BD3WS_MaxLengthData];
-	char request[BD3WS_MaxLengthData];
-	char line_file[BD3WS_MaxLengthData];
-	char line_type[BD3WS_MaxLengthData];
-	char* token = NULL;
+	struct sockaddr_un address;
+	int sockets[BD3WS_MaxNumberListeners];
+	int connection = -1;
+	char acknowledgement = 1;
 
 	memset(buffer, 0, sizeof(buffer));
-	memset(request, 0, sizeof(request));
-
-	// Attempt to receive a client request.
-	if (-1 != recv(server.clients[client].socket, request, BD3WS_MaxLengthData, 0))
-	{
-		// Print client request.
-		strcat(buffer, "\n===========================================================\n");
-		strcat(buffer, "\t\t\tClient Request Header: ");
-		strcat(buffer, "\n===========================================================\n");
-		sprintf((buffer + strlen(buffer)), "%s\n", request);
-		strcat(buffer, "\n===========================================================\n");
-		log(buffer, NONE);
-		//
+	memset(&address, 0, sizeof(address));
 
-		token = strtok(request, "\n");
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, upgrade_socket, sizeof(address.sun_path) - 1);
 
-		// Isolate string containing file path.
-		while (NULL != token)
+	if (-1 == (connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+		|| -1 == connect(connection, (struct sockaddr*)&address, sizeof(address))
+		|| 0 >= (server.number_listeners = receive_sockets(connection, sockets, BD3WS_MaxNumberListeners))
+		|| 1 != send(connection, &acknowledgement, 1, 0))
+	{
+		sprintf(buffer, "Cannot receive listening sockets from previous process!\n");
+		log(buffer, STDERR);
+		if (-1 != connection)
 		{
-			// Isolate line containing file path.
-			if (NULL != strstr(token, "GET"))
-			{
-				strcpy(line_file, token);
-			}
-			//
-
-			// Isolate line containing content type.
-			else if (NULL != strstr(token, "Accept:"))
-			{
-				strcpy(line_type, token);
-			}
-			//
-
-			token = strtok(NULL, "\n");
+			close(connection);
 		}
-		//
-
-		// Grab the file path piece of the request.
-		token = strtok(line_file, " ");
-		token = strtok(NULL, " ");
-		//
-
-		// Copy requested file path for output parameter.
-		strcpy(file_path, token);
-		//
+		finalize(1);
+	}
 
-		// Grab the content type piece of the request.
-		token = strtok(line_type, " ");
-		token = strtok(NULL, " ");
-		strcpy(line_type, token);
-		token = strtok(line_type, ",");
-		//
+	close(connection);
 
-		// Copy requested content type for output parameter.
-		strcpy(content_type, token);
-		//
+	// Adopt the listening sockets; their addresses are recovered by extract_connection_information().
+	for (int i = 0; i < server.number_listeners; ++i)
+	{
+		server.listeners[i].socket = sockets[i];
 	}
 	//
+
+	sprintf(buffer, "Received %d listening socket(s) from previous process.\n", server.number_listeners);
+	log(buffer, STDOUT);
 }
 
 /******************************************************************************
-	send_server_response: Sends server response to client request. This 
-involves checking the requested file for existence and validity, building an 
-HTTP response header, filling the response body, and sending it through the 
-client connection.
+	send_sockets: Passes socket descriptors over a Unix socket connection as 
+SCM_RIGHTS ancillary data. Returns 0 on success, or -1 on failure.
 ******************************************************************************/
-void send_server_response(int client, const char* file_name, const char* content_type)
+int send_sockets(int connection, int* sockets, int count)
 {
-	FILE* file_handle = NULL;
-	struct stat file_stat;
-	char file_path[BD3WS_MaxLengthData];
-	char buffer[BD3WS_MaxLengthData];
-	char response_header[BD3WS_MaxLengthData];
-	int bytes_read = 0;
+	char control[CMSG_SPACE(sizeof(int) * BD3WS_MaxNumberListeners)];
+	struct msghdr message;
+	struct cmsghdr* control_message = NULL;
+	struct iovec payload;
+	char marker = (char)count;
 
-	BD3WS_HTTPResponseState response_state;
+	if (0 >= count || BD3WS_MaxNumberListeners < count)
+	{
+		return -1;
+	}
 
-	memset(buffer, 0, sizeof(buffer));
-	memset(response_header, 0, sizeof(response_header));
+	memset(control, 0, sizeof(control));
+	memset(&message, 0, sizeof(message));
 
-	// Create full file path.
-	strcpy(file_path, BD3WS_PublicDirectory);
-	strcat(file_path, file_name);
+	// At least one byte of ordinary data must accompany the descriptors.
+	payload.iov_base = &marker;
+	payload.iov_len = 1;
+	message.msg_iov = &payload;
+	message.msg_iovlen = 1;
 	//
 
-	stat(file_path, &file_stat);
+	message.msg_control = control;
+	message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+	control_message = CMSG_FIRSTHDR(&message);
+	control_message->cmsg_level = SOL_SOCKET;
+	control_message->cmsg_type = SCM_RIGHTS;
+	control_message->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(control_message), sockets, sizeof(int) * count);
 
-	// If requested file is a directory.
+	return (1 == sendmsg(connection, &message, 0)) ? 0 : -1;
+}
+
+/******************************************************************************
+	receive_sockets: Receives socket descriptors passed by send_sockets(). 
+Returns the number of descriptors received, or -1 on failure.
+******************************************************************************/
+int receive_sockets(int connection, int* sockets, int capacity)
+{
+	char control[CMSG_SPACE(sizeof(int) * BD3WS_MaxNumberListeners)];
+	struct msghdr message;
+	struct cmsghdr* control_message = NULL;
+	struct iovec payload;
+	char marker = 0;
+	int count = 0;
+
+	memset(control, 0, sizeof(control));
+	memset(&message, 0, sizeof(message));
+
+	payload.iov_base = &marker;
+	payload.iov_len = 1;
+	message.msg_iov = &payload;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	if (1 != recvmsg(connection, &message, MSG_CMSG_CLOEXEC))
+	{
+		return -1;
+	}
+
+	control_message = CMSG_FIRSTHDR(&message);
+	if (NULL == control_message || SOL_SOCKET != control_message->cmsg_level || SCM_RIGHTS != control_message->cmsg_type)
+	{
+		return -1;
+	}
+
+	count = (control_message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (count > capacity)
+	{
+		return -1;
+	}
+
+	memcpy(sockets, CMSG_DATA(control_message), sizeof(int) * count);
+
+	return count;
+}
+
+/******************************************************************************
+	initialize: Initializes the program by setting up structs and sockets,
+parsing command-line arguments, and listening for client connections.
+******************************************************************************/
+void initialize(int argc, char** argv)
+{
+	char buffer[BD3WS_MaxLengthData];
+	const char* upgrade_socket = getenv(BD3WS_UpgradeEnvironment);
+	struct sigaction action;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	// Open log file, ensuring that its directory exists beforehand. An upgraded binary appends to its predecessor's log.
+	mkdir(BD3WS_LogDirectory, S_IRWXU | S_IRWXG | S_IROTH);
+	log_handle = fopen(BD3WS_Log, (NULL == upgrade_socket) ? "w" : "a");
+	//
+
+	sprintf(buffer, "Initializing...\n");
+	log(buffer, STDOUT);
+
+	// Mark sockets as unopened so that an early finalize() does not close stray descriptors.
+	for (int i = 0; i < BD3WS_MaxNumberListeners; ++i)
+	{
+		server.listeners[i].socket = -1;
+	}
+	for (int i = 0; i < BD3WS_MaxNumberClients; ++i)
+	{
+		server.clients[i].socket = -1;
+	}
+	for (int i = 0; i < BD3WS_MaxNumberWorkers; ++i)
+	{
+		server.workers[i] = -1;
+	}
+	server.drain_timeout = BD3WS_DefaultDrainTimeout;
+	server.socket_options.backlog = BD3WS_DefaultBacklog;
+	server.socket_options.defer_accept = BD3WS_DefaultDeferAccept;
+	server.socket_options.fast_open = BD3WS_DefaultFastOpen;
+	server.socket_options.no_delay = 1;
+	strcpy(server.hosts[0].root, BD3WS_PublicDirectory);
+	strcpy(server.hosts[0].file_http404, BD3WS_FileHTTP404);
+	server.hosts[0].directory = -1;
+	server.number_hosts = 1;
+	set_index_files(BD3WS_DefaultIndexFiles);
+	server.arguments = argv;
+	//
+
+	// Process command-line arguments.
+	process_CLA(argc, argv);
+	//
+
+	// Setup server sockets and bind them to their addresses, or take over the listening sockets of the process being upgraded.
+	if (NULL == upgrade_socket)
+	{
+		setup_socket();
+	}
+	else
+	{
+		receive_listening_sockets(upgrade_socket);
+		unsetenv(BD3WS_UpgradeEnvironment);
+	}
+	//
+
+	// Extract server connection information.
+	extract_connection_information();
+	//
+
+	// Open the document root of each host, which its files are resolved beneath, and serialize its 404 response once so that misses are answered from memory.
+	for (int i = 0; i < server.number_hosts; ++i)
+	{
+		if (-1 == (server.hosts[i].directory = open(server.hosts[i].root, O_PATH | O_DIRECTORY | O_CLOEXEC)))
+		{
+			sprintf(buffer, "Cannot open document root \"%s\"!\n", server.hosts[i].root);
+			log(buffer, STDERR);
+			finalize(1);
+		}
+		load_prepared_response(server.hosts[i].file_http404, NOTFOUND, &(server.hosts[i].not_found));
+
+		if (0 < i)
+		{
+			sprintf(buffer, "Serving host %s from %s\n", server.hosts[i].name, server.hosts[i].root);
+			log(buffer, STDOUT);
+		}
+	}
+	load_prepared_response(BD3WS_FileDefault, OK, &(server.default_page));
+	//
+
+	// Map the content cache before any workers are forked so that all of them share it.
+	cache_initialize();
+	//
+
+	// Build the HPACK Huffman decoding tree.
+	hpack_initialize();
+	//
+
+	// Initialize client occupany states.
+	for (int i = 0; i < BD3WS_MaxNumberClients; ++i)
+	{
+		server.clients[i].occupied = 0;
+	}
+	//
+
+	// Ignore broken pipes.
+	signal(SIGPIPE, SIG_IGN);
+	//
+
+	// Drain on SIGINT/SIGTERM and upgrade on SIGUSR2. SA_RESTART is left unset so that blocking calls are interrupted.
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigemptyset(&(action.sa_mask));
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGUSR2, &action, NULL);
+	//
+
+	// Tune the sockets and begin listening on them.
+	for (int i = 0; i < server.number_listeners; ++i)
+	{
+		tune_listener(&(server.listeners[i]));
+	}
+	//
+}
+
+/******************************************************************************
+	finalize: Performs program shutdown tasks before exiting. The listening 
+socket is closed first so that no new connections are accepted, then 
+in-flight connections are given up to the drain timeout to complete.
+******************************************************************************/
+void finalize(int exit_code)
+{
+	char buffer[BD3WS_MaxLengthData];
+	time_t deadline = 0;
+	int active = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	sprintf(buffer, "Finalizing...\n");
+	log(buffer, STDOUT);
+
+	// Ask long-lived (HTTP/2) connections to wind down as well.
+	shutdown_requested = 1;
+	//
+
+	// Stop accepting new connections, removing Unix socket paths unless they were handed over.
+	for (int i = 0; i < server.number_listeners; ++i)
+	{
+		if (-1 != server.listeners[i].socket)
+		{
+			close(server.listeners[i].socket);
+			server.listeners[i].socket = -1;
+		}
+		if ('\0' != server.listeners[i].unlink_path[0])
+		{
+			unlink(server.listeners[i].unlink_path);
+		}
+	}
+	//
+
+	// Drain in-flight connections.
+	deadline = time(NULL) + server.drain_timeout;
+	if (0 < (active = count_active_clients()))
+	{
+		sprintf(buffer, "Draining %d connection(s)...\n", active);
+		log(buffer, STDOUT);
+	}
+	while (0 < count_active_clients() && time(NULL) < deadline)
+	{
+		usleep(100000);
+	}
+	//
+
+	// Close connection sockets that outlived the drain timeout.
+	for (int i = 0; i < BD3WS_MaxNumberClients; ++i)
+	{
+		if (-1 != server.clients[i].socket)
+		{
+			close(server.clients[i].socket);
+		}
+	}
+	//
+
+	// Close log file.
+	if (NULL != log_handle)
+	{
+		fclose(log_handle);
+	}
+	//
+
+	exit(exit_code);
+}
+
+/******************************************************************************
+	count_active_clients: Counts client connections that are still being 
+served.
+******************************************************************************/
+int count_active_clients()
+{
+	int active = 0;
+
+	for (int i = 0; i < BD3WS_MaxNumberClients; ++i)
+	{
+		if (0 != __atomic_load_n(&(server.clients[i].occupied), __ATOMIC_ACQUIRE))
+		{
+			++active;
+		}
+	}
+
+	return active;
+}
+
+/******************************************************************************
+	process_CLA: Parses program command-line arguments.
+******************************************************************************/
+void process_CLA(int argc, char** argv)
+{
+	char buffer[BD3WS_MaxLengthData];
+	int option = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	// Parse option flags.
+	while (-1 != (option = getopt(argc, argv, "l:w:d:r:R:f:o:v:i:a")))
+	{
+		// Additional listen address (host:port, [host]:port, unix:/path or unix:@abstract).
+		if ('l' == option)
+		{
+			add_listener(optarg);
+		}
+		//
+
+		// Number of prefork worker processes (0 serves from a single process).
+		else if ('w' == option)
+		{
+			server.number_workers = atoi(optarg);
+			if (0 > server.number_workers || BD3WS_MaxNumberWorkers < server.number_workers)
+			{
+				sprintf(buffer, "Number of workers must be between 0 and %d!\n", BD3WS_MaxNumberWorkers);
+				log(buffer, STDERR);
+				finalize(1);
+			}
+		}
+		//
+
+		// Seconds to wait for in-flight connections when shutting down or upgrading.
+		else if ('d' == option)
+		{
+			server.drain_timeout = atoi(optarg);
+		}
+		//
+
+		// Per-connection send rate limit in bytes per second (0 is unlimited).
+		else if ('r' == option)
+		{
+			scheduler.connection_rate = atol(optarg);
+		}
+		//
+
+		// Global (per-process) send rate limit in bytes per second (0 is unlimited).
+		else if ('R' == option)
+		{
+			scheduler.global_rate = atol(optarg);
+		}
+		//
+
+		// FastCGI route (prefix=address).
+		else if ('f' == option)
+		{
+			add_fastcgi_route(optarg);
+		}
+		//
+
+		// Listening socket option (name=value).
+		else if ('o' == option)
+		{
+			set_socket_option(optarg);
+		}
+		//
+
+		// Name-based virtual host (name=directory[,404_page]).
+		else if ('v' == option)
+		{
+			add_virtual_host(optarg);
+		}
+		//
+
+		// Index files of directories, in order of preference (comma-separated).
+		else if ('i' == option)
+		{
+			set_index_files(optarg);
+		}
+		//
+
+		// List the contents of directories without an index file.
+		else if ('a' == option)
+		{
+			server.autoindex = 1;
+		}
+		//
+
+		// Unknown option.
+		else
+		{
+			sprintf(buffer, "Usage: %s [-l address]... [-f prefix=address]... [-o option=value]... [-v name=directory[,404_page]]... [-i index_files] [-a] [-w workers] [-d drain_timeout] [-r connection_rate] [-R global_rate] [address port]\n", argv[0]);
+			log(buffer, STDERR);
+			finalize(1);
+		}
+		//
+	}
+	//
+
+	// Listen on the specified hostname and service.
+	if (2 == argc - optind)
+	{
+		snprintf(buffer, sizeof(buffer), (NULL != strchr(argv[optind], ':')) ? "[%s]:%s" : "%s:%s", argv[optind], argv[optind + 1]);
+		add_listener(buffer);
+	}
+	//
+
+	// Listen on the default hostname and service if nothing else was requested.
+	else if (0 == server.number_listeners)
+	{
+		add_listener(BD3WS_DefaultAddress);
+	}
+	//
+}
+
+/******************************************************************************
+	add_listener: Records a listen address to be bound by setup_socket().
+******************************************************************************/
+void add_listener(const char* address)
+{
+	char buffer[BD3WS_MaxLengthData];
+
+	memset(buffer, 0, sizeof(buffer));
+
+	if (BD3WS_MaxNumberListeners <= server.number_listeners || BD3WS_MaxLengthAddress <= strlen(address))
+	{
+		sprintf(buffer, "Cannot listen on \"%.256s\"! At most %d listen addresses are supported.\n", address, BD3WS_MaxNumberListeners);
+		log(buffer, STDERR);
+		finalize(1);
+	}
+
+	strcpy(server.listeners[server.number_listeners].address, address);
+	++server.number_listeners;
+}
+
+/******************************************************************************
+	set_socket_option: Sets one of the options applied to the listening 
+sockets, given as name=value.
+******************************************************************************/
+void set_socket_option(const char* option)
+{
+	char buffer[BD3WS_MaxLengthData];
+	const char* names[] = { "backlog", "sndbuf", "rcvbuf", "defer_accept", "fastopen", "nodelay" };
+	int* values[] = { &(server.socket_options.backlog), &(server.socket_options.send_buffer), &(server.socket_options.receive_buffer),
+		&(server.socket_options.defer_accept), &(server.socket_options.fast_open), &(server.socket_options.no_delay) };
+	const char* value = strchr(option, '=');
+	int* target = NULL;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	for (int i = 0; NULL != value && i < sizeof(names) / sizeof(names[0]); ++i)
+	{
+		if (strlen(names[i]) == value - option && 0 == strncmp(option, names[i], value - option))
+		{
+			target = values[i];
+		}
+	}
+
+	if (NULL == target || !isdigit((unsigned char)value[1]))
+	{
+		sprintf(buffer, "Invalid socket option \"%.256s\"! Expected name=value, with name one of backlog, sndbuf, rcvbuf, defer_accept, fastopen or nodelay.\n", option);
+		log(buffer, STDERR);
+		finalize(1);
+	}
+
+	*target = atoi(value + 1);
+}
+
+/******************************************************************************
+	add_virtual_host: Records a name-based virtual host, given as 
+name=directory[,404_page], and enters it into the host table. Requests for 
+other names are served by the default host (public/).
+******************************************************************************/
+void add_virtual_host(const char* host)
+{
+	char buffer[BD3WS_MaxLengthData];
+	BD3WS_Host* entry = &(server.hosts[server.number_hosts]);
+	const char* root = strchr(host, '=');
+	const char* page = (NULL == root) ? NULL : strchr(root, ',');
+	unsigned long root_length = (NULL == root) ? 0 : ((NULL == page) ? strlen(root + 1) : page - root - 1);
+	unsigned long slot = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	// Check the host.
+	if (BD3WS_MaxNumberHosts <= server.number_hosts || NULL == root || root == host || sizeof(entry->name) <= root - host
+		|| 0 == root_length || sizeof(entry->root) - 1 <= root_length || (NULL != page && sizeof(entry->file_http404) <= strlen(page + 1)))
+	{
+		sprintf(buffer, "Invalid virtual host \"%.256s\"! Expected name=directory[,404_page], for at most %d hosts.\n", host, BD3WS_MaxNumberHosts - 1);
+		log(buffer, STDERR);
+		finalize(1);
+	}
+	//
+
+	// Fill in the host: a lowercase name, a document root ending in a separator, and its 404 page.
+	for (int i = 0; i < root - host; ++i)
+	{
+		entry->name[i] = tolower((unsigned char)host[i]);
+	}
+	entry->name[root - host] = '\0';
+	sprintf(entry->root, "%.*s%s", (int)root_length, root + 1, ('/' == root[root_length]) ? "" : "/");
+	strcpy(entry->file_http404, (NULL == page) ? BD3WS_FileHTTP404 : page + 1);
+	entry->directory = -1;
+	//
+
+	// Enter it into the host table (open addressing; the table is twice the maximum number of hosts).
+	for (slot = cache_hash(entry->name) % BD3WS_HostTableSize; 0 != server.host_table[slot]; slot = (slot + 1) % BD3WS_HostTableSize)
+	{
+		if (0 == strcmp(entry->name, server.hosts[server.host_table[slot]].name))
+		{
+			sprintf(buffer, "Virtual host \"%s\" is given more than once!\n", entry->name);
+			log(buffer, STDERR);
+			finalize(1);
+		}
+	}
+	server.host_table[slot] = server.number_hosts;
+	++server.number_hosts;
+	//
+}
+
+/******************************************************************************
+	set_index_files: Sets the (comma-separated) names of the files serving 
+requests for directories, in order of preference.
+******************************************************************************/
+void set_index_files(const char* index_files)
+{
+	char buffer[BD3WS_MaxLengthData];
+	const char* name = index_files;
+	unsigned long length = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	for (server.number_index_files = 0; '\0' != *name; name += length + (',' == name[length]))
+	{
+		length = strcspn(name, ",");
+		if (0 == length)
+		{
+			continue;
+		}
+
+		if (BD3WS_MaxNumberIndexFiles <= server.number_index_files || BD3WS_MaxLengthIndexFile <= length || NULL != memchr(name, '/', length))
+		{
+			sprintf(buffer, "Invalid index files \"%.256s\"! At most %d names (of %d characters, without '/') are supported.\n", index_files, BD3WS_MaxNumberIndexFiles, BD3WS_MaxLengthIndexFile - 1);
+			log(buffer, STDERR);
+			finalize(1);
+		}
+
+		sprintf(server.index_files[server.number_index_files++], "%.*s", (int)length, name);
+	}
+}
+
+/******************************************************************************
+	find_host: Looks up the virtual host serving a Host header value (or 
+HTTP/2 authority), ignoring case, the port and a trailing dot. Returns the 
+default host if no virtual host has the name.
+******************************************************************************/
+BD3WS_Host* find_host(const char* host)
+{
+	char name[BD3WS_MaxLengthAddress];
+	unsigned long length = ('[' == host[0]) ? strcspn(host, "]") + (']' == host[strcspn(host, "]")]) : strcspn(host, ":");
+	unsigned long slot = 0;
+
+	if (1 == server.number_hosts || sizeof(name) <= length)
+	{
+		return &(server.hosts[0]);
+	}
+
+	// Normalize the name.
+	for (int i = 0; i < length; ++i)
+	{
+		name[i] = tolower((unsigned char)host[i]);
+	}
+	if (0 < length && '.' == name[length - 1])
+	{
+		--length;
+	}
+	name[length] = '\0';
+	//
+
+	for (slot = cache_hash(name) % BD3WS_HostTableSize; 0 != server.host_table[slot]; slot = (slot + 1) % BD3WS_HostTableSize)
+	{
+		if (0 == strcmp(name, server.hosts[server.host_table[slot]].name))
+		{
+			return &(server.hosts[server.host_table[slot]]);
+		}
+	}
+
+	return &(server.hosts[0]);
+}
+
+/******************************************************************************
+	resolve_address: Translates a textual address into a socket address. 
+Accepts "unix:/path" for a Unix domain socket, "unix:@name" for a socket in 
+the abstract namespace, and "host:port" or "[host]:port" for TCP. Passive 
+addresses are suitable for bind(). Returns 0 on success, or -1 on failure.
+******************************************************************************/
+int resolve_address(const char* address, int passive, struct sockaddr_storage* storage, socklen_t* size)
+{
+	char host[BD3WS_MaxLengthAddress];
+	struct addrinfo hints;
+	struct addrinfo* info = NULL;
+	struct sockaddr_un* unix_address = (struct sockaddr_un*)storage;
+	const char* path = NULL;
+	char* port = NULL;
+	size_t length = 0;
+
+	memset(storage, 0, sizeof(*storage));
+
+	// Unix domain socket; a leading '@' selects the abstract namespace.
+	if (0 == strncmp(address, "unix:", 5))
+	{
+		path = address + 5;
+		length = strlen(path);
+		if (0 == length || sizeof(unix_address->sun_path) <= length)
+		{
+			return -1;
+		}
+
+		unix_address->sun_family = AF_UNIX;
+		memcpy(unix_address->sun_path, path, length);
+		if ('@' == path[0])
+		{
+			unix_address->sun_path[0] = '\0';
+			*size = offsetof(struct sockaddr_un, sun_path) + length;
+		}
+		else
+		{
+			*size = offsetof(struct sockaddr_un, sun_path) + length + 1;
+		}
+		return 0;
+	}
+	//
+
+	// Split TCP address into host and port, removing brackets around IPv6 hosts.
+	if (sizeof(host) <= strlen(address))
+	{
+		return -1;
+	}
+	strcpy(host, address);
+	if (NULL == (port = strrchr(host, ':')))
+	{
+		return -1;
+	}
+	*port++ = '\0';
+	path = host;
+	if ('[' == host[0] && ']' == host[strlen(host) - 1])
+	{
+		host[strlen(host) - 1] = '\0';
+		path = host + 1;
+	}
+	//
+
+	// Return address information for the hostname and service.
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	if (0 != getaddrinfo(('\0' == path[0]) ? NULL : path, port, &hints, &info))
+	{
+		return -1;
+	}
+
+	memcpy(storage, info->ai_addr, info->ai_addrlen);
+	*size = info->ai_addrlen;
+	freeaddrinfo(info);
+	//
+
+	return 0;
+}
+
+/******************************************************************************
+	extract_connection_information: Extracts information pertaining to the 
+server-client connection (server IP address and port, or Unix socket path) 
+for each listening socket.
+******************************************************************************/
+void extract_connection_information()
+{
+	struct sockaddr_storage address;
+	struct sockaddr_un* unix_address = (struct sockaddr_un*)&address;
+	socklen_t address_size = 0;
+	char ip[INET6_ADDRSTRLEN];
+	size_t length = 0;
+
+	for (int i = 0; i < server.number_listeners; ++i)
+	{
+		memset(&address, 0, sizeof(address));
+		memset(ip, 0, sizeof(ip));
+		address_size = sizeof(address);
+
+		// Extract address information from the listening socket, however it was obtained.
+		getsockname(server.listeners[i].socket, (struct sockaddr*)&address, &address_size);
+		//
+
+		// Unix domain socket: abstract names start with a null byte and are not null-terminated.
+		if (AF_UNIX == address.ss_family)
+		{
+			length = address_size - offsetof(struct sockaddr_un, sun_path);
+			if (0 < length && '\0' == unix_address->sun_path[0])
+			{
+				snprintf(server.listeners[i].address, BD3WS_MaxLengthAddress, "unix:@%.*s", (int)(length - 1), unix_address->sun_path + 1);
+			}
+			else
+			{
+				snprintf(server.listeners[i].address, BD3WS_MaxLengthAddress, "unix:%s", unix_address->sun_path);
+				strcpy(server.listeners[i].unlink_path, unix_address->sun_path);
+			}
+		}
+		//
+
+		// IPv6.
+		else if (AF_INET6 == address.ss_family)
+		{
+			inet_ntop(AF_INET6, &(((struct sockaddr_in6*)&address)->sin6_addr), ip, sizeof(ip));
+			snprintf(server.listeners[i].address, BD3WS_MaxLengthAddress, "[%s]:%hu", ip, ntohs(((struct sockaddr_in6*)&address)->sin6_port));
+		}
+		//
+
+		// IPv4.
+		else
+		{
+			inet_ntop(AF_INET, &(((struct sockaddr_in*)&address)->sin_addr), ip, sizeof(ip));
+			snprintf(server.listeners[i].address, BD3WS_MaxLengthAddress, "%s:%hu", ip, ntohs(((struct sockaddr_in*)&address)->sin_port));
+		}
+		//
+	}
+}
+
+/******************************************************************************
+	setup_socket: Establishes server socket/address pairings to prepare the 
+server to listen for incoming client connections. Listening sockets are 
+non-blocking so that a worker which loses an accept() race simply moves on.
+******************************************************************************/
+void setup_socket()
+{
+	char buffer[BD3WS_MaxLengthData];
+	struct sockaddr_storage address;
+	struct stat socket_stat;
+	socklen_t address_size = 0;
+	BD3WS_Listener* listener = NULL;
+	int optval = 1;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	for (int i = 0; i < server.number_listeners; ++i)
+	{
+		listener = &(server.listeners[i]);
+
+		// Return address information for the listen address.
+		if (-1 == resolve_address(listener->address, 1, &address, &address_size))
+		{
+			sprintf(buffer, "Cannot get address information for \"%s\"!\n", listener->address);
+			log(buffer, STDERR);
+			finalize(1);
+		}
+		//
+
+		// Get a server socket descriptor.
+		if (0 > (listener->socket = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)))
+		{
+			sprintf(buffer, "Invalid server socket descriptor!\n");
+			log(buffer, STDERR);
+			finalize(1);
+		}
+		//
+
+		// Set socket options, or remove a stale Unix socket left behind by an unclean exit.
+		if (AF_UNIX != address.ss_family)
+		{
+			setsockopt(listener->socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+		}
+		else if ('\0' != ((struct sockaddr_un*)&address)->sun_path[0] && 0 == stat(((struct sockaddr_un*)&address)->sun_path, &socket_stat) && S_ISSOCK(socket_stat.st_mode))
+		{
+			unlink(((struct sockaddr_un*)&address)->sun_path);
+		}
+		//
+
+		// Associate socket with address.
+		if (-1 == bind(listener->socket, (struct sockaddr*)&address, address_size))
+		{
+			sprintf(buffer, "Cannot bind to socket \"%s\"!\n", listener->address);
+			log(buffer, STDERR);
+			finalize(1);
+		}
+		//
+	}
+}
+
+/******************************************************************************
+	tune_listener: Applies the socket options to a listening socket and starts 
+listening on it, logging the values the kernel put into effect. TCP options 
+are set on the listening socket so that accepted connections inherit them 
+without further calls; the buffer sizes are set before listen() so that they 
+shape the advertised window scale.
+******************************************************************************/
+void tune_listener(BD3WS_Listener* listener)
+{
+	char buffer[BD3WS_MaxLengthData];
+	BD3WS_SocketOptions* options = &(server.socket_options);
+	struct sockaddr_storage address;
+	socklen_t address_size = sizeof(address);
+	socklen_t size = sizeof(int);
+	FILE* sysctl = NULL;
+	int backlog = options->backlog;
+	int maximum = 0;
+	int fast_open_mode = 2;
+	int send_buffer = 0;
+	int receive_buffer = 0;
+	int defer_accept = 0;
+	int fast_open = 0;
+	int no_delay = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	memset(&address, 0, sizeof(address));
+
+	getsockname(listener->socket, (struct sockaddr*)&address, &address_size);
+
+	// The kernel silently caps the backlog at net.core.somaxconn.
+	if (NULL != (sysctl = fopen("/proc/sys/net/core/somaxconn", "r")))
+	{
+		if (1 == fscanf(sysctl, "%d", &maximum) && 0 < maximum && maximum < backlog)
+		{
+			backlog = maximum;
+		}
+		fclose(sysctl);
+	}
+	//
+
+	// TCP options: hold connections back until the client has sent data, let returning clients send their request in the SYN, and send small writes immediately.
+	if (AF_UNIX != address.ss_family)
+	{
+		if (0 < options->send_buffer)
+		{
+			setsockopt(listener->socket, SOL_SOCKET, SO_SNDBUF, &(options->send_buffer), sizeof(int));
+		}
+		if (0 < options->receive_buffer)
+		{
+			setsockopt(listener->socket, SOL_SOCKET, SO_RCVBUF, &(options->receive_buffer), sizeof(int));
+		}
+		setsockopt(listener->socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &(options->defer_accept), sizeof(int));
+		setsockopt(listener->socket, IPPROTO_TCP, TCP_FASTOPEN, &(options->fast_open), sizeof(int));
+		setsockopt(listener->socket, IPPROTO_TCP, TCP_NODELAY, &(options->no_delay), sizeof(int));
+	}
+	//
+
+	// Begin listening on the socket (again, for sockets taken over from an upgraded process).
+	if (-1 == listen(listener->socket, backlog))
+	{
+		sprintf(buffer, "Cannot listen on socket \"%s\"!\n", listener->address);
+		log(buffer, STDERR);
+		finalize(1);
+	}
+	//
+
+	// Report the values in effect.
+	if (AF_UNIX == address.ss_family)
+	{
+		sprintf(buffer, "Listening on %s (backlog %d)\n", listener->address, backlog);
+	}
+	else
+	{
+		getsockopt(listener->socket, SOL_SOCKET, SO_SNDBUF, &send_buffer, &size);
+		getsockopt(listener->socket, SOL_SOCKET, SO_RCVBUF, &receive_buffer, &size);
+		getsockopt(listener->socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, &size);
+		getsockopt(listener->socket, IPPROTO_TCP, TCP_FASTOPEN, &fast_open, &size);
+		getsockopt(listener->socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, &size);
+
+		// Server-side Fast Open also has to be enabled system-wide (net.ipv4.tcp_fastopen bit 2).
+		if (NULL != (sysctl = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r")))
+		{
+			fscanf(sysctl, "%i", &fast_open_mode);
+			fclose(sysctl);
+		}
+		//
+
+		sprintf(buffer, "Listening on %s (backlog %d, sndbuf %d, rcvbuf %d, defer_accept %ds, fastopen %d%s, nodelay %s)\n", listener->address, backlog,
+			send_buffer, receive_buffer, defer_accept, fast_open, (0 < fast_open && 0 == (fast_open_mode & 2)) ? " (inactive, net.ipv4.tcp_fastopen lacks server support)" : "", no_delay ? "on" : "off");
+	}
+	log(buffer, STDOUT);
+	//
+}
+
+/******************************************************************************
+	accept_client: Waits on client requests on any listening socket and sets 
+up server-client connections upon receiving them. The wait is bounded so that 
+the caller can notice control signals. Connection sockets are created 
+non-blocking and close-on-exec by accept4() itself.
+******************************************************************************/
+int accept_client()
+{
+	char buffer[BD3WS_MaxLengthData];
+	struct pollfd listener_polls[BD3WS_MaxNumberListeners];
+	int i = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	// Wait for a pending connection on any listening socket.
+	for (int listener = 0; listener < server.number_listeners; ++listener)
+	{
+		listener_polls[listener].fd = server.listeners[listener].socket;
+		listener_polls[listener].events = POLLIN;
+		listener_polls[listener].revents = 0;
+	}
+
+	if (0 >= poll(listener_polls, server.number_listeners, 1000))
+	{
+		return -1;
+	}
+	//
+
+	// Get a connection socket descriptor.
+	for (i = 0; i < BD3WS_MaxNumberClients; ++i)
+	{
+		// Find vacant client.
+		if (0 == server.clients[i].occupied)
+		{
+			// Secure client structure.
+			server.clients[i].occupied = 1;
+			//
+
+			// Accept from the first listening socket with a pending connection.
+			for (int listener = 0; listener < server.number_listeners; ++listener)
+			{
+				if (0 == (listener_polls[listener].revents & POLLIN))
+				{
+					continue;
+				}
+
+				server.clients[i].address_size = sizeof(server.clients[i].address_storage);
+				if (-1 == (server.clients[i].socket = accept4(listener_polls[listener].fd, (struct sockaddr *)&(server.clients[i].address_storage), &(server.clients[i].address_size), SOCK_NONBLOCK | SOCK_CLOEXEC)))
+				{
+					// Another worker may have taken the connection, and an interrupted accept() is not an error.
+					if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+					{
+						sprintf(buffer, "Invalid connection socket descriptor!\n");
+						log(buffer, STDERR);
+					}
+					continue;
+					//
+				}
+
+				// Indicate successful client acceptance and return newly-occupied index.
+				sprintf(buffer, "Accepted connection request from client on %s.\n", server.listeners[listener].address);
+				log(buffer, STDOUT);
+				return i;
+				//
+			}
+			//
+
+			// Nothing accepted; vacate the client structure again.
+			server.clients[i].occupied = 0;
+			return -1;
+			//
+		}
+		//
+	}
+	//
+
+	// All client structures are occupied; back off briefly rather than spinning on the pending connection.
+	usleep(10000);
+	return -1;
+	//
+}
+
+/******************************************************************************
+	handle_client_request: Upon receiving a client request, the server spawns 
+a thread. The thread's main task is to execute this function, which parses 
+incoming client requests and responds to them accordingly. Before returning, 
+connection sockets are closed and client structures are vacated for future 
+tasks.
+******************************************************************************/
+void* handle_client_request(void* client)
+{
+	BD3WS_Request request;
+	BD3WS_FastCGIRoute* route = NULL;
+	char upgrade[BD3WS_MaxLengthData];
+
+	memset(&request, 0, sizeof(request));
+	memset(upgrade, 0, sizeof(upgrade));
+
+	// Receive file data request from client.
+	parse_client_request((int)client, &request);
+	//
+
+	// Serve HTTP/2 connections, known either by their preface (which parses as a "PRI" request) or by a bodiless request to upgrade.
+	if (0 == strcmp(request.method, "PRI") && 0 == strcmp(request.version, "HTTP/2.0"))
+	{
+		serve_http2((int)client, &request, 0);
+	}
+	else if (0 == strcmp(request.version, "HTTP/1.1") && 0 == request.content_length && get_request_header(&request, "Upgrade", upgrade, sizeof(upgrade))
+		&& NULL != strcasestr(upgrade, "h2c") && get_request_header(&request, "HTTP2-Settings", upgrade, sizeof(upgrade)))
+	{
+		serve_http2((int)client, &request, 1);
+	}
+	//
+
+	// Forward requests on dynamic routes to their FastCGI upstream, and send requested file data for everything else. 
+	// Once handed to the send scheduler, the connection is no longer ours to close.
+	else if (NULL != (route = find_fastcgi_route(request.path)))
+	{
+		if (forward_fastcgi_request((int)client, route, &request))
+		{
+			return NULL;
+		}
+	}
+	else if (send_server_response((int)client, find_host(request.host), request.path, request.accept))
+	{
+		return NULL;
+	}
+	//
+
+	// Close connection socket.
+	if (-1 != server.clients[(int)client].socket)
+	{
+		close(server.clients[(int)client].socket);
+		server.clients[(int)client].socket = -1;
+	}
+	//
+
+	// Vacate client.
+	__atomic_store_n(&(server.clients[(int)client].occupied), 0, __ATOMIC_RELEASE);
+	//
+
+	return NULL;
+}
+
+/******************************************************************************
+	parse_client_request: Parses incoming client request to determine an
+appropriate server response. The request line is split into method, path, 
+query and version; the remaining header lines are kept for later lookup, and 
+any bytes following the header block are the start of the request body.
+******************************************************************************/
+void parse_client_request(int client, BD3WS_Request* request)
+{
+	char buffer[BD3WS_MaxLengthData];
+	char target[BD3WS_MaxLengthData];
+	char content_length[32];
+	char* line_end = NULL;
+	char* headers_end = NULL;
+	char* token = NULL;
+	ssize_t received = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	memset(target, 0, sizeof(target));
+	memset(content_length, 0, sizeof(content_length));
+
+	strcpy(request->path, "/");
+	strcpy(request->method, "GET");
+	strcpy(request->version, "HTTP/1.0");
+	request->body = request->data;
+
+	// Attempt to receive a client request.
+	if (0 < (received = receive_client(server.clients[client].socket, request->data, BD3WS_MaxLengthData - 1)))
+	{
+		// Separate the header block from the start of the request body.
+		if (NULL != (headers_end = strstr(request->data, "\r\n\r\n")))
+		{
+			request->body = headers_end + 4;
+		}
+		else if (NULL != (headers_end = strstr(request->data, "\n\n")))
+		{
+			request->body = headers_end + 2;
+		}
+		else
+		{
+			headers_end = request->data + strlen(request->data);
+			request->body = request->data + received;
+		}
+		request->body_received = request->data + received - request->body;
+		*headers_end = '\0';
+		//
+
+		// Print client request.
+		strcat(buffer, "\n===========================================================\n");
+		strcat(buffer, "\t\t\tClient Request Header: ");
+		strcat(buffer, "\n===========================================================\n");
+		sprintf((buffer + strlen(buffer)), "%.1800s\n", request->data);
+		strcat(buffer, "\n===========================================================\n");
+		log(buffer, NONE);
+		//
+
+		// Isolate the request line; the header lines follow it.
+		if (NULL != (line_end = strchr(request->data, '\n')))
+		{
+			strcpy(request->headers, line_end + 1);
+			*line_end = '\0';
+		}
+		//
+
+		// Grab the method, target and version pieces of the request line.
+		sscanf(request->data, "%15s %2047s %15s", request->method, target, request->version);
+		if (NULL != (token = strchr(target, '?')))
+		{
+			*token = '\0';
+			strcpy(request->query, token + 1);
+		}
+		if ('\0' != target[0])
+		{
+			strcpy(request->path, target);
+		}
+		//
+
+		// Grab the host name, for virtual hosting.
+		get_request_header(request, "Host", request->host, sizeof(request->host));
+		//
+
+		// Grab the media types the client accepts, for content negotiation.
+		get_request_header(request, "Accept", request->accept, sizeof(request->accept));
+		//
+
+		// Grab the request body length.
+		if (get_request_header(request, "Content-Length", content_length, sizeof(content_length)))
+		{
+			request->content_length = atol(content_length);
+		}
+		//
+	}
+	//
+}
+
+/******************************************************************************
+	get_request_header: Looks up a request header by (case-insensitive) name 
+and copies its value, without surrounding whitespace. Returns 1 if the header 
+was found, or 0 otherwise.
+******************************************************************************/
+int get_request_header(BD3WS_Request* request, const char* name, char* value, unsigned long size)
+{
+	unsigned long name_length = strlen(name);
+	unsigned long value_length = 0;
+	const char* line = request->headers;
+	const char* line_end = NULL;
+
+	while ('\0' != *line)
+	{
+		if (NULL == (line_end = strchr(line, '\n')))
+		{
+			line_end = line + strlen(line);
+		}
+
+		// Match "Name:" at the start of the line and trim the value.
+		if (0 == strncasecmp(line, name, name_length) && ':' == line[name_length])
+		{
+			line += name_length + 1;
+			while (line < line_end && (' ' == *line || '\t' == *line))
+			{
+				++line;
+			}
+
+			value_length = line_end - line;
+			while (0 < value_length && ('\r' == line[value_length - 1] || ' ' == line[value_length - 1] || '\t' == line[value_length - 1]))
+			{
+				--value_length;
+			}
+
+			value_length = (value_length < size) ? value_length : size - 1;
+			memcpy(value, line, value_length);
+			value[value_length] = '\0';
+			return 1;
+		}
+		//
+
+		line = ('\0' == *line_end) ? line_end : line_end + 1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+	send_server_response: Sends server response to client request by handing 
+the prepared response to the send scheduler. Returns 1 if the connection was 
+handed to the scheduler, or 0 if the caller still owns it.
+******************************************************************************/
+int send_server_response(int client, BD3WS_Host* host, const char* file_name, const char* accept)
+{
+	BD3WS_Transfer* transfer = calloc(1, sizeof(BD3WS_Transfer));
+
+	if (NULL == transfer || 0 != prepare_server_response(host, file_name, accept, transfer))
+	{
+		free(transfer);
+		return 0;
+	}
+
+	transfer->client = client;
+	schedule_transfer(transfer);
+
+	return 1;
+}
+
+/******************************************************************************
+	prepare_server_response: Prepares the response to a request for a file. 
+This involves resolving the requested path beneath the host's document root, choosing 
+among the file's variants by the Accept header value, building an HTTP 
+response header, and filling in the response body of the (zeroed) transfer. 
+Small files are served from memory (and the content cache); larger ones are 
+streamed from the open file. Missing files are answered with the host's prepared 404 
+response, and remembered for a while in the negative cache. Returns 0 on 
+success, or -1 on failure.
+******************************************************************************/
+int prepare_server_response(BD3WS_Host* host, const char* file_name, const char* accept, BD3WS_Transfer* transfer)
+{
+	struct stat file_stat;
+	BD3WS_VariantSet variants;
+	char file_path[BD3WS_MaxLengthData];
+	char buffer[BD3WS_MaxLengthData];
+	char response_header[BD3WS_MaxLengthData];
+	char* relative_path = file_path + strlen(host->root);
+	char* content = NULL;
+	char* listing = NULL;
+	unsigned long listing_length = 0;
+	long content_length = -1;
+	unsigned long content_read = 0;
+	ssize_t bytes_read = 0;
+	const char* content_type = CONTENT_TEXT_HTML;
+	const char* vary = NULL;
+	int variant = 0;
+	int file = -1;
+
+	memset(&file_stat, 0, sizeof(file_stat));
+	memset(&variants, 0, sizeof(variants));
+	memset(buffer, 0, sizeof(buffer));
+	memset(response_header, 0, sizeof(response_header));
+
+	// Create the full file path from the decoded and normalized request path; malformed paths are not found.
+	strcpy(file_path, host->root);
+	if (-1 == resolve_path(file_name, relative_path, sizeof(file_path) - strlen(host->root) - BD3WS_MaxLengthIndexFile - 1) || negative_lookup(file_path))
+	{
+		return copy_prepared_response(&(host->not_found), transfer);
+	}
+	//
+
+	stat_beneath(host->directory, relative_path, &file_stat);
+
+	// If requested file is a directory, serve its index file, its listing or (for the document root) the default page.
 	if (S_ISDIR(file_stat.st_mode))
 	{
-		strcat(file_path, "/index.html");
-		stat(file_path, &file_stat);
+		if (-1 != resolve_directory(host, file_path, &file_stat, &listing, &listing_length))
+		{
+			stat_beneath(host->directory, relative_path, &file_stat);
+		}
+		else if (NULL != listing)
+		{
+			content = listing;
+			content_length = listing_length;
+			content_type = CONTENT_TEXT_HTML_UTF8;
+			file_stat.st_size = listing_length;
+		}
+		else if ('\0' == relative_path[0])
+		{
+			return copy_prepared_response(&(server.default_page), transfer);
+		}
+	}
+	//
+
+	// Negotiate the representation to serve, switching to the variant's file.
+	if (S_ISREG(file_stat.st_mode))
+	{
+		resolve_variants(host, file_path, &file_stat, &variants);
+		variant = negotiate_variant(accept, &variants);
+		if (0 != variant)
+		{
+			sprintf(strrchr(file_path, '.') + 1, "%s", variants.variants[variant].extension);
+			stat_beneath(host->directory, relative_path, &file_stat);
+		}
+		content_type = variants.variants[variant].content_type;
+		vary = (1 < variants.number_variants) ? "Accept" : NULL;
+	}
+	//
+
+	// Staging buffer for small file content (holds cache hits, and fills up for cache misses).
+	if (-1 == content_length)
+	{
+		content = malloc(BD3WS_CacheMaxLengthEntry);
+	}
+	//
+
+	// Attempt to serve the file from the shared content cache without opening it. An entry only matches the very file 
+	// that was opened beneath the document root when it was stored.
+	if (-1 == content_length && NULL != content && S_ISREG(file_stat.st_mode))
+	{
+		content_length = cache_lookup(file_path, &file_stat, content, BD3WS_CacheMaxLengthEntry);
+	}
+	//
+
+	// Open file beneath the document root.
+	if (-1 == content_length && -1 != (file = open_beneath(host->directory, relative_path, O_RDONLY)) && (0 != fstat(file, &file_stat) || !S_ISREG(file_stat.st_mode)))
+	{
+		close(file);
+		file = -1;
+		errno = EISDIR;
+	}
+	//
+
+	// If the file cannot be served, remember a missing (or escaping) path and serve the prepared 404 response.
+	if (-1 == content_length && -1 == file)
+	{
+		char error_buffer[256];
+		if (ENOENT == errno || ENOTDIR == errno || EXDEV == errno || ELOOP == errno)
+		{
+			negative_store(file_path);
+		}
+		sprintf(buffer, "Cannot serve file: \"%.*s\"! Details: %s\n", BD3WS_MaxLengthAddress, file_path, strerror_r(errno, error_buffer, 256));
+		log(buffer, NONE);
+		free(content);
+		return copy_prepared_response(&(host->not_found), transfer);
+	}
+	//
+
+	// Read small files into memory, publishing them to the content cache.
+	if (-1 != file && NULL != content && BD3WS_CacheMaxLengthEntry >= file_stat.st_size)
+	{
+		while (content_read < file_stat.st_size && 0 < (bytes_read = read(file, content + content_read, file_stat.st_size - content_read)))
+		{
+			content_read += bytes_read;
+		}
+
+		if (file_stat.st_size == content_read)
+		{
+			cache_store(file_path, &file_stat, content, content_read);
+			content_length = content_read;
+			close(file);
+			file = -1;
+		}
+	}
+	//
+
+	build_response_header(&file_stat, content_type, vary, response_header, OK);
+
+	// Fill in the response.
+	if (NULL == (transfer->header = strdup(response_header)) || NULL == (transfer->name = strdup(file_path)))
+	{
+		sprintf(buffer, "Cannot queue response for file \"%.*s\"!\n", BD3WS_MaxLengthAddress, file_path);
+		log(buffer, STDERR);
+		free(transfer->header);
+		transfer->header = NULL;
+		if (-1 != file)
+		{
+			close(file);
+		}
+		free(content);
+		return -1;
+	}
+
+	transfer->header_length = strlen(response_header);
+	transfer->file = -1;
+	if (-1 != content_length)
+	{
+		transfer->content = content;
+		transfer->body_length = content_length;
+	}
+	else
+	{
+		free(content);
+		transfer->file = file;
+		transfer->body_length = file_stat.st_size;
+	}
+	//
+
+	return 0;
+}
+
+/******************************************************************************
+	resolve_path: Translates a request path into a path relative to the 
+document root. Percent-encoded bytes are decoded first; then empty and "." 
+segments are dropped, and ".." segments remove the segment before them without 
+ever climbing above the root. The result has no leading separator, and is 
+empty for the root itself. Returns 0 on success, or -1 if the path is 
+malformed (bad escapes, encoded null bytes) or too long.
+******************************************************************************/
+int resolve_path(const char* target, char* path, unsigned long size)
+{
+	char decoded[BD3WS_MaxLengthData];
+	char digits[3];
+	const char* segment = NULL;
+	unsigned long segment_length = 0;
+	unsigned long length = 0;
+	unsigned long used = 0;
+
+	memset(digits, 0, sizeof(digits));
+
+	// Percent-decode the path.
+	for (; '\0' != *target; ++target)
+	{
+		if (sizeof(decoded) - 1 <= length)
+		{
+			return -1;
+		}
+
+		if ('%' == *target)
+		{
+			if (!isxdigit((unsigned char)target[1]) || !isxdigit((unsigned char)target[2]))
+			{
+				return -1;
+			}
+			digits[0] = target[1];
+			digits[1] = target[2];
+			if ('\0' == (decoded[length] = (char)strtol(digits, NULL, 16)))
+			{
+				return -1;
+			}
+			target += 2;
+		}
+		else
+		{
+			decoded[length] = *target;
+		}
+		++length;
+	}
+	decoded[length] = '\0';
+	//
+
+	// Normalize the segments.
+	path[0] = '\0';
+	for (segment = decoded; '\0' != *segment; segment += segment_length)
+	{
+		segment += strspn(segment, "/");
+		segment_length = strcspn(segment, "/");
+
+		if (0 == segment_length || (1 == segment_length && '.' == segment[0]))
+		{
+			continue;
+		}
+		else if (2 == segment_length && 0 == strncmp(segment, "..", 2))
+		{
+			while (0 < used && '/' != path[--used])
+			{
+			}
+			path[used] = '\0';
+			continue;
+		}
+
+		if (size <= used + segment_length + 2)
+		{
+			return -1;
+		}
+		if (0 < used)
+		{
+			path[used++] = '/';
+		}
+		memcpy(path + used, segment, segment_length);
+		used += segment_length;
+		path[used] = '\0';
+	}
+	//
+
+	return 0;
+}
+
+/******************************************************************************
+	resolve_directory: Resolves a request for a directory (given by its file 
+path) to the first of the index files present in it, appending the name of 
+that file to the path. If there is none and autoindex is on, a copy of the 
+directory's listing is returned instead. Results are cached per process until 
+the directory is modified (which adding or removing an index file does), so 
+that neither the index files nor the directory's entries are looked up again 
+on every request. Returns the index of the index file, or -1 if there is none.
+******************************************************************************/
+int resolve_directory(BD3WS_Host* host, char* file_path, struct stat* directory_stat, char** listing, unsigned long* listing_length)
+{
+	char index_path[BD3WS_MaxLengthData];
+	struct stat index_stat;
+	char* relative_path = file_path + strlen(host->root);
+	char* generated = NULL;
+	unsigned long generated_length = 0;
+	unsigned long hash = cache_hash(file_path);
+	BD3WS_DirectoryEntry* entry = &(directory_cache.entries[hash % BD3WS_DirectoryCacheNumberEntries]);
+	int index = -1;
+	int cached = 0;
+
+	memset(index_path, 0, sizeof(index_path));
+	*listing = NULL;
+	*listing_length = 0;
+
+	// Check the directory cache.
+	pthread_mutex_lock(&(directory_cache.mutex));
+	if (hash == entry->hash && 0 == strcmp(file_path, entry->file_path) && directory_stat->st_dev == entry->device && directory_stat->st_ino == entry->inode
+		&& directory_stat->st_mtim.tv_sec == entry->modified.tv_sec && directory_stat->st_mtim.tv_nsec == entry->modified.tv_nsec)
+	{
+		index = entry->index;
+		cached = 1;
+	}
+	pthread_mutex_unlock(&(directory_cache.mutex));
+	//
+
+	// Otherwise look for the index files, or list the directory.
+	if (!cached)
+	{
+		for (int i = 0; -1 == index && i < server.number_index_files; ++i)
+		{
+			snprintf(index_path, sizeof(index_path), "%s%s%s", relative_path, ('\0' == relative_path[0]) ? "" : "/", server.index_files[i]);
+			if (0 == stat_beneath(host->directory, index_path, &index_stat) && S_ISREG(index_stat.st_mode))
+			{
+				index = i;
+			}
+		}
+
+		if (-1 == index && server.autoindex)
+		{
+			generated = build_directory_listing(host, relative_path, &generated_length);
+		}
+
+		pthread_mutex_lock(&(directory_cache.mutex));
+		free(entry->listing);
+		entry->hash = hash;
+		strcpy(entry->file_path, file_path);
+		entry->device = directory_stat->st_dev;
+		entry->inode = directory_stat->st_ino;
+		entry->modified = directory_stat->st_mtim;
+		entry->index = index;
+		entry->listing = generated;
+		entry->listing_length = generated_length;
+		pthread_mutex_unlock(&(directory_cache.mutex));
+	}
+	//
+
+	// Serve the index file, or a copy of the listing (taken under the lock, since another thread may replace the entry).
+	if (-1 != index)
+	{
+		sprintf(relative_path + strlen(relative_path), "%s%s", ('\0' == relative_path[0]) ? "" : "/", server.index_files[index]);
+	}
+	else
+	{
+		pthread_mutex_lock(&(directory_cache.mutex));
+		if (hash == entry->hash && 0 == strcmp(file_path, entry->file_path) && NULL != entry->listing && NULL != (*listing = malloc(entry->listing_length)))
+		{
+			memcpy(*listing, entry->listing, entry->listing_length);
+			*listing_length = entry->listing_length;
+		}
+		pthread_mutex_unlock(&(directory_cache.mutex));
+	}
+	//
+
+	return index;
+}
+
+/******************************************************************************
+	build_directory_listing: Generates the HTML listing of a directory beneath 
+a host's document root, with links to its entries (hidden ones excepted) in 
+name order. Listings are cut short at BD3WS_MaxLengthListing bytes. Returns 
+the listing, or NULL if the directory cannot be read.
+******************************************************************************/
+char* build_directory_listing(BD3WS_Host* host, const char* relative_path, unsigned long* length)
+{
+	char parent[BD3WS_MaxLengthData];
+	char entry_path[BD3WS_MaxLengthData];
+	DIR* directory = NULL;
+	struct dirent* directory_entry = NULL;
+	struct stat entry_stat;
+	FILE* listing = NULL;
+	char* content = NULL;
+	char** names = NULL;
+	char** grown = NULL;
+	size_t size = 0;
+	unsigned long number_names = 0;
+	unsigned long capacity = 0;
+	int descriptor = open_beneath(host->directory, relative_path, O_RDONLY | O_DIRECTORY);
+	int is_directory = 0;
+
+	memset(parent, 0, sizeof(parent));
+
+	if (-1 == descriptor || NULL == (directory = fdopendir(descriptor)))
+	{
+		if (-1 != descriptor)
+		{
+			close(descriptor);
+		}
+		return NULL;
+	}
+
+	// Collect the names, marking directories with a trailing separator.
+	while (NULL != (directory_entry = readdir(directory)))
+	{
+		if ('.' == directory_entry->d_name[0])
+		{
+			continue;
+		}
+
+		// Symbolic links only count as directories if they resolve beneath the document root.
+		snprintf(entry_path, sizeof(entry_path), "%s%s%s", relative_path, ('\0' == relative_path[0]) ? "" : "/", directory_entry->d_name);
+		is_directory = DT_DIR == directory_entry->d_type || ((DT_UNKNOWN == directory_entry->d_type || DT_LNK == directory_entry->d_type)
+			&& 0 == stat_beneath(host->directory, entry_path, &entry_stat) && S_ISDIR(entry_stat.st_mode));
+		//
+
+		if (number_names == capacity)
+		{
+			capacity = (0 == capacity) ? 64 : 2 * capacity;
+			if (NULL == (grown = realloc(names, capacity * sizeof(char*))))
+			{
+				break;
+			}
+			names = grown;
+		}
+		if (NULL == (names[number_names] = malloc(strlen(directory_entry->d_name) + 2)))
+		{
+			break;
+		}
+		sprintf(names[number_names++], "%s%s", directory_entry->d_name, is_directory ? "/" : "");
+	}
+	closedir(directory);
+
+	qsort(names, number_names, sizeof(char*), compare_listing_names);
+	//
+
+	// Render the listing.
+	if (NULL != (listing = open_memstream(&content, &size)))
+	{
+		fprintf(listing, "<!DOCTYPE html>\n<html>\n<head>\n\t<meta charset=\"utf-8\">\n\t<title>Index of /");
+		write_listing_name(listing, relative_path, 0);
+		fprintf(listing, "%s</title>\n</head>\n<body>\n\t<h1>Index of /", ('\0' == relative_path[0]) ? "" : "/");
+		write_listing_name(listing, relative_path, 0);
+		fprintf(listing, "%s</h1>\n\t<ul>\n", ('\0' == relative_path[0]) ? "" : "/");
+		if ('\0' != relative_path[0])
+		{
+			snprintf(parent, sizeof(parent), "%.*s", (NULL == strrchr(relative_path, '/')) ? 0 : (int)(strrchr(relative_path, '/') - relative_path), relative_path);
+			fprintf(listing, "\t\t<li><a href=\"/");
+			write_listing_name(listing, parent, 1);
+			fprintf(listing, "%s\">../</a></li>\n", ('\0' == parent[0]) ? "" : "/");
+		}
+		for (unsigned long i = 0; i < number_names && BD3WS_MaxLengthListing > ftell(listing); ++i)
+		{
+			fprintf(listing, "\t\t<li><a href=\"/");
+			if ('\0' != relative_path[0])
+			{
+				write_listing_name(listing, relative_path, 1);
+				fprintf(listing, "/");
+			}
+			write_listing_name(listing, names[i], 1);
+			fprintf(listing, "\">");
+			write_listing_name(listing, names[i], 0);
+			fprintf(listing, "</a></li>\n");
+		}
+		fprintf(listing, "\t</ul>\n</body>\n</html>\n");
+		fclose(listing);
+	}
+	//
+
+	for (unsigned long i = 0; i < number_names; ++i)
+	{
+		free(names[i]);
+	}
+	free(names);
+
+	*length = (NULL == content) ? 0 : size;
+	return content;
+}
+
+/******************************************************************************
+	write_listing_name: Writes a name into a directory listing, either 
+percent-encoded for a link or with HTML special characters escaped.
+******************************************************************************/
+void write_listing_name(FILE* listing, const char* name, int link)
+{
+	for (; '\0' != *name; ++name)
+	{
+		if (link && !isalnum((unsigned char)*name) && NULL == strchr("/-._~", *name))
+		{
+			fprintf(listing, "%%%02X", (unsigned char)*name);
+		}
+		else if (!link && '&' == *name)
+		{
+			fprintf(listing, "&amp;");
+		}
+		else if (!link && '<' == *name)
+		{
+			fprintf(listing, "&lt;");
+		}
+		else if (!link && '>' == *name)
+		{
+			fprintf(listing, "&gt;");
+		}
+		else if (!link && '"' == *name)
+		{
+			fprintf(listing, "&quot;");
+		}
+		else
+		{
+			fputc(*name, listing);
+		}
+	}
+}
+
+/******************************************************************************
+	compare_listing_names: Orders directory listing names for qsort().
+******************************************************************************/
+int compare_listing_names(const void* first, const void* second)
+{
+	return strcmp(*(char* const*)first, *(char* const*)second);
+}
+
+/******************************************************************************
+	open_beneath: Opens a path relative to a directory with openat2(), whose 
+RESOLVE_BENEATH refuses any resolution (through ".." or symbolic links) that 
+leaves the directory. Kernels without openat2() fall back on openat(); paths 
+from resolve_path() can then only leave the directory through symbolic links. 
+Returns the file descriptor, or -1 on failure.
+******************************************************************************/
+int open_beneath(int directory, const char* path, int flags)
+{
+	static int unsupported = 0;
+	struct open_how how;
+	int file = -1;
+
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+	if ('\0' == path[0])
+	{
+		path = ".";
+	}
+
+	if (!unsupported)
+	{
+		if (-1 != (file = syscall(SYS_openat2, directory, path, &how, sizeof(how))) || ENOSYS != errno)
+		{
+			return file;
+		}
+		unsupported = 1;
+	}
+
+	return openat(directory, path, flags | O_CLOEXEC);
+}
+
+/******************************************************************************
+	stat_beneath: Gets the status of a path relative to a directory through a 
+descriptor from open_beneath(), so that nothing is disclosed about files 
+outside the directory (not even whether they exist). Returns 0 on success, or 
+-1 on failure.
+******************************************************************************/
+int stat_beneath(int directory, const char* path, struct stat* file_stat)
+{
+	int file = -1;
+	int status = -1;
+
+	if (-1 != (file = open_beneath(directory, path, O_PATH)))
+	{
+		status = fstat(file, file_stat);
+		close(file);
+	}
+
+	return status;
+}
+
+/******************************************************************************
+	negative_lookup: Checks the negative cache for a path found missing less 
+than BD3WS_NegativeCacheLifetime seconds ago. Returns 1 if it is known to be 
+missing, or 0 otherwise.
+******************************************************************************/
+int negative_lookup(const char* file_path)
+{
+	unsigned long hash = cache_hash(file_path);
+	BD3WS_NegativeEntry* entry = &(negative_cache.entries[hash % BD3WS_NegativeCacheNumberEntries]);
+	int missing = 0;
+
+	pthread_mutex_lock(&(negative_cache.mutex));
+	missing = hash == entry->hash && time(NULL) < entry->expires && 0 == strcmp(file_path, entry->file_path);
+	pthread_mutex_unlock(&(negative_cache.mutex));
+
+	return missing;
+}
+
+/******************************************************************************
+	negative_store: Records a missing path in the negative cache, replacing 
+whichever path shared its entry. Overly long paths are not recorded.
+******************************************************************************/
+void negative_store(const char* file_path)
+{
+	unsigned long hash = cache_hash(file_path);
+	BD3WS_NegativeEntry* entry = &(negative_cache.entries[hash % BD3WS_NegativeCacheNumberEntries]);
+
+	if (sizeof(entry->file_path) <= strlen(file_path))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&(negative_cache.mutex));
+	entry->hash = hash;
+	entry->expires = time(NULL) + BD3WS_NegativeCacheLifetime;
+	strcpy(entry->file_path, file_path);
+	pthread_mutex_unlock(&(negative_cache.mutex));
+}
+
+/******************************************************************************
+	load_prepared_response: Reads a page and serializes the complete response 
+serving it (header and body). A missing page leaves the body empty.
+******************************************************************************/
+void load_prepared_response(const char* file_path, BD3WS_HTTPResponseState response_state, BD3WS_PreparedResponse* response)
+{
+	char response_header[BD3WS_MaxLengthData];
+	struct stat file_stat;
+	unsigned long content_read = 0;
+	ssize_t bytes_read = 0;
+	int file = -1;
+
+	memset(response_header, 0, sizeof(response_header));
+	memset(&file_stat, 0, sizeof(file_stat));
+	memset(response, 0, sizeof(BD3WS_PreparedResponse));
+
+	// Read the page.
+	if (-1 != (file = open(file_path, O_RDONLY | O_CLOEXEC)) && 0 == fstat(file, &file_stat) && NULL != (response->content = malloc(file_stat.st_size + 1)))
+	{
+		while (content_read < file_stat.st_size && 0 < (bytes_read = read(file, response->content + content_read, file_stat.st_size - content_read)))
+		{
+			content_read += bytes_read;
+		}
+	}
+	if (-1 != file)
+	{
+		close(file);
+	}
+	file_stat.st_size = content_read;
+	//
+
+	build_response_header(&file_stat, CONTENT_TEXT_HTML, NULL, response_header, response_state);
+
+	response->name = strdup(file_path);
+	response->header = strdup(response_header);
+	response->header_length = strlen(response_header);
+	response->content_length = content_read;
+}
+
+/******************************************************************************
+	copy_prepared_response: Fills in the response of a (zeroed) transfer with 
+a copy of a prepared response. Returns 0 on success, or -1 on failure.
+******************************************************************************/
+int copy_prepared_response(BD3WS_PreparedResponse* response, BD3WS_Transfer* transfer)
+{
+	transfer->file = -1;
+	transfer->header = strdup(response->header);
+	transfer->name = strdup(response->name);
+	transfer->content = (0 < response->content_length) ? malloc(response->content_length) : NULL;
+
+	if (NULL == transfer->header || NULL == transfer->name || (0 < response->content_length && NULL == transfer->content))
+	{
+		free(transfer->header);
+		free(transfer->name);
+		free(transfer->content);
+		transfer->header = NULL;
+		transfer->name = NULL;
+		transfer->content = NULL;
+		return -1;
+	}
+
+	memcpy(transfer->content, response->content, response->content_length);
+	transfer->header_length = response->header_length;
+	transfer->body_length = response->content_length;
+
+	return 0;
+}
+
+/******************************************************************************
+	resolve_variants: Finds the representations of a file: the file itself 
+(variant 0) and, for images, the files next to it with the same name and a 
+variant extension (logo.avif and logo.webp next to logo.png). Alternatives are 
+looked up beneath the host's document root, like the file itself. Resolved sets 
+are cached per process and resolved again once the file or its directory 
+changes.
+******************************************************************************/
+void resolve_variants(BD3WS_Host* host, const char* file_path, struct stat* file_stat, BD3WS_VariantSet* variants)
+{
+	char variant_path[BD3WS_MaxLengthData];
+	char directory[BD3WS_MaxLengthData];
+	struct stat variant_stat;
+	struct stat directory_stat;
+	BD3WS_VariantSet* entry = NULL;
+	BD3WS_Variant* alternative = NULL;
+	const char* relative_path = file_path + strlen(host->root);
+	const char* extension = strrchr(relative_path, '.');
+	const char* slash = strrchr(relative_path, '/');
+	unsigned long hash = cache_hash(file_path);
+
+	memset(variant_path, 0, sizeof(variant_path));
+	memset(directory, 0, sizeof(directory));
+	memset(&directory_stat, 0, sizeof(directory_stat));
+	memset(variants, 0, sizeof(BD3WS_VariantSet));
+
+	// The file itself.
+	variants->number_variants = 1;
+	variants->variants[0].content_type = get_content_type(file_path);
+	variants->variants[0].size = file_stat->st_size;
+	if (NULL == extension || (NULL != slash && extension < slash) || sizeof(variants->variants[0].extension) <= strlen(extension))
+	{
+		return;
+	}
+	strcpy(variants->variants[0].extension, extension + 1);
+	if (0 != strncmp(variants->variants[0].content_type, "image/", 6))
+	{
+		return;
+	}
+	//
+
+	// Directory modification time (adding or removing a variant changes it).
+	if (NULL != slash)
+	{
+		sprintf(directory, "%.*s", (int)(slash - relative_path), relative_path);
+	}
+	stat_beneath(host->directory, directory, &directory_stat);
+	//
+
+	// Check the variant cache.
+	pthread_mutex_lock(&(variant_cache.mutex));
+	for (int i = 0; i < BD3WS_CacheNumberProbes; ++i)
+	{
+		entry = &(variant_cache.sets[(hash + i) % BD3WS_VariantCacheNumberEntries]);
+		if (hash == entry->hash && 0 == strcmp(file_path, entry->file_path)
+			&& file_stat->st_mtim.tv_sec == entry->modified.tv_sec && file_stat->st_mtim.tv_nsec == entry->modified.tv_nsec
+			&& directory_stat.st_mtim.tv_sec == entry->directory_modified.tv_sec && directory_stat.st_mtim.tv_nsec == entry->directory_modified.tv_nsec)
+		{
+			memcpy(variants, entry, sizeof(BD3WS_VariantSet));
+			pthread_mutex_unlock(&(variant_cache.mutex));
+			return;
+		}
+	}
+	pthread_mutex_unlock(&(variant_cache.mutex));
+	//
+
+	// Look for the alternatives next to the file.
+	for (int i = 0; i < sizeof(BD3WS_VariantExtensions) / sizeof(BD3WS_VariantExtensions[0]) && BD3WS_MaxNumberVariants > variants->number_variants; ++i)
+	{
+		sprintf(variant_path, "%.*s.%s", (int)(extension - relative_path), relative_path, BD3WS_VariantExtensions[i]);
+		if (0 != strcasecmp(extension + 1, BD3WS_VariantExtensions[i]) && 0 == stat_beneath(host->directory, variant_path, &variant_stat) && S_ISREG(variant_stat.st_mode))
+		{
+			alternative = &(variants->variants[variants->number_variants++]);
+			strcpy(alternative->extension, BD3WS_VariantExtensions[i]);
+			alternative->content_type = get_content_type(variant_path);
+			alternative->size = variant_stat.st_size;
+		}
+	}
+	//
+
+	// Cache the set, in the first free (or stale) probed entry.
+	variants->hash = hash;
+	strcpy(variants->file_path, file_path);
+	variants->modified = file_stat->st_mtim;
+	variants->directory_modified = directory_stat.st_mtim;
+
+	pthread_mutex_lock(&(variant_cache.mutex));
+	entry = &(variant_cache.sets[hash % BD3WS_VariantCacheNumberEntries]);
+	for (int i = 0; i < BD3WS_CacheNumberProbes; ++i)
+	{
+		BD3WS_VariantSet* candidate = &(variant_cache.sets[(hash + i) % BD3WS_VariantCacheNumberEntries]);
+		if (0 == candidate->number_variants || (hash == candidate->hash && 0 == strcmp(file_path, candidate->file_path)))
+		{
+			entry = candidate;
+			break;
+		}
+	}
+	memcpy(entry, variants, sizeof(BD3WS_VariantSet));
+	pthread_mutex_unlock(&(variant_cache.mutex));
+	//
+}
+
+/******************************************************************************
+	negotiate_variant: Chooses the variant to serve for an Accept header 
+value: the one of highest quality, and the smallest of those. Alternatives are 
+only chosen when their media type is named explicitly, since clients that 
+cannot decode newer image formats still send wildcards; the file itself is 
+served when nothing else is acceptable. Returns the index of the variant.
+******************************************************************************/
+int negotiate_variant(const char* accept, BD3WS_VariantSet* variants)
+{
+	double quality = 0;
+	double best_quality = accept_quality(accept, variants->variants[0].content_type, 0);
+	int best = 0;
+
+	for (int i = 1; i < variants->number_variants; ++i)
+	{
+		quality = accept_quality(accept, variants->variants[i].content_type, 1);
+		if (0 < quality && (quality > best_quality || (quality == best_quality && variants->variants[i].size < variants->variants[best].size)))
+		{
+			best_quality = quality;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/******************************************************************************
+	accept_quality: Returns the quality (q-value) an Accept header value gives 
+a media type, taken from the most specific media range matching it; 1 if the 
+header value is empty, and 0 if no range matches. If exact is set, wildcard 
+ranges do not match.
+******************************************************************************/
+double accept_quality(const char* accept, const char* content_type, int exact)
+{
+	const char* range = accept;
+	const char* range_end = NULL;
+	const char* parameter = NULL;
+	unsigned long type_length = strcspn(content_type, "/");
+	unsigned long length = 0;
+	double quality = 0;
+	double range_quality = 0;
+	int specificity = -1;
+	int range_specificity = 0;
+
+	if ('\0' == accept[0])
+	{
+		return exact ? 0 : 1;
+	}
+
+	for (; '\0' != *range; range = range_end)
+	{
+		// Media range and its q parameter.
+		range += strspn(range, " \t,");
+		range_end = range + strcspn(range, ",");
+		length = strcspn(range, ";, \t");
+		if (0 == length)
+		{
+			continue;
+		}
+
+		range_quality = 1;
+		for (parameter = range + length; parameter < range_end; ++parameter)
+		{
+			if (';' == *parameter)
+			{
+				parameter += 1 + strspn(parameter + 1, " \t");
+				if (('q' == parameter[0] || 'Q' == parameter[0]) && '=' == parameter[1])
+				{
+					range_quality = strtod(parameter + 2, NULL);
+				}
+				--parameter;
+			}
+		}
+		//
+
+		// Specificity of the match: exact, type/* or */*.
+		if (strlen(content_type) == length && 0 == strncasecmp(range, content_type, length))
+		{
+			range_specificity = 2;
+		}
+		else if (!exact && type_length + 2 == length && 0 == strncasecmp(range, content_type, type_length + 1) && '*' == range[type_length + 1])
+		{
+			range_specificity = 1;
+		}
+		else if (!exact && 3 == length && 0 == strncmp(range, "*/*", 3))
+		{
+			range_specificity = 0;
+		}
+		else
+		{
+			range_specificity = -1;
+		}
+
+		if (range_specificity > specificity)
+		{
+			specificity = range_specificity;
+			quality = (1 < range_quality) ? 1 : (0 > range_quality) ? 0 : range_quality;
+		}
+		//
+	}
+
+	return quality;
+}
+
+/******************************************************************************
+	get_content_type: Returns the media type of a file, by its extension.
+******************************************************************************/
+const char* get_content_type(const char* file_path)
+{
+	const char* extension = strrchr(file_path, '.');
+
+	if (NULL == extension || NULL != strchr(extension, '/'))
+	{
+		return CONTENT_APPLICATION_OCTETSTREAM;
+	}
+	++extension;
+
+	// Text
+	if (0 == strcasecmp(extension, "html") || 0 == strcasecmp(extension, "htm"))
+	{
+		return CONTENT_TEXT_HTML;
+	}
+	else if (0 == strcasecmp(extension, "txt"))
+	{
+		return CONTENT_TEXT_PLAIN;
+	}
+	else if (0 == strcasecmp(extension, "css"))
+	{
+		return CONTENT_TEXT_CSS;
+	}
+	else if (0 == strcasecmp(extension, "js"))
+	{
+		return CONTENT_TEXT_JAVASCRIPT;
+	}
+	//
+
+	// Images
+	else if (0 == strcasecmp(extension, "png"))
+	{
+		return CONTENT_IMAGE_PNG;
+	}
+	else if (0 == strcasecmp(extension, "jpg") || 0 == strcasecmp(extension, "jpeg"))
+	{
+		return CONTENT_IMAGE_JPEG;
+	}
+	else if (0 == strcasecmp(extension, "gif"))
+	{
+		return CONTENT_IMAGE_GIF;
+	}
+	else if (0 == strcasecmp(extension, "svg"))
+	{
+		return CONTENT_IMAGE_SVG;
+	}
+	else if (0 == strcasecmp(extension, "webp"))
+	{
+		return CONTENT_IMAGE_WEBP;
+	}
+	else if (0 == strcasecmp(extension, "avif"))
+	{
+		return CONTENT_IMAGE_AVIF;
+	}
+	else if (0 == strcasecmp(extension, "ico"))
+	{
+		return CONTENT_IMAGE_XICON;
+	}
+	//
+
+	// Audio and video (WebM and Ogg files are taken to hold video).
+	else if (0 == strcasecmp(extension, "webm"))
+	{
+		return CONTENT_VIDEO_WEBM;
+	}
+	else if (0 == strcasecmp(extension, "ogv") || 0 == strcasecmp(extension, "ogg"))
+	{
+		return CONTENT_VIDEO_OGG;
+	}
+	else if (0 == strcasecmp(extension, "oga") || 0 == strcasecmp(extension, "opus"))
+	{
+		return CONTENT_AUDIO_OGG;
+	}
+	//
+
+	// Other
+	else if (0 == strcasecmp(extension, "json"))
+	{
+		return CONTENT_APPLICATION_JSON;
+	}
+	//
+
+	return CONTENT_APPLICATION_OCTETSTREAM;
+}
+
+/******************************************************************************
+	build_response_header: Constructs the HTTP response header that will be 
+sent to a client. The Vary field is left out if vary is NULL.
+******************************************************************************/
+void build_response_header(struct stat* file_stat, const char* content_type, const char* vary, char* response_header, BD3WS_HTTPResponseState response_state)
+{
+	char buffer[BD3WS_MaxLengthData];
+
+	memset(buffer, 0, sizeof(buffer));
+
+	build_response_header_state(response_header, response_state);
+
+	strcat(response_header, "\n");
+	strcat(response_header, "Server: ");
+	strcat(response_header, BD3WS_ServerName);
+	strcat(response_header, " v");
+	strcat(response_header, BD3WS_ServerVersion);
+	strcat(response_header, "\n");
+
+	build_response_header_content(file_stat, content_type, vary, response_header);
+
+	strcat(response_header, "\n\n");
+
+	strcat(buffer, "\n===========================================================\n");
+	strcat(buffer, "\t\t\tServer Response Header:");
+	strcat(buffer, "\n===========================================================\n");
+	strcat(buffer, response_header);
+	sprintf((buffer + strlen(buffer)), "\n===========================================================\n");
+	log(buffer, NONE);
+}
+
+/******************************************************************************
+	build_response_header_state: Constructs the HTTP status (200 OK, 404 NOT 
+FOUND, etc.) portion of the server HTTP response header.
+******************************************************************************/
+void build_response_header_state(char* response_header, BD3WS_HTTPResponseState response_state)
+{
+	// Determine HTTP response state of requested file.
+	if (OK == response_state)
+	{
+		strcat(response_header, HTTP_200_OK);
+	}
+	else if (NOTFOUND == response_state)
+	{
+		strcat(response_header, HTTP_404_NOTFOUND);
+	}
+	else if (BADGATEWAY == response_state)
+	{
+		strcat(response_header, HTTP_502_BADGATEWAY);
+	}
+	//
+}
+
+/******************************************************************************
+	build_response_header_content: Constructs the Content fields of the server 
+HTTP response header (Content-Type, Content-Length, etc.), and the Vary field 
+of negotiated responses.
+******************************************************************************/
+void build_response_header_content(struct stat* file_stat, const char* content_type, const char* vary, char* response_header)
+{
+	char file_size[32];
+
+	memset(file_size, 0, sizeof(file_size));
+
+	// Content-Type, with the character set of text documents.
+	strcat(response_header, "Content-Type: ");
+	strcat(response_header, content_type);
+	if (0 == strcmp(CONTENT_TEXT_PLAIN, content_type) || 0 == strcmp(CONTENT_TEXT_HTML, content_type))
+	{
+		// strcat(response_header, ";charset=UTF-8");
+		strcat(response_header, ";charset=Windows-1252");
+	}
+	//
+
+	// Vary
+	if (NULL != vary)
+	{
+		strcat(response_header, "\nVary: ");
+		strcat(response_header, vary);
+	}
+	//
+
+	sprintf(file_size, "%lld", (long long)file_stat->st_size);
+	strcat(response_header, "\nContent-Length: ");
+	strcat(response_header, file_size);
+}
+
+/******************************************************************************
+	build_gateway_error_header: Constructs the complete (bodiless) HTTP 
+response header sent when a FastCGI upstream cannot produce a response.
+******************************************************************************/
+void build_gateway_error_header(char* response_header)
+{
+	build_response_header_state(response_header, BADGATEWAY);
+
+	strcat(response_header, "\n");
+	strcat(response_header, "Server: ");
+	strcat(response_header, BD3WS_ServerName);
+	strcat(response_header, " v");
+	strcat(response_header, BD3WS_ServerVersion);
+	strcat(response_header, "\nContent-Length: 0\nConnection: close\n\n");
+}
+
+/******************************************************************************
+	server_information: Constructs a string describing server program 
+meta-data (name, version, etc.).
+******************************************************************************/
+void server_information(char* information)
+{
+	strcat(information, BD3WS_ServerName);
+	strcat(information, " ");
+	strcat(information, BD3WS_ServerVersion);
+}
+
+/******************************************************************************
+	log: Logs server activity in the system log file.
+******************************************************************************/
+void log(const char* message, BD3WS_Output output)
+{
+	// Lock the log mutex.
+	pthread_mutex_lock(&mutex_log);
+	//
+
+	char log_message[BD3WS_MaxLengthData];
+
+	// Ensure that the log file is open.
+	if (NULL == log_handle)
+	{
+		// Ensure that if the log file is not open, it can be opened (or created, if necessary).
+		if (-1 == mkdir(BD3WS_LogDirectory, S_IRWXU | S_IRWXG | S_IROTH))
+		{
+			// Unlock the log mutex before returning prematurely.
+			pthread_mutex_unlock(&mutex_log);
+			//
+
+			return;
+		}
+		//
+
+		log_handle = fopen(BD3WS_Log, "w");
+	}
+	//
+
+	// Prepend a timestamp to the log message.
+	time_t log_time = time(NULL);
+	strftime(log_message, BD3WS_MaxLengthData, "%D %T", localtime(&log_time));
+	//
+	
+
+	// Determine output to write to.
+	if (NONE == output)
+	{
+		// Print timestamp and raw message content only.
+		sprintf(log_message, "%s : %s", log_message, message);
+		//
+	}
+	else if (STDOUT == output)
+	{
+		// Denote message as an informational message.
+		sprintf(log_message, "%s (%s | Information): %s", log_message, BD3WS_ServerName, message);
+		//
+
+		// Write to stdout.
+		fprintf(stdout, "%s", log_message);
+		fflush(stdout);
+		//
+	}
+	else if (STDERR == output)
+	{
+		// Denote message as an error message.
+		sprintf(log_message, "%s (%s | Error): %s", log_message, BD3WS_ServerName, message);
+		//
+
+		// Write to stdout.
+		fprintf(stdout, "%s", log_message);
+		fflush(stdout);
+		//
+	}
+	//
+
+	// Write to log file.
+	fprintf(log_handle, "%s", log_message);
+	fflush(log_handle);
+	//
+
+	// Unlock the log mutex.
+	pthread_mutex_unlock(&mutex_log);
+	//
+}
+
+/******************************************************************************
+	clean_file_path: Cleans up a given file path in-place. Currently, this
+simply means removing multiple successive path separators (forward slashes).
+******************************************************************************/
+void clean_file_path(char* file_path)
+{
+	// Get the length of the file path.
+	unsigned int length = strlen(file_path);
+	///
+
+	// Initialize string iterators to the beginning of the string.
+	unsigned int trailing = 0;
+	unsigned int leading = 0;
+	//
+
+	// Iterate through the string and remove redundant file path separators.
+	while (leading < length)
+	{
+		// If the iterators are offset from each other, redundant separators have been found and the string elements should be shifted.
+		if (trailing != leading)
+		{
+			file_path[trailing] = file_path[leading];
+		}
+		//
+
+		// If a path separator has been encountered, check for redundant separators immediately following it.
+		if (file_path[trailing] == '/')
+		{
+			// Move the leading iterator to the end of the redundant separator chain.
+			while (file_path[leading] == '/')
+			{
+				++leading;
+			}
+			//
+
+			// Advance the trailing iterator to the new write-point (directly following the first, non-redundant separator).
+			++trailing;
+			//
+		}
+		//
+
+		// If a path separator has not been encountered, continue iteration normally.
+		else
+		{
+			++trailing;
+			++leading;
+		}
+		//
+	}
+	//
+
+	// Null-terminate the path.
+	file_path[trailing] = '\0';
+	//
+}
+
+/******************************************************************************
+	cache_initialize: Maps the shared content cache. The mapping is anonymous 
+and shared, so it is inherited across fork() and outlives any single worker. 
+If it cannot be mapped, the server simply runs without a cache.
+******************************************************************************/
+void cache_initialize()
+{
+	char buffer[BD3WS_MaxLengthData];
+
+	memset(buffer, 0, sizeof(buffer));
+
+	cache = mmap(NULL, sizeof(BD3WS_Cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == cache)
+	{
+		cache = NULL;
+		sprintf(buffer, "Cannot map shared content cache! Continuing without it.\n");
+		log(buffer, STDERR);
+	}
+}
+
+/******************************************************************************
+	cache_hash: Hashes a file path (FNV-1a) to locate its content cache entry.
+******************************************************************************/
+unsigned long cache_hash(const char* file_path)
+{
+	unsigned long hash = 14695981039346656037UL;
+
+	while ('\0' != *file_path)
+	{
+		hash ^= (unsigned char)*file_path;
+		hash *= 1099511628211UL;
+		++file_path;
+	}
+
+	return hash;
+}
+
+/******************************************************************************
+	cache_lookup: Copies a file's content out of the shared content cache if 
+a fresh entry exists (same inode, size and modification time as the given 
+file stat). Readers never block: an entry that is being written, or that 
+changes while being copied, is treated as a miss. Returns the content length, 
+or -1 on a miss.
+******************************************************************************/
+long cache_lookup(const char* file_path, struct stat* file_stat, char* content, unsigned long capacity)
+{
+	BD3WS_CacheEntry* entry = NULL;
+	unsigned long hash = 0;
+	unsigned long length = 0;
+	unsigned int sequence = 0;
+	int match = 0;
+
+	if (NULL == cache)
+	{
+		return -1;
+	}
+
+	hash = cache_hash(file_path);
+
+	// Probe a short run of entries following the hashed slot.
+	for (int probe = 0; probe < BD3WS_CacheNumberProbes; ++probe)
+	{
+		entry = &(cache->entries[(hash + probe) % BD3WS_CacheNumberEntries]);
+
+		// Skip entries that are currently owned by a writer.
+		sequence = __atomic_load_n(&(entry->sequence), __ATOMIC_ACQUIRE);
+		if (0 != (sequence & 1) || hash != entry->hash)
+		{
+			continue;
+		}
+		//
+
+		// Validate the entry against the file on disk and copy it out.
+		length = entry->length;
+		match = length <= capacity
+			&& file_stat->st_dev == entry->device
+			&& file_stat->st_ino == entry->inode
+			&& file_stat->st_size == entry->size
+			&& file_stat->st_mtime == entry->modified
+			&& 0 == strncmp(file_path, entry->file_path, BD3WS_MaxLengthData);
+		if (match)
+		{
+			memcpy(content, entry->content, length);
+		}
+		//
+
+		// Only trust the copy if no writer touched the entry in the meantime.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (match && sequence == __atomic_load_n(&(entry->sequence), __ATOMIC_RELAXED))
+		{
+			__atomic_fetch_add(&(cache->hits), 1, __ATOMIC_RELAXED);
+			return length;
+		}
+		//
+	}
+	//
+
+	__atomic_fetch_add(&(cache->misses), 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+/******************************************************************************
+	cache_store: Publishes a file's content to the shared content cache. The 
+writer claims an entry by recording its pid as the owner, then moves the 
+sequence number from even to odd while it fills the entry; if another writer 
+already owns the entry, the store is simply skipped.
+******************************************************************************/
+void cache_store(const char* file_path, struct stat* file_stat, const char* content, unsigned long length)
+{
+	BD3WS_CacheEntry* entry = NULL;
+	BD3WS_CacheEntry* candidate = NULL;
+	unsigned long hash = 0;
+	unsigned int sequence = 0;
+	pid_t owner = 0;
+
+	if (NULL == cache || BD3WS_CacheMaxLengthEntry < length || BD3WS_MaxLengthData <= strlen(file_path))
+	{
+		return;
+	}
+
+	hash = cache_hash(file_path);
+
+	// Prefer an entry already holding this path, then an empty one, then evict the home slot.
+	for (int probe = 0; probe < BD3WS_CacheNumberProbes && NULL == entry; ++probe)
+	{
+		candidate = &(cache->entries[(hash + probe) % BD3WS_CacheNumberEntries]);
+		if (hash == candidate->hash)
+		{
+			entry = candidate;
+		}
+		else if (0 == candidate->hash && 0 == candidate->length)
+		{
+			entry = candidate;
+		}
+	}
+
+	if (NULL == entry)
+	{
+		entry = &(cache->entries[hash % BD3WS_CacheNumberEntries]);
+	}
+	//
+
+	// Claim the entry. The owner is set in the same step, so that the supervisor can recover the entry should this worker die holding it.
+	if (!__atomic_compare_exchange_n(&(entry->owner), &owner, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	sequence = __atomic_load_n(&(entry->sequence), __ATOMIC_RELAXED);
+	__atomic_store_n(&(entry->sequence), sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	//
+
+	// Fill the entry.
+	entry->hash = hash;
+	strncpy(entry->file_path, file_path, BD3WS_MaxLengthData - 1);
+	entry->device = file_stat->st_dev;
+	entry->inode = file_stat->st_ino;
+	entry->size = file_stat->st_size;
+	entry->modified = file_stat->st_mtime;
+	entry->length = length;
+	memcpy(entry->content, content, length);
+	//
+
+	// Release the entry to readers, then to other writers.
+	__atomic_store_n(&(entry->sequence), sequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&(entry->owner), 0, __ATOMIC_RELEASE);
+	//
+}
+
+/******************************************************************************
+	cache_recover: Releases the shared content cache entries owned by a worker 
+that has died. An entry it was filling is emptied before it is handed back to 
+readers, since its content may be partly written.
+******************************************************************************/
+void cache_recover(pid_t pid)
+{
+	char buffer[BD3WS_MaxLengthData];
+	BD3WS_CacheEntry* entry = NULL;
+	unsigned int sequence = 0;
+	int recovered = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	if (NULL == cache)
+	{
+		return;
+	}
+
+	for (int i = 0; i < BD3WS_CacheNumberEntries; ++i)
+	{
+		entry = &(cache->entries[i]);
+		if (pid != __atomic_load_n(&(entry->owner), __ATOMIC_ACQUIRE))
+		{
+			continue;
+		}
+
+		sequence = __atomic_load_n(&(entry->sequence), __ATOMIC_RELAXED);
+		if (0 != (sequence & 1))
+		{
+			entry->hash = 0;
+			entry->length = 0;
+			__atomic_store_n(&(entry->sequence), sequence + 1, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&(entry->owner), 0, __ATOMIC_RELEASE);
+		++recovered;
+	}
+
+	if (0 < recovered)
+	{
+		sprintf(buffer, "Recovered %d shared cache entr%s held by pid %d.\n", recovered, (1 == recovered) ? "y" : "ies", (int)pid);
+		log(buffer, STDERR);
+	}
+}
+
+/******************************************************************************
+	scheduler_initialize: Starts the send scheduler thread for this process. 
+The thread sleeps in poll() on a wakeup pipe and on the sockets of blocked 
+transfers.
+******************************************************************************/
+void scheduler_initialize()
+{
+	char buffer[BD3WS_MaxLengthData];
+
+	memset(buffer, 0, sizeof(buffer));
+
+	clock_gettime(CLOCK_MONOTONIC, &(scheduler.refilled));
+	scheduler.global_refilled = scheduler.refilled;
+	if (-1 == pipe2(scheduler.wakeup, O_NONBLOCK | O_CLOEXEC) || 0 != pthread_create(&(scheduler.thread), NULL, run_scheduler, NULL))
+	{
+		sprintf(buffer, "Cannot start send scheduler!\n");
+		log(buffer, STDERR);
+		finalize(1);
+	}
+
+	pthread_detach(scheduler.thread);
+}
+
+/******************************************************************************
+	schedule_transfer: Hands a response transfer (and its client connection) 
+to the send scheduler.
+******************************************************************************/
+void schedule_transfer(BD3WS_Transfer* transfer)
+{
+	char wakeup = 0;
+
+	pthread_mutex_lock(&(scheduler.mutex));
+	transfer->next = scheduler.incoming;
+	scheduler.incoming = transfer;
+	pthread_mutex_unlock(&(scheduler.mutex));
+
+	write(scheduler.wakeup[1], &wakeup, 1);
+}
+
+/******************************************************************************
+	run_scheduler: Send scheduler main loop. Every round, each small response 
+gets one quantum ahead of the bulk responses; each bulk response then adds a 
+quantum to its deficit and may send up to its deficit (deficit round-robin). A 
+slow reader only blocks its own transfer, never a request thread.
+******************************************************************************/
+void* run_scheduler(void* unused)
+{
+	BD3WS_Transfer* transfer = NULL;
+	long sent = 0;
+
+	while (1)
+	{
+		scheduler_adopt();
+		scheduler_refill();
+
+		// Small responses first, one quantum each.
+		for (transfer = scheduler.small; NULL != transfer; transfer = transfer->next)
+		{
+			if (!transfer->blocked)
+			{
+				scheduler_send(transfer, BD3WS_SchedulerQuantum);
+			}
+		}
+		//
+
+		// Bulk responses by deficit round-robin. Deficit is not carried over by a transfer whose socket is full.
+		for (transfer = scheduler.bulk; NULL != transfer; transfer = transfer->next)
+		{
+			if (!transfer->blocked)
+			{
+				transfer->deficit += BD3WS_SchedulerQuantum;
+				sent = scheduler_send(transfer, transfer->deficit);
+				transfer->deficit = transfer->blocked ? 0 : transfer->deficit - sent;
+			}
+		}
+		//
+
+		scheduler_demote();
+		scheduler_retire(&(scheduler.small));
+		scheduler_retire(&(scheduler.bulk));
+
+		scheduler_wait();
+	}
+
+	return NULL;
+}
+
+/******************************************************************************
+	scheduler_adopt: Moves newly handed-off transfers onto the small or bulk 
+queue, preserving arrival order.
+******************************************************************************/
+void scheduler_adopt()
+{
+	BD3WS_Transfer* incoming = NULL;
+	BD3WS_Transfer* transfer = NULL;
+	BD3WS_Transfer** tail = NULL;
+
+	pthread_mutex_lock(&(scheduler.mutex));
+	incoming = scheduler.incoming;
+	scheduler.incoming = NULL;
+	pthread_mutex_unlock(&(scheduler.mutex));
+
+	// Reverse the hand-off stack into arrival order.
+	while (NULL != incoming)
+	{
+		transfer = incoming;
+		incoming = incoming->next;
+		transfer->next = NULL;
+
+		transfer->small = BD3WS_SchedulerSmallResponse >= transfer->header_length + transfer->body_length;
+		transfer->tokens = BD3WS_SchedulerQuantum;
+
+		tail = transfer->small ? &(scheduler.small) : &(scheduler.bulk);
+		while (NULL != *tail)
+		{
+			tail = &((*tail)->next);
+		}
+		*tail = transfer;
+	}
+	//
+}
+
+/******************************************************************************
+	scheduler_refill: Refills the per-connection rate limit token buckets of 
+queued transfers for the time elapsed since the last refill. Buckets hold at 
+most a tenth of a second's worth of bytes, and never less than one quantum.
+******************************************************************************/
+void scheduler_refill()
+{
+	BD3WS_Transfer* transfer = NULL;
+	struct timespec now;
+	double elapsed = 0;
+	double limit = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - scheduler.refilled.tv_sec) + (now.tv_nsec - scheduler.refilled.tv_nsec) / 1e9;
+	scheduler.refilled = now;
+
+	if (0 < scheduler.connection_rate)
+	{
+		limit = (scheduler.connection_rate / 10 > BD3WS_SchedulerQuantum) ? scheduler.connection_rate / 10 : BD3WS_SchedulerQuantum;
+		for (int queue = 0; queue < 2; ++queue)
+		{
+			for (transfer = (0 == queue) ? scheduler.small : scheduler.bulk; NULL != transfer; transfer = transfer->next)
+			{
+				transfer->tokens += elapsed * scheduler.connection_rate;
+				transfer->tokens = (transfer->tokens > limit) ? limit : transfer->tokens;
+			}
+		}
+	}
+}
+
+/******************************************************************************
+	scheduler_take_tokens: Takes up to the wanted number of bytes from the 
+global rate limit bucket, refilling it first as scheduler_refill() does for 
+connections. The bucket is shared by the scheduler and HTTP/2 connections. 
+Returns the number of bytes granted; any the caller does not send are given 
+back with scheduler_return_tokens().
+******************************************************************************/
+long scheduler_take_tokens(long wanted)
+{
+	struct timespec now;
+	double limit = 0;
+
+	if (0 >= scheduler.global_rate || 0 >= wanted)
+	{
+		return wanted;
+	}
+
+	pthread_mutex_lock(&(scheduler.mutex));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	limit = (scheduler.global_rate / 10 > BD3WS_SchedulerQuantum) ? scheduler.global_rate / 10 : BD3WS_SchedulerQuantum;
+	scheduler.global_tokens += ((now.tv_sec - scheduler.global_refilled.tv_sec) + (now.tv_nsec - scheduler.global_refilled.tv_nsec) / 1e9) * scheduler.global_rate;
+	scheduler.global_tokens = (scheduler.global_tokens > limit) ? limit : scheduler.global_tokens;
+	scheduler.global_refilled = now;
+
+	wanted = (wanted > scheduler.global_tokens) ? scheduler.global_tokens : wanted;
+	scheduler.global_tokens -= wanted;
+
+	pthread_mutex_unlock(&(scheduler.mutex));
+
+	return wanted;
+}
+
+/******************************************************************************
+	scheduler_return_tokens: Gives unsent bytes back to the global rate limit 
+bucket.
+******************************************************************************/
+void scheduler_return_tokens(long unused)
+{
+	if (0 >= scheduler.global_rate || 0 >= unused)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&(scheduler.mutex));
+	scheduler.global_tokens += unused;
+	pthread_mutex_unlock(&(scheduler.mutex));
+}
+
+/******************************************************************************
+	scheduler_send: Sends up to budget bytes of a transfer (header first, then 
+body) without blocking, subject to the rate limits. Marks the transfer as 
+blocked if its socket is full, throttled if a rate limit left no budget, 
+waiting if its stream has nothing buffered yet, and failed (with the error 
+number) on a send error. Returns the number of bytes sent.
+******************************************************************************/
+long scheduler_send(BD3WS_Transfer* transfer, long budget)
+{
+	BD3WS_Chunk* chunk = NULL;
+	int socket = server.clients[transfer->client].socket;
+	long sent_total = 0;
+	ssize_t sent = 0;
+	off_t offset = 0;
+	size_t length = 0;
+
+	// Apply rate limits.
+	if (0 < scheduler.connection_rate && budget > transfer->tokens)
+	{
+		budget = transfer->tokens;
+	}
+	budget = scheduler_take_tokens(budget);
+
+	transfer->throttled = 0 >= budget;
+	transfer->waiting = 0;
+	//
+
+	while (0 < budget && !transfer->failed && transfer_pending(transfer))
+	{
+		// Response header, corked if a body follows.
+		if (transfer->header_sent < transfer->header_length)
+		{
+			length = transfer->header_length - transfer->header_sent;
+			length = (length > budget) ? budget : length;
+			sent = send(socket, transfer->header + transfer->header_sent, length, MSG_NOSIGNAL | ((0 < transfer->body_length) ? MSG_MORE : 0));
+		}
+		//
+
+		// Streamed response body; wait for the producer if it has nothing buffered, and give up along with it.
+		else if (NULL != transfer->stream)
+		{
+			pthread_mutex_lock(&(transfer->stream->mutex));
+			if (transfer->stream->failed)
+			{
+				pthread_mutex_unlock(&(transfer->stream->mutex));
+				transfer->failed = ECONNABORTED;
+				break;
+			}
+			else if (NULL == (chunk = transfer->stream->head))
+			{
+				transfer->stream_finished = transfer->stream->finished;
+				transfer->waiting = !transfer->stream_finished;
+				pthread_mutex_unlock(&(transfer->stream->mutex));
+				if (transfer->waiting)
+				{
+					break;
+				}
+				continue;
+			}
+
+			length = chunk->length - chunk->sent;
+			length = (length > budget) ? budget : length;
+			sent = send(socket, chunk->data + chunk->sent, length, MSG_NOSIGNAL);
+			if (0 < sent)
+			{
+				chunk->sent += sent;
+				transfer->stream->buffered -= sent;
+				if (chunk->length == chunk->sent)
+				{
+					transfer->stream->head = chunk->next;
+					transfer->stream->tail = (NULL == chunk->next) ? NULL : transfer->stream->tail;
+					free(chunk);
+					pthread_cond_broadcast(&(transfer->stream->drained));
+				}
+			}
+			pthread_mutex_unlock(&(transfer->stream->mutex));
+		}
+		//
+
+		// Response body from memory.
+		else if (NULL != transfer->content)
+		{
+			length = transfer->body_length - transfer->body_sent;
+			length = (length > budget) ? budget : length;
+			sent = send(socket, transfer->content + transfer->body_sent, length, MSG_NOSIGNAL);
+		}
+		//
+
+		// Response body from file.
+		else
+		{
+			length = transfer->body_length - transfer->body_sent;
+			length = (length > budget) ? budget : length;
+			offset = transfer->body_sent;
+			sent = sendfile(socket, transfer->file, &offset, length);
+		}
+		//
+
+		// Socket full, or connection broken (a file that shrank underneath us also ends the transfer).
+		if (-1 == sent && (EAGAIN == errno || EWOULDBLOCK == errno))
+		{
+			transfer->blocked = 1;
+			break;
+		}
+		else if (0 >= sent)
+		{
+			transfer->failed = (-1 == sent) ? errno : EIO;
+			break;
+		}
+		//
+
+		if (transfer->header_sent < transfer->header_length)
+		{
+			transfer->header_sent += sent;
+		}
+		else
+		{
+			transfer->body_sent += sent;
+		}
+
+		budget -= sent;
+		sent_total += sent;
+	}
+
+	transfer->tokens -= sent_total;
+	scheduler_return_tokens(budget);
+
+	return sent_total;
+}
+
+/******************************************************************************
+	scheduler_demote: Moves streamed transfers whose size was unknown up front 
+from the small queue to the bulk queue once they outgrow a small response.
+******************************************************************************/
+void scheduler_demote()
+{
+	BD3WS_Transfer** queue = &(scheduler.small);
+	BD3WS_Transfer** tail = &(scheduler.bulk);
+	BD3WS_Transfer* transfer = NULL;
+
+	while (NULL != *tail)
+	{
+		tail = &((*tail)->next);
+	}
+
+	while (NULL != (transfer = *queue))
+	{
+		if (BD3WS_SchedulerSmallResponse < transfer->body_sent)
+		{
+			*queue = transfer->next;
+			transfer->next = NULL;
+			transfer->small = 0;
+			*tail = transfer;
+			tail = &(transfer->next);
+		}
+		else
+		{
+			queue = &(transfer->next);
+		}
+	}
+}
+
+/******************************************************************************
+	scheduler_retire: Removes finished and failed transfers from a queue, 
+closing their connections and vacating their clients.
+******************************************************************************/
+void scheduler_retire(BD3WS_Transfer** queue)
+{
+	char buffer[BD3WS_MaxLengthData];
+	struct linger linger = { 1, 0 };
+	BD3WS_Transfer* transfer = NULL;
+	int client = -1;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	while (NULL != (transfer = *queue))
+	{
+		// Keep transfers that still have data to send.
+		if (!transfer->failed && transfer_pending(transfer))
+		{
+			queue = &(transfer->next);
+			continue;
+		}
+		//
+
+		*queue = transfer->next;
+
+		if (transfer->failed)
+		{
+			char error_buffer[256];
+			sprintf(buffer, "Cannot send file \"%.*s\" to client! Details: %s\n", BD3WS_MaxLengthAddress, transfer->name, strerror_r(transfer->failed, error_buffer, 256));
+			log(buffer, STDERR);
+		}
+		else
+		{
+			sprintf(buffer, "File \"%.*s\" sent successfully!\n", BD3WS_MaxLengthAddress, transfer->name);
+			log(buffer, STDOUT);
+		}
+
+		// Close connection socket and vacate client. A failed response is reset, so that the client cannot take what it got for 
+		// all of it.
+		client = transfer->client;
+		if (transfer->failed)
+		{
+			setsockopt(server.clients[client].socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		}
+		close(server.clients[client].socket);
+		server.clients[client].socket = -1;
+		__atomic_store_n(&(server.clients[client].occupied), 0, __ATOMIC_RELEASE);
+		//
+
+		if (-1 != transfer->file)
+		{
+			close(transfer->file);
+		}
+		if (NULL != transfer->stream)
+		{
+			pthread_mutex_lock(&(transfer->stream->mutex));
+			transfer->stream->abandoned = 1;
+			pthread_cond_broadcast(&(transfer->stream->drained));
+			pthread_mutex_unlock(&(transfer->stream->mutex));
+			stream_release(transfer->stream);
+		}
+		free(transfer->content);
+		free(transfer->header);
+		free(transfer->name);
+		free(transfer);
+	}
+}
+
+/******************************************************************************
+	scheduler_wait: Sleeps until there is more scheduling work: a new transfer 
+is handed off, a blocked socket becomes writable, or (if transfers are only 
+rate limited) the throttle interval elapses. Streamed transfers with nothing 
+buffered wait for their producer to write to the wakeup pipe. Returns immediately if any 
+transfer can make progress.
+******************************************************************************/
+void scheduler_wait()
+{
+	struct pollfd polls[1 + BD3WS_MaxNumberClients];
+	BD3WS_Transfer* polled[1 + BD3WS_MaxNumberClients];
+	BD3WS_Transfer* transfer = NULL;
+	char wakeup[64];
+	int number_polls = 1;
+	int timeout = -1;
+
+	polls[0].fd = scheduler.wakeup[0];
+	polls[0].events = POLLIN;
+	polls[0].revents = 0;
+
+	// Poll blocked transfers for writability, and decide how long to sleep. Blocked transfers whose producer gave up fail 
+	// right away.
+	for (int queue = 0; queue < 2; ++queue)
+	{
+		for (transfer = (0 == queue) ? scheduler.small : scheduler.bulk; NULL != transfer; transfer = transfer->next)
+		{
+			if (transfer->blocked && NULL != transfer->stream && __atomic_load_n(&(transfer->stream->failed), __ATOMIC_RELAXED))
+			{
+				transfer->blocked = 0;
+				timeout = 0;
+			}
+			else if (transfer->blocked)
+			{
+				polls[number_polls].fd = server.clients[transfer->client].socket;
+				polls[number_polls].events = POLLOUT;
+				polls[number_polls].revents = 0;
+				polled[number_polls] = transfer;
+				++number_polls;
+			}
+			else if (transfer->throttled)
+			{
+				timeout = (0 == timeout) ? 0 : BD3WS_SchedulerThrottleInterval;
+			}
+			else if (transfer->waiting)
+			{
+				// Producers write to the wakeup pipe when they append data.
+			}
+			else
+			{
+				timeout = 0;
+			}
+		}
+	}
+	//
+
+	poll(polls, number_polls, timeout);
+
+	// Unblock writable transfers (errors are picked up by the next send).
+	for (int i = 1; i < number_polls; ++i)
+	{
+		if (0 != polls[i].revents)
+		{
+			polled[i]->blocked = 0;
+		}
+	}
+	//
+
+	// Drain the wakeup pipe.
+	while (0 < read(scheduler.wakeup[0], wakeup, sizeof(wakeup)))
+	{
+	}
+	//
+}
+
+/******************************************************************************
+	transfer_pending: Returns 1 if a transfer still has data to send, or 0 if 
+it is complete.
+******************************************************************************/
+int transfer_pending(BD3WS_Transfer* transfer)
+{
+	if (transfer->header_sent < transfer->header_length)
+	{
+		return 1;
+	}
+
+	if (NULL != transfer->stream)
+	{
+		return !transfer->stream_finished;
+	}
+
+	return transfer->body_sent < transfer->body_length;
+}
+
+/******************************************************************************
+	stream_create: Allocates a response stream with one reference each for 
+its producer and for its consumer, which is woken by writes to the wakeup 
+descriptor.
+******************************************************************************/
+BD3WS_Stream* stream_create(int wakeup)
+{
+	BD3WS_Stream* stream = calloc(1, sizeof(BD3WS_Stream));
+
+	if (NULL != stream)
+	{
+		pthread_mutex_init(&(stream->mutex), NULL);
+		pthread_cond_init(&(stream->drained), NULL);
+		stream->wakeup = wakeup;
+		stream->references = 2;
+	}
+
+	return stream;
+}
+
+/******************************************************************************
+	stream_append: Appends data to a response stream and wakes its consumer. 
+Blocks while too much data is buffered for a slow client; data for an 
+abandoned stream (the client went away) is discarded.
+******************************************************************************/
+void stream_append(BD3WS_Stream* stream, const char* data, unsigned long length)
+{
+	BD3WS_Chunk* chunk = NULL;
+	char wakeup = 0;
+
+	if (0 == length)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&(stream->mutex));
+
+	while (!stream->abandoned && !stream->failed && BD3WS_FastCGIMaxBuffered < stream->buffered)
+	{
+		pthread_cond_wait(&(stream->drained), &(stream->mutex));
+	}
+
+	if (!stream->abandoned && !stream->failed && NULL != (chunk = malloc(sizeof(BD3WS_Chunk) + length)))
+	{
+		chunk->next = NULL;
+		chunk->length = length;
+		chunk->sent = 0;
+		memcpy(chunk->data, data, length);
+
+		if (NULL == stream->tail)
+		{
+			stream->head = chunk;
+		}
+		else
+		{
+			stream->tail->next = chunk;
+		}
+		stream->tail = chunk;
+		stream->buffered += length;
+	}
+
+	pthread_mutex_unlock(&(stream->mutex));
+
+	write(stream->wakeup, &wakeup, 1);
+}
+
+/******************************************************************************
+	stream_finish: Marks the end of a response stream and wakes its consumer.
+******************************************************************************/
+void stream_finish(BD3WS_Stream* stream)
+{
+	char wakeup = 0;
+
+	pthread_mutex_lock(&(stream->mutex));
+	stream->finished = 1;
+	pthread_mutex_unlock(&(stream->mutex));
+
+	write(stream->wakeup, &wakeup, 1);
+}
+
+/******************************************************************************
+	stream_full: Returns 1 if appending to a response stream would block until 
+its consumer drains it, or 0 otherwise. Only the consumer takes data from a 
+stream, so a stream that is not full stays so until the producer appends.
+******************************************************************************/
+int stream_full(BD3WS_Stream* stream)
+{
+	int full = 0;
+
+	pthread_mutex_lock(&(stream->mutex));
+	full = !stream->abandoned && BD3WS_FastCGIMaxBuffered < stream->buffered;
+	pthread_mutex_unlock(&(stream->mutex));
+
+	return full;
+}
+
+/******************************************************************************
+	stream_fail: Marks a response stream as given up on and wakes its consumer, 
+which resets the response, and its producer if it is waiting to append. 
+Further data is discarded.
+******************************************************************************/
+void stream_fail(BD3WS_Stream* stream)
+{
+	char wakeup = 0;
+
+	pthread_mutex_lock(&(stream->mutex));
+	stream->failed = 1;
+	pthread_cond_broadcast(&(stream->drained));
+	pthread_mutex_unlock(&(stream->mutex));
+
+	write(stream->wakeup, &wakeup, 1);
+}
+
+/******************************************************************************
+	stream_release: Drops one reference to a response stream, freeing it and 
+any unsent data once neither the producer nor the consumer holds it.
+******************************************************************************/
+void stream_release(BD3WS_Stream* stream)
+{
+	BD3WS_Chunk* chunk = NULL;
+	int references = 0;
+
+	pthread_mutex_lock(&(stream->mutex));
+	references = --stream->references;
+	pthread_mutex_unlock(&(stream->mutex));
+
+	if (0 < references)
+	{
+		return;
+	}
+
+	while (NULL != (chunk = stream->head))
+	{
+		stream->head = chunk->next;
+		free(chunk);
+	}
+
+	pthread_cond_destroy(&(stream->drained));
+	pthread_mutex_destroy(&(stream->mutex));
+	free(stream);
+}
+
+/******************************************************************************
+	add_fastcgi_route: Records a FastCGI route given as "prefix=address", where 
+the address is anything resolve_address() accepts. Trailing slashes are 
+removed from the prefix, so "/" routes every request.
+******************************************************************************/
+void add_fastcgi_route(const char* route)
+{
+	char buffer[BD3WS_MaxLengthData];
+	BD3WS_FastCGIRoute* fastcgi_route = &(server.routes[server.number_routes]);
+	const char* separator = strchr(route, '=');
+	unsigned long prefix_length = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	if (BD3WS_MaxNumberRoutes <= server.number_routes || NULL == separator || '/' != route[0]
+		|| BD3WS_MaxLengthAddress <= separator - route || BD3WS_MaxLengthAddress <= strlen(separator + 1))
+	{
+		sprintf(buffer, "Invalid FastCGI route \"%.256s\"! Expected prefix=address (at most %d routes).\n", route, BD3WS_MaxNumberRoutes);
+		log(buffer, STDERR);
+		finalize(1);
+	}
+
+	// Split the route into prefix and upstream address.
+	prefix_length = separator - route;
+	while (0 < prefix_length && '/' == route[prefix_length - 1])
+	{
+		--prefix_length;
+	}
+	memcpy(fastcgi_route->prefix, route, prefix_length);
+	fastcgi_route->prefix[prefix_length] = '\0';
+	strcpy(fastcgi_route->address, separator + 1);
+	//
+
+	// Connections are opened on demand by each serving process.
+	pthread_mutex_init(&(fastcgi_route->mutex), NULL);
+	pthread_cond_init(&(fastcgi_route->available), NULL);
+	for (int i = 0; i < BD3WS_FastCGIPoolSize; ++i)
+	{
+		fastcgi_route->connections[i].route = fastcgi_route;
+		fastcgi_route->connections[i].socket = -1;
+		fastcgi_route->connections[i].connecting = 0;
+		pthread_mutex_init(&(fastcgi_route->connections[i].write_mutex), NULL);
+	}
+	//
+
+	++server.number_routes;
+}
+
+/******************************************************************************
+	find_fastcgi_route: Returns the FastCGI route with the longest prefix 
+matching the request path (at a path segment boundary), or NULL if the path is 
+served from the public directory. The path is matched as resolve_path() 
+normalizes it, so that dot segments and percent-encoding can neither carry a 
+request into a route nor around one.
+******************************************************************************/
+BD3WS_FastCGIRoute* find_fastcgi_route(const char* path)
+{
+	char resolved[BD3WS_MaxLengthData];
+	BD3WS_FastCGIRoute* route = NULL;
+	unsigned long length = 0;
+
+	resolved[0] = '/';
+	if (-1 == resolve_path(path, resolved + 1, sizeof(resolved) - 1))
+	{
+		return NULL;
+	}
+
+	for (int i = 0; i < server.number_routes; ++i)
+	{
+		length = strlen(server.routes[i].prefix);
+		if (0 == strncmp(resolved, server.routes[i].prefix, length) && ('\0' == resolved[length] || '/' == resolved[length])
+			&& (NULL == route || strlen(route->prefix) < length))
+		{
+			route = &(server.routes[i]);
+		}
+	}
+
+	return route;
+}
+
+/******************************************************************************
+	forward_fastcgi_request: Forwards a client request to a FastCGI upstream 
+over a pooled connection, and hands a streamed response to the send scheduler. 
+The upstream connection's reader thread fills the stream as output arrives. 
+Returns 1 if the connection was handed to the scheduler, or 0 if the caller 
+still owns it.
+******************************************************************************/
+int forward_fastcgi_request(int client, BD3WS_FastCGIRoute* route, BD3WS_Request* request)
+{
+	char buffer[BD3WS_MaxLengthData];
+	BD3WS_FastCGIConnection* connection = NULL;
+	BD3WS_Transfer* transfer = NULL;
+	BD3WS_Stream* stream = NULL;
+	unsigned long generation = 0;
+	long body_remaining = 0;
+	ssize_t received = 0;
+	int request_id = 0;
+	int written = 1;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	// Set up the response stream, shared by the upstream reader and the send scheduler, and start the upstream request.
+	if (NULL == (transfer = calloc(1, sizeof(BD3WS_Transfer)))
+		|| NULL == (transfer->name = strdup(request->path))
+		|| NULL == (stream = stream_create(scheduler.wakeup[1])))
+	{
+		connection = NULL;
+	}
+	else
+	{
+		connection = fastcgi_begin_request(client, route, request, stream, &request_id, &generation);
+	}
+	//
+
+	// Without an upstream connection, answer with a gateway error right away.
+	if (NULL == connection)
+	{
+		if (NULL != stream)
+		{
+			stream_release(stream);
+			stream_release(stream);
+		}
+		if (NULL != transfer)
+		{
+			free(transfer->name);
+		}
+		free(transfer);
+
+		build_gateway_error_header(buffer);
+		send(server.clients[client].socket, buffer, strlen(buffer), MSG_NOSIGNAL);
+		return 0;
+	}
+	//
+
+	// Forward the request body: first what arrived with the header, then the rest from the client.
+	body_remaining = request->content_length;
+	received = (request->body_received < body_remaining) ? request->body_received : body_remaining;
+	while (written && 0 < body_remaining)
+	{
+		if (0 >= received)
+		{
+			request->body = request->data;
+			received = receive_client(server.clients[client].socket, request->data, (sizeof(request->data) < body_remaining) ? sizeof(request->data) : body_remaining);
+			if (0 >= received)
+			{
+				break;
+			}
+		}
+
+		written = 0 == fastcgi_send(connection, generation, FCGI_STDIN, request_id, request->body, received);
+		body_remaining -= received;
+		received = 0;
+	}
+
+	// A truncated body must not reach the application as a complete one: abort the 
+	// request instead of ending its input, so that it fails with a gateway error.
+	if (written && 0 < body_remaining)
+	{
+		snprintf(buffer, sizeof(buffer), "Request body for \"%.*s\" ended %ld byte(s) short; aborting FastCGI request.\n", BD3WS_MaxLengthAddress, request->path, body_remaining);
+		log(buffer, STDERR);
+		fastcgi_send(connection, generation, FCGI_ABORT_REQUEST, request_id, NULL, 0);
+	}
+	else if (written)
+	{
+		fastcgi_send(connection, generation, FCGI_STDIN, request_id, NULL, 0);
+	}
+	//
+
+	// Hand the streamed response to the send scheduler. If the upstream failed, its reader answers with a gateway error.
+	transfer->client = client;
+	transfer->file = -1;
+	transfer->stream = stream;
+	schedule_transfer(transfer);
+	//
+
+	return 1;
+}
+
+/******************************************************************************
+	fastcgi_begin_request: Starts a client request on a pooled upstream 
+connection by sending its BEGIN_REQUEST record and CGI environment. The 
+connection's reader thread fills the response stream as output arrives; the 
+caller sends the request body (FCGI_STDIN records) with the request ID and 
+connection generation stored. Returns the connection, or NULL if none could be 
+had.
+******************************************************************************/
+BD3WS_FastCGIConnection* fastcgi_begin_request(int client, BD3WS_FastCGIRoute* route, BD3WS_Request* request, BD3WS_Stream* stream, int* request_id, unsigned long* generation)
+{
+	char buffer[BD3WS_MaxLengthData];
+	char resolved[BD3WS_MaxLengthData];
+	char params[BD3WS_FastCGIMaxLengthParams];
+	char name[BD3WS_MaxLengthData];
+	char value[BD3WS_MaxLengthData];
+	char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	struct sockaddr_storage* address = &(server.clients[client].address_storage);
+	BD3WS_FastCGIConnection* connection = NULL;
+	BD3WS_FastCGIRequest* fastcgi_request = NULL;
+	BD3WS_Host* host = find_host(request->host);
+	unsigned long params_length = 0;
+	const char* line = NULL;
+	const char* line_end = NULL;
+	const char* colon = NULL;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	// The script and path info come from the normalized path the route was matched on.
+	resolved[0] = '/';
+	if (-1 == resolve_path(request->path, resolved + 1, sizeof(resolved) - 2))
+	{
+		return NULL;
+	}
+	if ('\0' != resolved[1] && '/' == request->path[strlen(request->path) - 1])
+	{
+		strcat(resolved, "/");
+	}
+	//
+
+	// Build the CGI environment.
+	fastcgi_add_param(params, &params_length, "GATEWAY_INTERFACE", "CGI/1.1");
+	sprintf(value, "%s/%s", BD3WS_ServerName, BD3WS_ServerVersion);
+	fastcgi_add_param(params, &params_length, "SERVER_SOFTWARE", value);
+	fastcgi_add_param(params, &params_length, "SERVER_PROTOCOL", request->version);
+	fastcgi_add_param(params, &params_length, "REQUEST_METHOD", request->method);
+	snprintf(value, sizeof(value), ('\0' == request->query[0]) ? "%s" : "%s?%s", request->path, request->query);
+	fastcgi_add_param(params, &params_length, "REQUEST_URI", value);
+	fastcgi_add_param(params, &params_length, "SCRIPT_NAME", route->prefix);
+	fastcgi_add_param(params, &params_length, "PATH_INFO", resolved + strlen(route->prefix));
+	if (sizeof(value) <= (unsigned long)snprintf(value, sizeof(value), "%s%s", host->root, resolved))
+	{
+		return NULL;
+	}
+	clean_file_path(value);
+	fastcgi_add_param(params, &params_length, "SCRIPT_FILENAME", value);
+	fastcgi_add_param(params, &params_length, "DOCUMENT_ROOT", host->root);
+	fastcgi_add_param(params, &params_length, "QUERY_STRING", request->query);
+	if (get_request_header(request, "Content-Type", value, sizeof(value)))
+	{
+		fastcgi_add_param(params, &params_length, "CONTENT_TYPE", value);
+	}
+	if (get_request_header(request, "Content-Length", value, sizeof(value)))
+	{
+		fastcgi_add_param(params, &params_length, "CONTENT_LENGTH", value);
+	}
+	if (AF_INET == address->ss_family || AF_INET6 == address->ss_family)
+	{
+		if (AF_INET == address->ss_family)
+		{
+			inet_ntop(AF_INET, &(((struct sockaddr_in*)address)->sin_addr), value, sizeof(value));
+			sprintf(name, "%hu", ntohs(((struct sockaddr_in*)address)->sin_port));
+		}
+		else
+		{
+			inet_ntop(AF_INET6, &(((struct sockaddr_in6*)address)->sin6_addr), value, sizeof(value));
+			sprintf(name, "%hu", ntohs(((struct sockaddr_in6*)address)->sin6_port));
+		}
+		fastcgi_add_param(params, &params_length, "REMOTE_ADDR", value);
+		fastcgi_add_param(params, &params_length, "REMOTE_PORT", name);
+	}
+	//
+
+	// Request headers become HTTP_* parameters (Content-Type and Content-Length were passed above).
+	for (line = request->headers; '\0' != *line; line = ('\0' == *line_end) ? line_end : line_end + 1)
+	{
+		if (NULL == (line_end = strchr(line, '\n')))
+		{
+			line_end = line + strlen(line);
+		}
+
+		if (NULL == (colon = memchr(line, ':', line_end - line)) || BD3WS_MaxLengthData - 6 <= colon - line
+			|| (14 == colon - line && 0 == strncasecmp(line, "Content-Length", 14))
+			|| (12 == colon - line && 0 == strncasecmp(line, "Content-Type", 12)))
+		{
+			continue;
+		}
+
+		strcpy(name, "HTTP_");
+		for (int i = 0; i < colon - line; ++i)
+		{
+			name[5 + i] = ('-' == line[i]) ? '_' : toupper((unsigned char)line[i]);
+		}
+		name[5 + (colon - line)] = '\0';
+
+		memcpy(buffer, line, line_end - line);
+		buffer[line_end - line] = '\0';
+		buffer[colon - line] = '\0';
+		if (get_request_header(request, buffer, value, sizeof(value)))
+		{
+			fastcgi_add_param(params, &params_length, name, value);
+		}
+	}
+	//
+
+	// Claim a request ID on a pooled connection.
+	if (NULL != (fastcgi_request = calloc(1, sizeof(BD3WS_FastCGIRequest))))
+	{
+		fastcgi_request->stream = stream;
+		connection = fastcgi_acquire(route, fastcgi_request, request_id, generation);
+	}
+
+	if (NULL == connection)
+	{
+		snprintf(buffer, sizeof(buffer), "Cannot forward request for \"%.*s\" to FastCGI upstream %s!\n", BD3WS_MaxLengthAddress, request->path, route->address);
+		log(buffer, STDERR);
+		free(fastcgi_request);
+		return NULL;
+	}
+	//
+
+	// Send the request records. Each record is written whole, so multiplexed requests interleave safely.
+	if (0 == fastcgi_send(connection, *generation, FCGI_BEGIN_REQUEST, *request_id, begin, sizeof(begin))
+		&& 0 == fastcgi_send(connection, *generation, FCGI_PARAMS, *request_id, params, params_length))
+	{
+		fastcgi_send(connection, *generation, FCGI_PARAMS, *request_id, NULL, 0);
+	}
+	//
+
+	return connection;
+}
+
+/******************************************************************************
+	fastcgi_acquire: Assigns a request to a pooled upstream connection and 
+returns the connection, with the request ID stored in request_id. Idle 
+connections are preferred, then new connections (up to the pool size), then 
+multiplexing onto the least busy connection (other than those stalled by a 
+slow client), then taking over a stalled connection. If every connection is at 
+capacity, waits for one to free up. The connection generation is stored in 
+generation, as the request may complete (and be freed) as soon as the route 
+mutex is released. Returns NULL on failure.
+******************************************************************************/
+BD3WS_FastCGIConnection* fastcgi_acquire(BD3WS_FastCGIRoute* route, BD3WS_FastCGIRequest* request, int* request_id, unsigned long* generation)
+{
+	BD3WS_FastCGIConnection* connection = NULL;
+	BD3WS_FastCGIConnection* best = NULL;
+	struct timespec deadline;
+	int open = 0;
+	int pending = 0;
+	int failed = 0;
+	int id = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += BD3WS_FastCGIQueueTimeout;
+
+	pthread_mutex_lock(&(route->mutex));
+
+	while (1)
+	{
+		// Find the least busy open connection with spare capacity.
+		best = NULL;
+		open = 0;
+		pending = 0;
+		for (int i = 0; i < BD3WS_FastCGIPoolSize; ++i)
+		{
+			connection = &(route->connections[i]);
+			open += (-1 != connection->socket);
+			pending += connection->connecting;
+			if (-1 != connection->socket && !connection->stalled && connection->active < connection->capacity && (NULL == best || connection->active < best->active))
+			{
+				best = connection;
+			}
+		}
+		//
+
+		// Open another pooled connection rather than queueing behind a busy one. The 
+		// slot is reserved while connecting so that the route mutex is not held 
+		// across a slow upstream; the pool is searched again afterwards.
+		if ((NULL == best || 0 < best->active) && !failed)
+		{
+			connection = NULL;
+			for (int i = 0; i < BD3WS_FastCGIPoolSize && NULL == connection; ++i)
+			{
+				if (-1 == route->connections[i].socket && !route->connections[i].connecting)
+				{
+					connection = &(route->connections[i]);
+				}
+			}
+
+			if (NULL != connection)
+			{
+				connection->connecting = 1;
+				pthread_mutex_unlock(&(route->mutex));
+				failed = (-1 == fastcgi_connect(connection));
+				pthread_mutex_lock(&(route->mutex));
+				continue;
+			}
+		}
+		//
+
+		// Rather than wait behind connections stalled by slow clients, give up on their requests; the connections take requests 
+		// again as soon as their readers move on (or, if they do not multiplex, once the backend ends the request).
+		for (int i = 0; i < BD3WS_FastCGIPoolSize && NULL == best; ++i)
+		{
+			connection = &(route->connections[i]);
+			if (-1 != connection->socket && connection->stalled)
+			{
+				for (id = 0; id < BD3WS_FastCGIMaxRequests; ++id)
+				{
+					if (NULL != connection->requests[id])
+					{
+						stream_fail(connection->requests[id]->stream);
+					}
+				}
+				connection->stalled = 0;
+				best = (connection->active < connection->capacity) ? connection : NULL;
+			}
+		}
+		//
+
+		if (NULL != best)
+		{
+			break;
+		}
+
+		// Give up if the upstream is unreachable, or if nothing frees up in time.
+		if ((failed && 0 == open && 0 == pending) || ETIMEDOUT == pthread_cond_timedwait(&(route->available), &(route->mutex), &deadline))
+		{
+			pthread_mutex_unlock(&(route->mutex));
+			return NULL;
+		}
+		//
+	}
+
+	// Claim a free request ID on the connection.
+	for (id = 0; id < best->capacity && NULL != best->requests[id]; ++id)
+	{
+	}
+
+	best->requests[id] = request;
+	++best->active;
+	request->generation = best->generation;
+	*generation = best->generation;
+	*request_id = id + 1;
+	//
+
+	pthread_mutex_unlock(&(route->mutex));
+
+	return best;
+}
+
+/******************************************************************************
+	fastcgi_connect: Opens a pooled upstream connection reserved by 
+fastcgi_acquire() (without the route mutex held; the connect is bounded by 
+BD3WS_FastCGIConnectTimeout), asks the backend whether it multiplexes requests 
+(FCGI_GET_VALUES), then publishes the connection and starts its reader thread. 
+Returns 0 on success, or -1 on failure.
+******************************************************************************/
+int fastcgi_connect(BD3WS_FastCGIConnection* connection)
+{
+	char buffer[BD3WS_MaxLengthData];
+	char params[64];
+	unsigned char record[8 + FCGI_MaxLengthContent + 255];
+	struct sockaddr_storage address;
+	struct pollfd upstream_poll;
+	socklen_t address_size = 0;
+	unsigned long params_length = 0;
+	unsigned long content_length = 0;
+	unsigned long position = 0;
+	unsigned long name_length = 0;
+	unsigned long value_length = 0;
+	socklen_t error_size = sizeof(int);
+	pthread_t reader;
+	int multiplexed = 0;
+	int maximum = BD3WS_FastCGIMaxRequests;
+	int upstream = -1;
+	int status = -1;
+	int error = 0;
+	int optval = 1;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	// Connect to the upstream without blocking past the connect timeout.
+	if (-1 != resolve_address(connection->route->address, 0, &address, &address_size)
+		&& -1 != (upstream = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+	{
+		status = connect(upstream, (struct sockaddr*)&address, address_size);
+		if (-1 == status && EINPROGRESS == errno)
+		{
+			upstream_poll.fd = upstream;
+			upstream_poll.events = POLLOUT;
+			if (1 != poll(&upstream_poll, 1, BD3WS_FastCGIConnectTimeout))
+			{
+				errno = ETIMEDOUT;
+			}
+			else if (0 == getsockopt(upstream, SOL_SOCKET, SO_ERROR, &error, &error_size) && 0 != error)
+			{
+				errno = error;
+			}
+			else
+			{
+				status = 0;
+			}
+		}
+	}
+
+	if (-1 == status || -1 == fcntl(upstream, F_SETFL, fcntl(upstream, F_GETFL) & ~O_NONBLOCK))
+	{
+		char error_buffer[256];
+		sprintf(buffer, "Cannot connect to FastCGI upstream %s! Details: %s\n", connection->route->address, strerror_r(errno, error_buffer, 256));
+		log(buffer, STDERR);
+		if (-1 != upstream)
+		{
+			close(upstream);
+		}
+		pthread_mutex_lock(&(connection->route->mutex));
+		connection->connecting = 0;
+		pthread_cond_broadcast(&(connection->route->available));
+		pthread_mutex_unlock(&(connection->route->mutex));
+		return -1;
+	}
+
+	if (AF_UNIX != address.ss_family)
+	{
+		setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	}
+	//
+
+	// Ask whether the backend multiplexes requests over one connection, and how many.
+	fastcgi_add_param(params, &params_length, "FCGI_MPXS_CONNS", "");
+	fastcgi_add_param(params, &params_length, "FCGI_MAX_REQS", "");
+	upstream_poll.fd = upstream;
+	upstream_poll.events = POLLIN;
+	if (0 == fastcgi_write_record(upstream, FCGI_GET_VALUES, 0, params, params_length)
+		&& 1 == poll(&upstream_poll, 1, BD3WS_FastCGIConnectTimeout)
+		&& 0 == read_fully(upstream, (char*)record, 8)
+		&& FCGI_GET_VALUES_RESULT == record[1]
+		&& 0 == read_fully(upstream, (char*)record + 8, ((record[4] << 8) | record[5]) + record[6]))
+	{
+		content_length = (record[4] << 8) | record[5];
+		position = 8;
+		while (position < 8 + content_length)
+		{
+			name_length = (record[position] & 0x80) ? ((record[position] & 0x7F) << 24) | (record[position + 1] << 16) | (record[position + 2] << 8) | record[position + 3] : record[position];
+			position += (record[position] & 0x80) ? 4 : 1;
+			value_length = (record[position] & 0x80) ? ((record[position] & 0x7F) << 24) | (record[position + 1] << 16) | (record[position + 2] << 8) | record[position + 3] : record[position];
+			position += (record[position] & 0x80) ? 4 : 1;
+			if (8 + content_length < position + name_length + value_length || sizeof(buffer) <= value_length)
+			{
+				break;
+			}
+
+			memcpy(buffer, record + position + name_length, value_length);
+			buffer[value_length] = '\0';
+			if (15 == name_length && 0 == memcmp(record + position, "FCGI_MPXS_CONNS", 15))
+			{
+				multiplexed = 0 == strcmp(buffer, "1");
+			}
+			else if (13 == name_length && 0 == memcmp(record + position, "FCGI_MAX_REQS", 13) && 0 < atoi(buffer))
+			{
+				maximum = (atoi(buffer) < maximum) ? atoi(buffer) : maximum;
+			}
+			position += name_length + value_length;
+		}
+		memset(buffer, 0, sizeof(buffer));
+	}
+	//
+
+	// Publish the connection and start reading responses from it.
+	pthread_mutex_lock(&(connection->route->mutex));
+	connection->socket = upstream;
+	connection->capacity = multiplexed ? maximum : 1;
+	connection->active = 0;
+	connection->connecting = 0;
+	if (0 != pthread_create(&reader, NULL, run_fastcgi_reader, connection))
+	{
+		connection->socket = -1;
+		close(upstream);
+		status = -1;
+	}
+	else
+	{
+		pthread_detach(reader);
+	}
+	pthread_cond_broadcast(&(connection->route->available));
+	pthread_mutex_unlock(&(connection->route->mutex));
+
+	if (-1 == status)
+	{
+		sprintf(buffer, "Cannot start reader for FastCGI upstream %s!\n", connection->route->address);
+		log(buffer, STDERR);
+		return -1;
+	}
+	//
+
+	sprintf(buffer, "Connected to FastCGI upstream %s (up to %d request(s) per connection).\n", connection->route->address, connection->capacity);
+	log(buffer, STDOUT);
+
+	return 0;
+}
+
+/******************************************************************************
+	run_fastcgi_reader: Reads records from a pooled upstream connection and 
+routes them by request ID: output goes to the request's response stream, 
+errors go to the log, and END_REQUEST completes the request. When the 
+connection is lost, every request in flight on it is failed and the connection 
+is closed so that it is reopened on demand.
+******************************************************************************/
+void* run_fastcgi_reader(void* connection_pointer)
+{
+	char buffer[BD3WS_MaxLengthData];
+	unsigned char header[8];
+	char* content = malloc(FCGI_MaxLengthContent + 255);
+	BD3WS_FastCGIConnection* connection = connection_pointer;
+	BD3WS_FastCGIRoute* route = connection->route;
+	BD3WS_FastCGIRequest* request = NULL;
+	unsigned long length = 0;
+	int upstream = connection->socket;
+	int request_id = 0;
+	int type = 0;
+	int stalled = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	while (NULL != content && 0 == read_fully(upstream, (char*)header, sizeof(header)))
+	{
+		type = header[1];
+		request_id = (header[2] << 8) | header[3];
+		length = (header[4] << 8) | header[5];
+		if (0 != read_fully(upstream, content, length + header[6]))
+		{
+			break;
+		}
+
+		// Find the request the record belongs to (management records have ID 0).
+		request = NULL;
+		pthread_mutex_lock(&(route->mutex));
+		if (1 <= request_id && BD3WS_FastCGIMaxRequests >= request_id)
+		{
+			request = connection->requests[request_id - 1];
+		}
+		pthread_mutex_unlock(&(route->mutex));
+
+		if (NULL == request)
+		{
+			continue;
+		}
+		//
+
+		// Output for a slow client whose stream is full would block the reader. A request alone on the connection is paced by its 
+		// client, and the connection is marked stalled meanwhile; one multiplexed with others would hold them all up, so it is 
+		// given up on.
+		stalled = 0;
+		if (FCGI_STDOUT == type && !request->failed && stream_full(request->stream))
+		{
+			pthread_mutex_lock(&(route->mutex));
+			stalled = connection->stalled = (1 == connection->active);
+			pthread_mutex_unlock(&(route->mutex));
+
+			if (!stalled)
+			{
+				sprintf(buffer, "Giving up on FastCGI request %d on %s for a slow client!\n", request_id, route->address);
+				log(buffer, STDERR);
+				stream_fail(request->stream);
+			}
+		}
+		//
+
+		if (FCGI_STDOUT == type)
+		{
+			fastcgi_receive_output(request, content, length);
+		}
+		else if (FCGI_STDERR == type && 0 < length)
+		{
+			snprintf(buffer, sizeof(buffer), "FastCGI upstream %s: %.*s\n", route->address, (int)length, content);
+			log(buffer, STDERR);
+		}
+		else if (FCGI_END_REQUEST == type)
+		{
+			fastcgi_end_request(connection, request_id);
+			continue;
+		}
+
+		// Once its slow client has caught up (or the request was given up on for another one), the connection takes requests again.
+		if (stalled)
+		{
+			pthread_mutex_lock(&(route->mutex));
+			connection->stalled = 0;
+			pthread_cond_broadcast(&(route->available));
+			pthread_mutex_unlock(&(route->mutex));
+		}
+		//
+
+		// Ask the backend to stop working on requests whose client went away, or that were given up on.
+		if (!request->aborted && (__atomic_load_n(&(request->stream->abandoned), __ATOMIC_RELAXED) || __atomic_load_n(&(request->stream->failed), __ATOMIC_RELAXED)))
+		{
+			request->aborted = 1;
+			fastcgi_send(connection, request->generation, FCGI_ABORT_REQUEST, request_id, NULL, 0);
+		}
+		//
+	}
+
+	free(content);
+
+	// Stop assigning requests to the connection, then fail those in flight.
+	pthread_mutex_lock(&(route->mutex));
+	connection->capacity = 0;
+	pthread_mutex_unlock(&(route->mutex));
+
+	for (int i = 0; i < BD3WS_FastCGIMaxRequests; ++i)
+	{
+		if (NULL != connection->requests[i])
+		{
+			fastcgi_end_request(connection, i + 1);
+		}
+	}
+	//
+
+	// Close the connection so that it is reopened on demand.
+	pthread_mutex_lock(&(route->mutex));
+	pthread_mutex_lock(&(connection->write_mutex));
+	close(upstream);
+	connection->socket = -1;
+	++connection->generation;
+	pthread_mutex_unlock(&(connection->write_mutex));
+	pthread_cond_broadcast(&(route->available));
+	pthread_mutex_unlock(&(route->mutex));
+	//
+
+	sprintf(buffer, "FastCGI upstream %s closed a pooled connection.\n", route->address);
+	log(buffer, STDOUT);
+
+	return NULL;
+}
+
+/******************************************************************************
+	fastcgi_receive_output: Handles FCGI_STDOUT data for a request. The CGI 
+header block (Status, Location and other fields) is collected first and 
+translated into an HTTP response header; everything after it is streamed to the 
+client as is.
+******************************************************************************/
+void fastcgi_receive_output(BD3WS_FastCGIRequest* request, const char* data, unsigned long length)
+{
+	char response_header[BD3WS_FastCGIMaxLengthHeader + BD3WS_MaxLengthAddress];
+	char* headers_end = NULL;
+	unsigned long copied = 0;
+	unsigned long body_start = 0;
+
+	if (request->failed)
+	{
+		return;
+	}
+
+	if (request->header_done)
+	{
+		stream_append(request->stream, data, length);
+		return;
+	}
+
+	// Collect the CGI header block.
+	copied = BD3WS_FastCGIMaxLengthHeader - 1 - request->header_length;
+	copied = (copied < length) ? copied : length;
+	memcpy(request->header + request->header_length, data, copied);
+	request->header_length += copied;
+	request->header[request->header_length] = '\0';
+
+	if (NULL != (headers_end = strstr(request->header, "\r\n\r\n")))
+	{
+		body_start = headers_end + 4 - request->header;
+	}
+	else if (NULL != (headers_end = strstr(request->header, "\n\n")))
+	{
+		body_start = headers_end + 2 - request->header;
+	}
+	else
+	{
+		// An oversized header block cannot be translated.
+		if (BD3WS_FastCGIMaxLengthHeader - 1 == request->header_length)
+		{
+			request->failed = 1;
+		}
+		return;
+		//
+	}
+
+	*headers_end = '\0';
+	//
+
+	// Translate the CGI header block; one that does not fit the response header fails the request.
+	if (-1 == fastcgi_translate_header(request->header, response_header, sizeof(response_header)))
+	{
+		request->failed = 1;
+		return;
+	}
+	//
+
+	// Stream the response header, then whatever body arrived along with it.
+	request->header_done = 1;
+	stream_append(request->stream, response_header, strlen(response_header));
+	stream_append(request->stream, request->header + body_start, request->header_length - body_start);
+	stream_append(request->stream, data + copied, length - copied);
+	//
+}
+
+/******************************************************************************
+	fastcgi_translate_header: Translates a CGI header block (Status, Location 
+and other fields, NUL terminated and without the blank line) into an HTTP 
+response header of at most size bytes. Returns -1 if it does not fit.
+******************************************************************************/
+int fastcgi_translate_header(const char* header, char* response_header, unsigned long size)
+{
+	const char* line = NULL;
+	const char* line_end = NULL;
+	unsigned long used = 0;
+	int written = 0;
+
+	// Status line: an explicit Status field, a redirect for a bare Location field, or 200 OK.
+	if (NULL != (line = strcasestr(header, "Status:")) && (line == header || '\n' == line[-1]))
+	{
+		line += 7;
+		while (' ' == *line)
+		{
+			++line;
+		}
+		line_end = line + strcspn(line, "\r\n");
+		written = snprintf(response_header, size, "HTTP/1.1 %.*s", (int)(line_end - line), line);
+	}
+	else if (NULL != (line = strcasestr(header, "Location:")) && (line == header || '\n' == line[-1]))
+	{
+		written = snprintf(response_header, size, "HTTP/1.1 302 Found");
+	}
+	else
+	{
+		written = snprintf(response_header, size, "%s", HTTP_200_OK);
+	}
+	if (0 > written || size - used <= (unsigned long)written)
+	{
+		return -1;
+	}
+	used += written;
+
+	written = snprintf(response_header + used, size - used, "\r\nServer: %s v%s\r\n", BD3WS_ServerName, BD3WS_ServerVersion);
+	if (0 > written || size - used <= (unsigned long)written)
+	{
+		return -1;
+	}
+	used += written;
+	//
+
+	// Copy the remaining header fields, normalizing line endings.
+	for (line = header; '\0' != *line; line = ('\0' == *line_end) ? line_end : line_end + 1)
+	{
+		line_end = line + strcspn(line, "\n");
+		if (line_end == line || (line_end - line == 1 && '\r' == *line) || 0 == strncasecmp(line, "Status:", 7))
+		{
+			continue;
+		}
+		written = snprintf(response_header + used, size - used, "%.*s\r\n", (int)(line_end - line - ('\r' == line_end[-1])), line);
+		if (0 > written || size - used <= (unsigned long)written)
+		{
+			return -1;
+		}
+		used += written;
+	}
+	written = snprintf(response_header + used, size - used, "Connection: close\r\n\r\n");
+	if (0 > written || size - used <= (unsigned long)written)
+	{
+		return -1;
+	}
+	used += written;
+	//
+
+	return used;
+}
+
+/******************************************************************************
+	fastcgi_end_request: Completes a request: removes it from its connection, 
+answers with a gateway error if no response header was produced, and finishes 
+its response stream.
+******************************************************************************/
+void fastcgi_end_request(BD3WS_FastCGIConnection* connection, int request_id)
+{
+	char response_header[BD3WS_MaxLengthData];
+	BD3WS_FastCGIRoute* route = connection->route;
+	BD3WS_FastCGIRequest* request = NULL;
+
+	memset(response_header, 0, sizeof(response_header));
+
+	// Free the request ID for reuse.
+	pthread_mutex_lock(&(route->mutex));
+	if (NULL != (request = connection->requests[request_id - 1]))
+	{
+		connection->requests[request_id - 1] = NULL;
+		--connection->active;
+		pthread_cond_broadcast(&(route->available));
+	}
+	pthread_mutex_unlock(&(route->mutex));
+	//
+
+	if (NULL == request)
+	{
+		return;
+	}
+
+	if (!request->header_done)
+	{
+		build_gateway_error_header(response_header);
+		stream_append(request->stream, response_header, strlen(response_header));
+	}
+
+	stream_finish(request->stream);
+	stream_release(request->stream);
+	free(request);
+}
+
+/******************************************************************************
+	fastcgi_send: Writes one record to a pooled upstream connection, unless the 
+connection was closed since the request was assigned to it. A failed write 
+shuts the connection down so that its reader fails every request on it. 
+Returns 0 on success, or -1 on failure.
+******************************************************************************/
+int fastcgi_send(BD3WS_FastCGIConnection* connection, unsigned long generation, int type, int request_id, const char* content, unsigned long length)
+{
+	int result = -1;
+
+	pthread_mutex_lock(&(connection->write_mutex));
+	if (generation == connection->generation && -1 != connection->socket)
+	{
+		result = fastcgi_write_record(connection->socket, type, request_id, content, length);
+		if (-1 == result)
+		{
+			shutdown(connection->socket, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&(connection->write_mutex));
+
+	return result;
+}
+
+/******************************************************************************
+	fastcgi_write_record: Writes one FastCGI record (header, content and 
+padding to a multiple of eight bytes). Returns 0 on success, or -1 on failure.
+******************************************************************************/
+int fastcgi_write_record(int socket, int type, int request_id, const char* content, unsigned long length)
+{
+	unsigned char header[8];
+	char padding[8];
+	unsigned char padding_length = (8 - (length % 8)) % 8;
+
+	if (FCGI_MaxLengthContent < length)
+	{
+		return -1;
+	}
+
+	memset(padding, 0, sizeof(padding));
+
+	header[0] = FCGI_VERSION_1;
+	header[1] = type;
+	header[2] = (request_id >> 8) & 0xFF;
+	header[3] = request_id & 0xFF;
+	header[4] = (length >> 8) & 0xFF;
+	header[5] = length & 0xFF;
+	header[6] = padding_length;
+	header[7] = 0;
+
+	if (-1 == write_fully(socket, (char*)header, sizeof(header)) || -1 == write_fully(socket, content, length) || -1 == write_fully(socket, padding, padding_length))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+	fastcgi_add_param: Appends a FastCGI name-value pair to a parameter 
+buffer of BD3WS_FastCGIMaxLengthParams bytes. Returns 0 on success, or -1 (and 
+leaves the buffer unchanged) if the pair does not fit.
+******************************************************************************/
+int fastcgi_add_param(char* params, unsigned long* length, const char* name, const char* value)
+{
+	unsigned long lengths[2] = { strlen(name), strlen(value) };
+	unsigned long position = *length;
+
+	if (BD3WS_FastCGIMaxLengthParams < position + 8 + lengths[0] + lengths[1] || FCGI_MaxLengthContent < position + 8 + lengths[0] + lengths[1])
+	{
+		return -1;
+	}
+
+	// Lengths below 128 take one byte; longer ones take four with the high bit set.
+	for (int i = 0; i < 2; ++i)
+	{
+		if (128 > lengths[i])
+		{
+			params[position++] = lengths[i];
+		}
+		else
+		{
+			params[position++] = ((lengths[i] >> 24) & 0x7F) | 0x80;
+			params[position++] = (lengths[i] >> 16) & 0xFF;
+			params[position++] = (lengths[i] >> 8) & 0xFF;
+			params[position++] = lengths[i] & 0xFF;
+		}
+	}
+	//
+
+	memcpy(params + position, name, lengths[0]);
+	position += lengths[0];
+	memcpy(params + position, value, lengths[1]);
+	position += lengths[1];
+
+	*length = position;
+
+	return 0;
+}
+
+/******************************************************************************
+	serve_http2: Serves an HTTP/2 connection (h2c) until it is closed. The 
+connection either opened with the HTTP/2 preface (prior knowledge), or is an 
+HTTP/1.1 request asking to upgrade, which then becomes stream 1. Streams are 
+multiplexed by this thread: it handles incoming frames as they arrive, and 
+interleaves response bodies across the open streams one DATA frame at a time, 
+within the flow control windows granted by the client. HTTP/2 responses are 
+therefore not queued on the send scheduler, but their DATA frames take from 
+the same rate limit buckets (see http2_take_tokens()).
+******************************************************************************/
+void serve_http2(int client, BD3WS_Request* request, int upgraded)
+{
+	char buffer[BD3WS_MaxLengthData];
+	unsigned char settings[BD3WS_MaxLengthData];
+	unsigned char server_settings[6] = { 0, HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, BD3WS_HTTP2MaxStreams };
+	BD3WS_HTTP2Session* session = NULL;
+	BD3WS_HTTP2Stream* stream = NULL;
+	struct pollfd descriptors[2];
+	unsigned long length = 0;
+	ssize_t received = 0;
+	long settings_length = 0;
+	int more = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	if (NULL == (session = calloc(1, sizeof(BD3WS_HTTP2Session))) || 0 != pipe2(session->wakeup, O_NONBLOCK | O_CLOEXEC))
+	{
+		sprintf(buffer, "Cannot serve HTTP/2 connection!\n");
+		log(buffer, STDERR);
+		free(session);
+		return;
+	}
+
+	session->client = client;
+	session->socket = server.clients[client].socket;
+	session->window = BD3WS_HTTP2DefaultWindow;
+	session->initial_window = BD3WS_HTTP2DefaultWindow;
+	session->decoder.max_size = BD3WS_HPACKTableSize;
+	session->tokens = BD3WS_SchedulerQuantum;
+	clock_gettime(CLOCK_MONOTONIC, &(session->refilled));
+	session->active = time(NULL);
+
+	// Switch protocols, taking the client's settings from the upgrade request.
+	if (upgraded)
+	{
+		get_request_header(request, "HTTP2-Settings", buffer, sizeof(buffer));
+		settings_length = decode_base64url(buffer, settings, sizeof(settings));
+		sprintf(buffer, "%s\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n", HTTP_101_SWITCHINGPROTOCOLS);
+		if (-1 == settings_length || 0 != settings_length % 6 || -1 == write_fully(session->socket, buffer, strlen(buffer)))
+		{
+			session->failed = 1;
+		}
+		else if (0 != http2_apply_settings(session, settings, settings_length))
+		{
+			session->failed = 1;
+		}
+	}
+	//
+
+	// Bytes that followed the request are the start of the HTTP/2 byte stream. The preface's request line was parsed as HTTP/1.x, so it is put back in front.
+	if (!upgraded)
+	{
+		memcpy(session->input, BD3WS_HTTP2Preface, 18);
+		session->input_length = 18;
+	}
+	if (0 < request->body_received)
+	{
+		length = sizeof(session->input) - session->input_length;
+		length = (request->body_received < length) ? request->body_received : length;
+		memcpy(session->input + session->input_length, request->body, length);
+		session->input_length += length;
+	}
+	//
+
+	// Our settings come first; the upgrade request is answered on stream 1.
+	http2_write_frame(session, HTTP2_SETTINGS, 0, 0, server_settings, sizeof(server_settings));
+	if (upgraded && !session->failed && NULL != (stream = calloc(1, sizeof(BD3WS_HTTP2Stream))))
+	{
+		memcpy(&(stream->request), request, sizeof(BD3WS_Request));
+		strcpy(stream->request.version, "HTTP/2.0");
+		stream->id = 1;
+		stream->window = session->initial_window;
+		stream->remote_closed = 1;
+		stream->response.file = -1;
+		session->streams[session->number_streams++] = stream;
+		session->last_stream_id = 1;
+		http2_start_response(session, stream);
+	}
+	//
+
+	http2_receive(session);
+
+	while (!session->failed)
+	{
+		// Wind down on shutdown or when idle: open streams are finished, but no new ones are accepted.
+		if (!session->goaway_sent && (shutdown_requested || (0 == session->number_streams && BD3WS_HTTP2IdleTimeout <= time(NULL) - session->active)))
+		{
+			http2_write_integer_frame(session, HTTP2_GOAWAY, 0, session->last_stream_id, HTTP2_NO_ERROR, 2);
+			session->goaway_sent = 1;
+		}
+		//
+
+		// Queue response frames and send as much as the socket takes. Responses wait for the client preface (and settings), which 
+		// after an upgrade follows the 101 response.
+		more = session->preface_received && http2_generate(session);
+		if (0 != http2_flush(session))
+		{
+			break;
+		}
+		//
+
+		if ((session->goaway_sent || session->goaway_received) && 0 == session->number_streams && session->output_sent == session->output_length)
+		{
+			break;
+		}
+
+		// Wait for frames from the client, room in the socket, output from an upstream, or (if response data is rate limited) the 
+		// throttle interval.
+		descriptors[0].fd = session->socket;
+		descriptors[0].events = POLLIN | ((more || session->output_sent < session->output_length) ? POLLOUT : 0);
+		descriptors[0].revents = 0;
+		descriptors[1].fd = session->wakeup[0];
+		descriptors[1].events = POLLIN;
+		descriptors[1].revents = 0;
+		if (-1 == poll(descriptors, 2, session->throttled ? BD3WS_SchedulerThrottleInterval : 1000) && EINTR != errno)
+		{
+			break;
+		}
+
+		if (descriptors[1].revents & POLLIN)
+		{
+			while (0 < read(session->wakeup[0], buffer, sizeof(buffer)))
+			{
+			}
+		}
+		//
+
+		// Handle incoming frames.
+		if (descriptors[0].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			received = recv(session->socket, session->input + session->input_length, sizeof(session->input) - session->input_length, 0);
+			if (0 == received || (-1 == received && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno))
+			{
+				break;
+			}
+			if (0 < received)
+			{
+				session->input_length += received;
+				session->active = time(NULL);
+				http2_receive(session);
+			}
+		}
+		//
+	}
+
+	// Send what is left of a GOAWAY frame, then close gracefully: unread frames from the client would otherwise make the kernel 
+	// reset the connection, discarding response data it has yet to deliver.
+	http2_flush(session);
+	shutdown(session->socket, SHUT_WR);
+	for (time_t deadline = time(NULL) + BD3WS_HTTP2LingerTimeout; time(NULL) < deadline; )
+	{
+		descriptors[0].fd = session->socket;
+		descriptors[0].events = POLLIN;
+		if (0 >= poll(descriptors, 1, 1000) || 0 >= recv(session->socket, session->input, sizeof(session->input), 0))
+		{
+			break;
+		}
+	}
+
+	while (0 < session->number_streams)
+	{
+		http2_close_stream(session, session->streams[0], -1);
+	}
+
+	for (int i = 0; i < session->decoder.count; ++i)
+	{
+		free(session->decoder.names[i]);
+		free(session->decoder.values[i]);
+	}
+
+	close(session->wakeup[0]);
+	close(session->wakeup[1]);
+	free(session->header_block);
+	free(session->output);
+	free(session);
+	//
+}
+
+/******************************************************************************
+	http2_receive: Handles the complete frames (and the connection preface) 
+in the input buffer, keeping any partial frame for later.
+******************************************************************************/
+void http2_receive(BD3WS_HTTP2Session* session)
+{
+	const unsigned char* frame = NULL;
+	unsigned long position = 0;
+	unsigned long length = 0;
+	unsigned int stream_id = 0;
+
+	while (!session->failed)
+	{
+		// The client connection preface.
+		if (!session->preface_received)
+		{
+			if (session->input_length - position < strlen(BD3WS_HTTP2Preface))
+			{
+				break;
+			}
+			if (0 != memcmp(session->input + position, BD3WS_HTTP2Preface, strlen(BD3WS_HTTP2Preface)))
+			{
+				http2_fail(session, HTTP2_PROTOCOL_ERROR);
+				break;
+			}
+			position += strlen(BD3WS_HTTP2Preface);
+			session->preface_received = 1;
+			continue;
+		}
+		//
+
+		// Frame header: 24-bit length, type, flags and 31-bit stream identifier.
+		if (session->input_length - position < 9)
+		{
+			break;
+		}
+
+		frame = session->input + position;
+		length = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+		stream_id = ((frame[5] & 0x7F) << 24) | (frame[6] << 16) | (frame[7] << 8) | frame[8];
+		if (BD3WS_HTTP2MaxFrameSize < length)
+		{
+			http2_fail(session, HTTP2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (session->input_length - position < 9 + length)
+		{
+			break;
+		}
+		//
+
+		http2_handle_frame(session, frame[3], frame[4], stream_id, frame + 9, length);
+		position += 9 + length;
+	}
+
+	memmove(session->input, session->input + position, session->input_length - position);
+	session->input_length -= position;
+}
+
+/******************************************************************************
+	http2_handle_frame: Handles one frame received from the client.
+******************************************************************************/
+void http2_handle_frame(BD3WS_HTTP2Session* session, int type, int flags, unsigned int stream_id, const unsigned char* payload, unsigned long length)
+{
+	BD3WS_HTTP2Stream* stream = http2_find_stream(session, stream_id);
+	unsigned char* block = NULL;
+	unsigned long offset = 0;
+	unsigned long padding = 0;
+	unsigned long increment = 0;
+
+	// Header blocks must not be interrupted by other frames, and CONTINUATION frames only ever continue one.
+	if (0 != session->header_block_stream && (HTTP2_CONTINUATION != type || stream_id != session->header_block_stream))
+	{
+		http2_fail(session, HTTP2_PROTOCOL_ERROR);
+		return;
+	}
+	if (HTTP2_CONTINUATION == type && 0 == session->header_block_stream)
+	{
+		http2_fail(session, HTTP2_PROTOCOL_ERROR);
+		return;
+	}
+	//
+
+	// Strip padding (and priority information) from DATA and HEADERS frames.
+	if ((HTTP2_DATA == type || HTTP2_HEADERS == type) && (flags & HTTP2_FLAG_PADDED))
+	{
+		if (0 == length)
+		{
+			http2_fail(session, HTTP2_PROTOCOL_ERROR);
+			return;
+		}
+		padding = payload[0];
+		offset = 1;
+	}
+	if (HTTP2_HEADERS == type && (flags & HTTP2_FLAG_PRIORITY))
+	{
+		offset += 5;
+	}
+	if (offset + padding > length)
+	{
+		http2_fail(session, HTTP2_PROTOCOL_ERROR);
+		return;
+	}
+	//
+
+	// DATA: request body, forwarded to a FastCGI upstream or discarded. The client is credited right away, on the 
+	// connection even for streams that are closed, or half closed by the client, which are reset with STREAM_CLOSED.
+	if (HTTP2_DATA == type)
+	{
+		if (0 == stream_id || (NULL == stream && stream_id > session->last_stream_id))
+		{
+			http2_fail(session, HTTP2_PROTOCOL_ERROR);
+			return;
+		}
+
+		if (0 < length)
+		{
+			http2_write_integer_frame(session, HTTP2_WINDOW_UPDATE, 0, length, 0, 1);
+		}
+
+		if (NULL != stream && !stream->remote_closed)
+		{
+			if (NULL != stream->upstream && 0 < length - offset - padding)
+			{
+				fastcgi_send(stream->upstream, stream->upstream_generation, FCGI_STDIN, stream->upstream_id, (const char*)payload + offset, length - offset - padding);
+			}
+
+			if (flags & HTTP2_FLAG_END_STREAM)
+			{
+				stream->remote_closed = 1;
+				if (NULL != stream->upstream)
+				{
+					fastcgi_send(stream->upstream, stream->upstream_generation, FCGI_STDIN, stream->upstream_id, NULL, 0);
+				}
+			}
+			else if (0 < length)
+			{
+				http2_write_integer_frame(session, HTTP2_WINDOW_UPDATE, stream_id, length, 0, 1);
+			}
+		}
+		else if (NULL != stream)
+		{
+			http2_close_stream(session, stream, HTTP2_STREAM_CLOSED);
+		}
+		else
+		{
+			http2_write_integer_frame(session, HTTP2_RST_STREAM, stream_id, HTTP2_STREAM_CLOSED, 0, 1);
+		}
+	}
+	//
+
+	// HEADERS and CONTINUATION: collect the header block until its last fragment.
+	else if (HTTP2_HEADERS == type || HTTP2_CONTINUATION == type)
+	{
+		if (0 == stream_id || (HTTP2_HEADERS == type && 0 == (stream_id & 1)))
+		{
+			http2_fail(session, HTTP2_PROTOCOL_ERROR);
+			return;
+		}
+
+		if (HTTP2_HEADERS == type)
+		{
+			session->header_block_stream = stream_id;
+			session->header_block_end_stream = flags & HTTP2_FLAG_END_STREAM;
+			session->header_block_length = 0;
+		}
+
+		if (BD3WS_HTTP2MaxLengthHeaderBlock < session->header_block_length + length - offset - padding
+			|| NULL == (block = realloc(session->header_block, session->header_block_length + length - offset - padding + 1)))
+		{
+			http2_fail(session, HTTP2_ENHANCE_YOUR_CALM);
+			return;
+		}
+		session->header_block = block;
+		memcpy(session->header_block + session->header_block_length, payload + offset, length - offset - padding);
+		session->header_block_length += length - offset - padding;
+
+		if (flags & HTTP2_FLAG_END_HEADERS)
+		{
+			http2_end_headers(session);
+		}
+	}
+	//
+
+	// RST_STREAM: the client cancelled a stream.
+	else if (HTTP2_RST_STREAM == type)
+	{
+		if (0 == stream_id || 4 != length)
+		{
+			http2_fail(session, (4 != length) ? HTTP2_FRAME_SIZE_ERROR : HTTP2_PROTOCOL_ERROR);
+			return;
+		}
+
+		if (NULL != stream)
+		{
+			http2_close_stream(session, stream, -1);
+		}
+	}
+	//
+
+	// SETTINGS: apply and acknowledge the client's settings.
+	else if (HTTP2_SETTINGS == type)
+	{
+		if (0 != stream_id || 0 != length % 6 || ((flags & HTTP2_FLAG_ACK) && 0 != length))
+		{
+			http2_fail(session, (0 != stream_id) ? HTTP2_PROTOCOL_ERROR : HTTP2_FRAME_SIZE_ERROR);
+			return;
+		}
+
+		if (!(flags & HTTP2_FLAG_ACK) && 0 == http2_apply_settings(session, payload, length))
+		{
+			http2_write_frame(session, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+		}
+	}
+	//
+
+	// PING: answer with the same payload.
+	else if (HTTP2_PING == type)
+	{
+		if (0 != stream_id || 8 != length)
+		{
+			http2_fail(session, (0 != stream_id) ? HTTP2_PROTOCOL_ERROR : HTTP2_FRAME_SIZE_ERROR);
+			return;
+		}
+
+		if (!(flags & HTTP2_FLAG_ACK))
+		{
+			http2_write_frame(session, HTTP2_PING, HTTP2_FLAG_ACK, 0, payload, length);
+		}
+	}
+	//
+
+	// GOAWAY: the client will not open further streams; finish the open ones.
+	else if (HTTP2_GOAWAY == type)
+	{
+		session->goaway_received = 1;
+	}
+	//
+
+	// WINDOW_UPDATE: the client grants more room for response data.
+	else if (HTTP2_WINDOW_UPDATE == type)
+	{
+		if (4 != length)
+		{
+			http2_fail(session, HTTP2_FRAME_SIZE_ERROR);
+			return;
+		}
+
+		increment = ((payload[0] & 0x7F) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+		if (0 == stream_id)
+		{
+			if (0 == increment || BD3WS_HTTP2MaxWindow < session->window + (long)increment)
+			{
+				http2_fail(session, (0 == increment) ? HTTP2_PROTOCOL_ERROR : HTTP2_FLOW_CONTROL_ERROR);
+				return;
+			}
+			session->window += increment;
+		}
+		else if (NULL != stream)
+		{
+			if (0 == increment || BD3WS_HTTP2MaxWindow < stream->window + (long)increment)
+			{
+				http2_close_stream(session, stream, (0 == increment) ? HTTP2_PROTOCOL_ERROR : HTTP2_FLOW_CONTROL_ERROR);
+				return;
+			}
+			stream->window += increment;
+		}
+	}
+	//
+
+	// PUSH_PROMISE: only servers may push.
+	else if (HTTP2_PUSH_PROMISE == type)
+	{
+		http2_fail(session, HTTP2_PROTOCOL_ERROR);
+	}
+	//
+
+	// PRIORITY and unknown frame types are ignored.
+}
+
+/******************************************************************************
+	http2_end_headers: Decodes a complete header block. A block on a new 
+stream opens it and starts its response; a block on an open stream carries 
+request trailers, and must end the stream. A block on a stream that is closed, 
+or half closed by the client, resets it with STREAM_CLOSED (RFC 9113, section 
+5.1). Every block is decoded, even for refused streams, as header compression 
+state is shared by the whole connection.
+******************************************************************************/
+void http2_end_headers(BD3WS_HTTP2Session* session)
+{
+	char buffer[BD3WS_MaxLengthData];
+	unsigned int stream_id = session->header_block_stream;
+	BD3WS_HTTP2Stream* stream = http2_find_stream(session, stream_id);
+	BD3WS_Request trailers;
+	int decoded = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	session->header_block_stream = 0;
+
+	// Trailers end the request body of an open stream. Stream IDs up to the last one opened name streams that are 
+	// gone (or were skipped, which closes them).
+	if (NULL != stream || stream_id <= session->last_stream_id)
+	{
+		memset(&trailers, 0, sizeof(trailers));
+		if (-1 == hpack_decode_block(&(session->decoder), session->header_block, session->header_block_length, &trailers))
+		{
+			http2_fail(session, HTTP2_COMPRESSION_ERROR);
+			return;
+		}
+
+		if (NULL == stream)
+		{
+			http2_write_integer_frame(session, HTTP2_RST_STREAM, stream_id, HTTP2_STREAM_CLOSED, 0, 1);
+		}
+		else if (stream->remote_closed)
+		{
+			http2_close_stream(session, stream, HTTP2_STREAM_CLOSED);
+		}
+		else if (!session->header_block_end_stream)
+		{
+			http2_close_stream(session, stream, HTTP2_PROTOCOL_ERROR);
+		}
+		else
+		{
+			stream->remote_closed = 1;
+			if (NULL != stream->upstream)
+			{
+				fastcgi_send(stream->upstream, stream->upstream_generation, FCGI_STDIN, stream->upstream_id, NULL, 0);
+			}
+		}
+		return;
+	}
+	//
+
+	// Open the stream.
+	if (NULL == (stream = calloc(1, sizeof(BD3WS_HTTP2Stream))))
+	{
+		http2_fail(session, HTTP2_INTERNAL_ERROR);
+		return;
+	}
+
+	strcpy(stream->request.version, "HTTP/2.0");
+	stream->request.body = stream->request.data;
+	decoded = hpack_decode_block(&(session->decoder), session->header_block, session->header_block_length, &(stream->request));
+	stream->id = stream_id;
+	stream->window = session->initial_window;
+	stream->remote_closed = session->header_block_end_stream;
+	stream->response.file = -1;
+	session->last_stream_id = stream_id;
+
+	if (-1 == decoded)
+	{
+		free(stream);
+		http2_fail(session, HTTP2_COMPRESSION_ERROR);
+		return;
+	}
+	//
+
+	// Reset requests without a method or path as malformed, and refuse streams beyond the concurrency limit or after 
+	// GOAWAY.
+	if ('\0' == stream->request.method[0] || '\0' == stream->request.path[0])
+	{
+		http2_write_integer_frame(session, HTTP2_RST_STREAM, stream_id, HTTP2_PROTOCOL_ERROR, 0, 1);
+		free(stream);
+		return;
+	}
+	if (session->goaway_sent || BD3WS_HTTP2MaxStreams <= session->number_streams)
+	{
+		http2_write_integer_frame(session, HTTP2_RST_STREAM, stream_id, HTTP2_REFUSED_STREAM, 0, 1);
+		free(stream);
+		return;
+	}
+	//
+
+	// Print client request.
+	strcat(buffer, "\n===========================================================\n");
+	strcat(buffer, "\t\t\tClient Request Header (HTTP/2): ");
+	strcat(buffer, "\n===========================================================\n");
+	snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer) - 64, "Stream %u: %s %s%s%s\n%s", stream_id, stream->request.method, stream->request.path, 
+		('\0' == stream->request.query[0]) ? "" : "?", stream->request.query, stream->request.headers);
+	strcat(buffer, "\n===========================================================\n");
+	log(buffer, NONE);
+	//
+
+	session->streams[session->number_streams++] = stream;
+	http2_start_response(session, stream);
+}
+
+/******************************************************************************
+	http2_apply_settings: Applies a SETTINGS payload from the client. Returns 
+0 on success, or -1 (after failing the connection) if a setting is invalid.
+******************************************************************************/
+int http2_apply_settings(BD3WS_HTTP2Session* session, const unsigned char* settings, unsigned long length)
+{
+	unsigned long identifier = 0;
+	unsigned long value = 0;
+
+	for (unsigned long i = 0; i + 6 <= length; i += 6)
+	{
+		identifier = (settings[i] << 8) | settings[i + 1];
+		value = ((unsigned long)settings[i + 2] << 24) | (settings[i + 3] << 16) | (settings[i + 4] << 8) | settings[i + 5];
+
+		// A new initial window size adjusts the windows of open streams by the difference, which must not take any of them 
+		// past the largest window.
+		if (HTTP2_SETTINGS_INITIAL_WINDOW_SIZE == identifier)
+		{
+			if (BD3WS_HTTP2MaxWindow < value)
+			{
+				http2_fail(session, HTTP2_FLOW_CONTROL_ERROR);
+				return -1;
+			}
+			for (int j = 0; j < session->number_streams; ++j)
+			{
+				if (BD3WS_HTTP2MaxWindow < session->streams[j]->window + (long)value - session->initial_window)
+				{
+					http2_fail(session, HTTP2_FLOW_CONTROL_ERROR);
+					return -1;
+				}
+			}
+			for (int j = 0; j < session->number_streams; ++j)
+			{
+				session->streams[j]->window += (long)value - session->initial_window;
+			}
+			session->initial_window = value;
+		}
+		//
+
+		// Frames are never sent larger than the minimum maximum size, so only validity is checked.
+		else if ((HTTP2_SETTINGS_MAX_FRAME_SIZE == identifier && (BD3WS_HTTP2MaxFrameSize > value || 16777215 < value))
+			|| (HTTP2_SETTINGS_ENABLE_PUSH == identifier && 1 < value))
+		{
+			http2_fail(session, HTTP2_PROTOCOL_ERROR);
+			return -1;
+		}
+		//
+
+		// The header table size only concerns our encoder, which never indexes.
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+	http2_start_response: Starts the response to a stream's request, either 
+from a FastCGI upstream or from the public directory.
+******************************************************************************/
+void http2_start_response(BD3WS_HTTP2Session* session, BD3WS_HTTP2Stream* stream)
+{
+	char response_header[BD3WS_MaxLengthData];
+	BD3WS_FastCGIRoute* route = find_fastcgi_route(stream->request.path);
+	BD3WS_Stream* body = NULL;
+
+	memset(response_header, 0, sizeof(response_header));
+
+	stream->head = (0 == strcmp(stream->request.method, "HEAD"));
+
+	// Dynamic routes: the upstream response arrives through a stream that wakes this connection.
+	if (NULL != route)
+	{
+		if (NULL != (body = stream_create(session->wakeup[1]))
+			&& NULL != (stream->upstream = fastcgi_begin_request(session->client, route, &(stream->request), body, &(stream->upstream_id), &(stream->upstream_generation))))
+		{
+			stream->response.stream = body;
+			if (stream->remote_closed)
+			{
+				fastcgi_send(stream->upstream, stream->upstream_generation, FCGI_STDIN, stream->upstream_id, NULL, 0);
+			}
+		}
+		else
+		{
+			// Without an upstream connection, answer with a gateway error right away.
+			if (NULL != body)
+			{
+				stream_release(body);
+				stream_release(body);
+			}
+			build_gateway_error_header(response_header);
+			if (NULL == (stream->response.header = strdup(response_header)))
+			{
+				http2_close_stream(session, stream, HTTP2_INTERNAL_ERROR);
+				return;
+			}
+			//
+		}
+	}
+	//
+
+	// Static files.
+	else if (0 != prepare_server_response(find_host(stream->request.host), stream->request.path, stream->request.accept, &(stream->response)))
+	{
+		http2_close_stream(session, stream, HTTP2_INTERNAL_ERROR);
+		return;
+	}
+	//
+
+	stream->responding = 1;
+}
+
+/******************************************************************************
+	http2_generate: Queues response frames for the open streams, one frame 
+per stream per round, so that their bodies are interleaved. Rounds continue 
+while streams make progress and the output buffer has room; streams whose 
+responses are complete are then closed. Returns 1 if it stopped because the 
+output buffer was full, or 0 if the streams have nothing more to send for now.
+******************************************************************************/
+int http2_generate(BD3WS_HTTP2Session* session)
+{
+	BD3WS_HTTP2Stream* stream = NULL;
+	int progress = 1;
+	int first = 0;
+
+	session->throttled = 0;
+	while (progress && !session->failed && BD3WS_HTTP2MaxBuffered > session->output_length - session->output_sent)
+	{
+		progress = 0;
+
+		// Start each round with the next stream in turn.
+		first = (0 < session->number_streams) ? session->next_stream % session->number_streams : 0;
+		session->next_stream = first + 1;
+		for (int i = 0; i < session->number_streams && !session->failed && BD3WS_HTTP2MaxBuffered > session->output_length - session->output_sent; ++i)
+		{
+			progress |= http2_send_response(session, session->streams[(first + i) % session->number_streams]);
+		}
+		//
+
+		// Close completed streams.
+		for (int i = 0; i < session->number_streams; )
+		{
+			stream = session->streams[i];
+			if (stream->done)
+			{
+				http2_close_stream(session, stream, stream->remote_closed ? -1 : HTTP2_NO_ERROR);
+			}
+			else
+			{
+				++i;
+			}
+		}
+		//
+	}
+
+	return progress;
+}
+
+/******************************************************************************
+	http2_send_response: Queues the next frame of a stream's response: the 
+response header, or one DATA frame as large as the flow control windows and 
+the rate limits allow. Returns 1 if a frame was queued, or 0 if the stream has 
+nothing to send.
+******************************************************************************/
+int http2_send_response(BD3WS_HTTP2Session* session, BD3WS_HTTP2Stream* stream)
+{
+	char response_header[BD3WS_MaxLengthData];
+	BD3WS_Transfer* response = &(stream->response);
+	BD3WS_Chunk* chunk = NULL;
+	unsigned char* payload = NULL;
+	unsigned long length = 0;
+	unsigned long copied = 0;
+	ssize_t bytes_read = 0;
+	long window = (session->window < stream->window) ? session->window : stream->window;
+	int end_stream = 0;
+
+	if (!stream->responding || stream->done)
+	{
+		return 0;
+	}
+
+	// Response header. An upstream delivers its translated header as the first chunk of its stream.
+	if (!stream->headers_sent)
+	{
+		if (NULL == response->header && NULL != response->stream)
+		{
+			pthread_mutex_lock(&(response->stream->mutex));
+			if (NULL != (chunk = response->stream->head))
+			{
+				response->stream->head = chunk->next;
+				response->stream->tail = (NULL == chunk->next) ? NULL : response->stream->tail;
+				response->stream->buffered -= chunk->length - chunk->sent;
+				pthread_cond_broadcast(&(response->stream->drained));
+			}
+			else if (response->stream->finished)
+			{
+				memset(response_header, 0, sizeof(response_header));
+				build_gateway_error_header(response_header);
+				response->header = strdup(response_header);
+			}
+			pthread_mutex_unlock(&(response->stream->mutex));
+
+			if (NULL != chunk && NULL != (response->header = malloc(chunk->length - chunk->sent + 1)))
+			{
+				memcpy(response->header, chunk->data + chunk->sent, chunk->length - chunk->sent);
+				response->header[chunk->length - chunk->sent] = '\0';
+			}
+			free(chunk);
+
+			if (NULL == response->header)
+			{
+				return 0;
+			}
+		}
+
+		end_stream = stream->head || (NULL == response->stream && 0 == response->body_length);
+		if (0 != http2_write_headers(session, stream->id, response->header, end_stream))
+		{
+			return 0;
+		}
+		stream->headers_sent = 1;
+		stream->done = end_stream;
+		return 1;
+	}
+	//
+
+	// A response its producer gave up on is reset.
+	if (NULL != response->stream && __atomic_load_n(&(response->stream->failed), __ATOMIC_RELAXED))
+	{
+		http2_close_stream(session, stream, HTTP2_INTERNAL_ERROR);
+		return 1;
+	}
+	//
+
+	length = (0 < window) ? window : 0;
+	length = (BD3WS_HTTP2MaxFrameSize < length) ? BD3WS_HTTP2MaxFrameSize : length;
+
+	// Data ready to send, as much of it as the rate limits allow. Only this thread takes data from the stream, so what is buffered 
+	// can only grow.
+	if (NULL != response->stream)
+	{
+		pthread_mutex_lock(&(response->stream->mutex));
+		length = (response->stream->buffered < length) ? response->stream->buffered : length;
+		pthread_mutex_unlock(&(response->stream->mutex));
+	}
+	else
+	{
+		length = (response->body_length - response->body_sent < length) ? response->body_length - response->body_sent : length;
+	}
+	length = http2_take_tokens(session, length);
+	//
+
+	// Streamed body: as much buffered data as fits, ending the stream once the upstream has finished.
+	if (NULL != response->stream)
+	{
+		pthread_mutex_lock(&(response->stream->mutex));
+		end_stream = response->stream->finished && response->stream->buffered == length;
+		if ((0 < length || end_stream) && NULL != (payload = http2_write_frame(session, HTTP2_DATA, end_stream ? HTTP2_FLAG_END_STREAM : 0, stream->id, NULL, length)))
+		{
+			while (copied < length && NULL != (chunk = response->stream->head))
+			{
+				bytes_read = chunk->length - chunk->sent;
+				bytes_read = (bytes_read < length - copied) ? bytes_read : length - copied;
+				memcpy(payload + copied, chunk->data + chunk->sent, bytes_read);
+				chunk->sent += bytes_read;
+				copied += bytes_read;
+				if (chunk->length == chunk->sent)
+				{
+					response->stream->head = chunk->next;
+					response->stream->tail = (NULL == chunk->next) ? NULL : response->stream->tail;
+					free(chunk);
+				}
+			}
+			response->stream->buffered -= length;
+			pthread_cond_broadcast(&(response->stream->drained));
+		}
+		pthread_mutex_unlock(&(response->stream->mutex));
+
+		if (NULL == payload)
+		{
+			return 0;
+		}
+	}
+	//
+
+	// Body from memory or file.
+	else
+	{
+		if (0 == length)
+		{
+			return 0;
+		}
+
+		end_stream = response->body_sent + length == response->body_length;
+		if (NULL == (payload = http2_write_frame(session, HTTP2_DATA, end_stream ? HTTP2_FLAG_END_STREAM : 0, stream->id, NULL, length)))
+		{
+			return 0;
+		}
+
+		if (NULL != response->content)
+		{
+			memcpy(payload, response->content + response->body_sent, length);
+		}
+		else
+		{
+			// A file that shrank underneath us cannot complete its response.
+			while (copied < length && 0 < (bytes_read = pread(response->file, payload + copied, length - copied, response->body_sent + copied)))
+			{
+				copied += bytes_read;
+			}
+			if (copied < length)
+			{
+				session->output_length -= 9 + length;
+				http2_close_stream(session, stream, HTTP2_INTERNAL_ERROR);
+				return 1;
+			}
+			//
+		}
+	}
+	//
+
+	session->window -= length;
+	stream->window -= length;
+	response->body_sent += length;
+	stream->done = end_stream;
+
+	return 1;
+}
+
+/******************************************************************************
+	http2_take_tokens: Takes up to the wanted number of bytes of response data 
+from the connection's rate limit bucket and the global one shared with the 
+send scheduler, refilling the connection's as scheduler_refill() does. Marks 
+the session as throttled if it was granted less. Returns the number of bytes 
+granted.
+******************************************************************************/
+long http2_take_tokens(BD3WS_HTTP2Session* session, long wanted)
+{
+	struct timespec now;
+	double limit = 0;
+	long granted = wanted;
+
+	if (0 < scheduler.connection_rate)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		limit = (scheduler.connection_rate / 10 > BD3WS_SchedulerQuantum) ? scheduler.connection_rate / 10 : BD3WS_SchedulerQuantum;
+		session->tokens += ((now.tv_sec - session->refilled.tv_sec) + (now.tv_nsec - session->refilled.tv_nsec) / 1e9) * scheduler.connection_rate;
+		session->tokens = (session->tokens > limit) ? limit : session->tokens;
+		session->refilled = now;
+		granted = (granted > session->tokens) ? session->tokens : granted;
+	}
+
+	granted = scheduler_take_tokens(granted);
+	session->tokens -= (0 < scheduler.connection_rate) ? granted : 0;
+	session->throttled |= granted < wanted;
+
+	return granted;
+}
+
+/******************************************************************************
+	http2_write_headers: Queues a response header as a HEADERS frame (and 
+CONTINUATION frames, if need be). The HTTP/1.x response header text is 
+translated: the status line becomes the :status field, field names are 
+lowercased, and connection-specific fields are dropped. Returns 0 on success, 
+or -1 on failure.
+******************************************************************************/
+int http2_write_headers(BD3WS_HTTP2Session* session, unsigned int stream_id, const char* response_header, int end_stream)
+{
+	unsigned char block[2 * (BD3WS_FastCGIMaxLengthHeader + BD3WS_MaxLengthAddress)];
+	char name[BD3WS_MaxLengthData];
+	char value[BD3WS_FastCGIMaxLengthHeader + BD3WS_MaxLengthAddress];
+	const char* line = NULL;
+	const char* line_end = NULL;
+	const char* colon = NULL;
+	unsigned long length = 0;
+	unsigned long position = 0;
+	unsigned long fragment = 0;
+	int value_length = 0;
+
+	// Status line.
+	memset(value, 0, sizeof(value));
+	if (1 != sscanf(response_header, "%*s %3[0-9]", value))
+	{
+		strcpy(value, "500");
+	}
+	hpack_encode_field(block, &length, sizeof(block), ":status", value);
+	//
+
+	// Header fields; fields that do not fit are dropped.
+	for (line = response_header + strcspn(response_header, "\n"); '\0' != *line; line = line_end)
+	{
+		line += ('\n' == *line);
+		line_end = line + strcspn(line, "\n");
+		if (NULL == (colon = memchr(line, ':', line_end - line)) || sizeof(name) <= colon - line)
+		{
+			continue;
+		}
+
+		for (int i = 0; i < colon - line; ++i)
+		{
+			name[i] = tolower((unsigned char)line[i]);
+		}
+		name[colon - line] = '\0';
+
+		for (++colon; colon < line_end && (' ' == *colon || '\t' == *colon); ++colon)
+		{
+		}
+		value_length = line_end - colon - (colon < line_end && '\r' == line_end[-1]);
+		snprintf(value, sizeof(value), "%.*s", value_length, colon);
+
+		if (0 != strcmp(name, "connection") && 0 != strcmp(name, "keep-alive") && 0 != strcmp(name, "proxy-connection")
+			&& 0 != strcmp(name, "transfer-encoding") && 0 != strcmp(name, "upgrade"))
+		{
+			hpack_encode_field(block, &length, sizeof(block), name, value);
+		}
+	}
+	//
+
+	// Split the header block into frames.
+	do
+	{
+		fragment = (BD3WS_HTTP2MaxFrameSize < length - position) ? BD3WS_HTTP2MaxFrameSize : length - position;
+		if (NULL == http2_write_frame(session, (0 == position) ? HTTP2_HEADERS : HTTP2_CONTINUATION,
+			((position + fragment == length) ? HTTP2_FLAG_END_HEADERS : 0) | ((0 == position && end_stream) ? HTTP2_FLAG_END_STREAM : 0), stream_id, block + position, fragment))
+		{
+			return -1;
+		}
+		position += fragment;
+	} while (position < length);
+	//
+
+	return 0;
+}
+
+/******************************************************************************
+	http2_write_frame: Queues a frame in the output buffer, copying its payload 
+unless the payload is NULL. Returns a pointer to the payload in the buffer, or 
+NULL (failing the connection) if the buffer cannot grow.
+******************************************************************************/
+unsigned char* http2_write_frame(BD3WS_HTTP2Session* session, int type, int flags, unsigned int stream_id, const void* payload, unsigned long length)
+{
+	unsigned char* frame = NULL;
+	unsigned long capacity = session->output_capacity;
+	char* output = NULL;
+
+	// Reclaim sent bytes first, then grow the buffer if needed.
+	if (0 < session->output_sent && session->output_capacity < session->output_length + 9 + length)
+	{
+		memmove(session->output, session->output + session->output_sent, session->output_length - session->output_sent);
+		session->output_length -= session->output_sent;
+		session->output_sent = 0;
+	}
+
+	while (capacity < session->output_length + 9 + length)
+	{
+		capacity = (0 == capacity) ? 2 * BD3WS_HTTP2MaxBuffered : 2 * capacity;
+	}
+
+	if (capacity != session->output_capacity)
+	{
+		if (NULL == (output = realloc(session->output, capacity)))
+		{
+			session->failed = 1;
+			return NULL;
+		}
+		session->output = output;
+		session->output_capacity = capacity;
+	}
+	//
+
+	frame = (unsigned char*)session->output + session->output_length;
+	frame[0] = (length >> 16) & 0xFF;
+	frame[1] = (length >> 8) & 0xFF;
+	frame[2] = length & 0xFF;
+	frame[3] = type;
+	frame[4] = flags;
+	frame[5] = (stream_id >> 24) & 0x7F;
+	frame[6] = (stream_id >> 16) & 0xFF;
+	frame[7] = (stream_id >> 8) & 0xFF;
+	frame[8] = stream_id & 0xFF;
+	if (NULL != payload)
+	{
+		memcpy(frame + 9, payload, length);
+	}
+	session->output_length += 9 + length;
+
+	return frame + 9;
+}
+
+/******************************************************************************
+	http2_write_integer_frame: Queues a frame whose payload is one or two 
+32-bit integers (WINDOW_UPDATE, RST_STREAM and GOAWAY frames).
+******************************************************************************/
+void http2_write_integer_frame(BD3WS_HTTP2Session* session, int type, unsigned int stream_id, unsigned long first, unsigned long second, int count)
+{
+	unsigned char payload[8];
+	unsigned long values[2] = { first, second };
+
+	for (int i = 0; i < count; ++i)
+	{
+		payload[4 * i] = (values[i] >> 24) & 0xFF;
+		payload[4 * i + 1] = (values[i] >> 16) & 0xFF;
+		payload[4 * i + 2] = (values[i] >> 8) & 0xFF;
+		payload[4 * i + 3] = values[i] & 0xFF;
+	}
+
+	http2_write_frame(session, type, 0, stream_id, payload, 4 * count);
+}
+
+/******************************************************************************
+	http2_flush: Sends queued frames until the socket would block. Returns 0 
+on success, or -1 if the connection is broken.
+******************************************************************************/
+int http2_flush(BD3WS_HTTP2Session* session)
+{
+	ssize_t sent = 0;
+
+	while (session->output_sent < session->output_length)
+	{
+		sent = send(session->socket, session->output + session->output_sent, session->output_length - session->output_sent, MSG_NOSIGNAL);
+		if (-1 == sent && EINTR == errno)
+		{
+			continue;
+		}
+		else if (-1 == sent && (EAGAIN == errno || EWOULDBLOCK == errno))
+		{
+			break;
+		}
+		else if (0 >= sent)
+		{
+			return -1;
+		}
+		session->output_sent += sent;
+	}
+
+	if (session->output_sent == session->output_length)
+	{
+		session->output_sent = 0;
+		session->output_length = 0;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+	http2_fail: Ends a connection on a protocol error, telling the client why 
+with a GOAWAY frame.
+******************************************************************************/
+void http2_fail(BD3WS_HTTP2Session* session, int error_code)
+{
+	char buffer[BD3WS_MaxLengthData];
+
+	memset(buffer, 0, sizeof(buffer));
+
+	sprintf(buffer, "Closing HTTP/2 connection on error %d!\n", error_code);
+	log(buffer, STDERR);
+
+	http2_write_integer_frame(session, HTTP2_GOAWAY, 0, session->last_stream_id, error_code, 2);
+	session->goaway_sent = 1;
+	session->failed = 1;
+}
+
+/******************************************************************************
+	http2_find_stream: Returns the open stream with the given identifier, or 
+NULL if there is none.
+******************************************************************************/
+BD3WS_HTTP2Stream* http2_find_stream(BD3WS_HTTP2Session* session, unsigned int stream_id)
+{
+	for (int i = 0; i < session->number_streams; ++i)
+	{
+		if (stream_id == session->streams[i]->id)
+		{
+			return session->streams[i];
+		}
+	}
+
+	return NULL;
+}
+
+/******************************************************************************
+	http2_close_stream: Closes a stream and releases its response, resetting 
+the stream with the given error code unless it is -1. An upstream request that 
+is still running (and not already given up on) is aborted.
+******************************************************************************/
+void http2_close_stream(BD3WS_HTTP2Session* session, BD3WS_HTTP2Stream* stream, int error_code)
+{
+	BD3WS_Transfer* response = &(stream->response);
+	int finished = 0;
+	int index = 0;
+
+	if (-1 != error_code)
+	{
+		http2_write_integer_frame(session, HTTP2_RST_STREAM, stream->id, error_code, 0, 1);
+	}
+
+	// Abandon the upstream response.
+	if (NULL != response->stream)
+	{
+		pthread_mutex_lock(&(response->stream->mutex));
+		finished = response->stream->finished || response->stream->failed;
+		response->stream->abandoned = 1;
+		pthread_cond_broadcast(&(response->stream->drained));
+		pthread_mutex_unlock(&(response->stream->mutex));
+
+		if (!finished && NULL != stream->upstream)
+		{
+			fastcgi_send(stream->upstream, stream->upstream_generation, FCGI_ABORT_REQUEST, stream->upstream_id, NULL, 0);
+		}
+		stream_release(response->stream);
+	}
+	//
+
+	free(response->name);
+	free(response->header);
+	free(response->content);
+	if (-1 != response->file)
+	{
+		close(response->file);
+	}
+
+	// Remove the stream, keeping the others in turn.
+	for (index = 0; index < session->number_streams && stream != session->streams[index]; ++index)
+	{
+	}
+	if (index < session->number_streams)
+	{
+		memmove(session->streams + index, session->streams + index + 1, (session->number_streams - index - 1) * sizeof(BD3WS_HTTP2Stream*));
+		--session->number_streams;
 	}
 	//
 
-	// Clean the file path.
-	clean_file_path(file_path);
+	free(stream);
+}
+
+/******************************************************************************
+	http2_add_request_field: Adds a decoded header field to a request. 
+Pseudo-header fields fill in the request line; other fields (and the 
+authority, as Host) are kept in HTTP/1.x form for get_request_header().
+******************************************************************************/
+void http2_add_request_field(BD3WS_Request* request, const char* name, const char* value)
+{
+	unsigned long used = strlen(request->headers);
+	char* query = NULL;
+
+	if (0 == strcmp(name, ":method"))
+	{
+		snprintf(request->method, sizeof(request->method), "%s", value);
+	}
+	else if (0 == strcmp(name, ":path"))
+	{
+		snprintf(request->path, sizeof(request->path), "%s", value);
+		if (NULL != (query = strchr(request->path, '?')))
+		{
+			*query = '\0';
+			snprintf(request->query, sizeof(request->query), "%s", query + 1);
+		}
+	}
+	else if (':' != name[0] || 0 == strcmp(name, ":authority"))
+	{
+		if (used + strlen(name) + strlen(value) + 3 < sizeof(request->headers))
+		{
+			sprintf(request->headers + used, "%s: %s\n", (':' == name[0]) ? "host" : name, value);
+		}
+
+		if (0 == strcmp(name, ":authority") || (0 == strcmp(name, "host") && '\0' == request->host[0]))
+		{
+			snprintf(request->host, sizeof(request->host), "%s", value);
+		}
+		else if (0 == strcmp(name, "accept"))
+		{
+			used = strlen(request->accept);
+			snprintf(request->accept + used, sizeof(request->accept) - used, "%s%s", (0 == used) ? "" : ", ", value);
+		}
+		else if (0 == strcmp(name, "content-length"))
+		{
+			request->content_length = atol(value);
+		}
+	}
+}
+
+/******************************************************************************
+	hpack_initialize: Builds the HPACK Huffman decoding tree from the code 
+table. Internal nodes are numbered from the root (0); leaves hold -(symbol + 1).
+******************************************************************************/
+void hpack_initialize()
+{
+	int nodes = 1;
+	int node = 0;
+	int bit = 0;
+
+	memset(hpack_huffman_tree, 0, sizeof(hpack_huffman_tree));
+
+	for (int symbol = 0; symbol < 257; ++symbol)
+	{
+		node = 0;
+		for (int i = BD3WS_HuffmanLengths[symbol] - 1; 0 < i; --i)
+		{
+			bit = (BD3WS_HuffmanCodes[symbol] >> i) & 1;
+			if (0 == hpack_huffman_tree[node][bit])
+			{
+				hpack_huffman_tree[node][bit] = nodes++;
+			}
+			node = hpack_huffman_tree[node][bit];
+		}
+		hpack_huffman_tree[node][BD3WS_HuffmanCodes[symbol] & 1] = -(symbol + 1);
+	}
+}
+
+/******************************************************************************
+	hpack_decode_block: Decodes an HPACK header block into a request, updating 
+the dynamic table. Returns 0 on success, or -1 if the block is malformed.
+******************************************************************************/
+int hpack_decode_block(BD3WS_HPACKTable* table, const unsigned char* block, unsigned long length, BD3WS_Request* request)
+{
+	char name[BD3WS_HPACKMaxLengthString];
+	char value[BD3WS_HPACKMaxLengthString];
+	const unsigned char* position = block;
+	const unsigned char* end = block + length;
+	unsigned long index = 0;
+	int representation = 0;
+	int fields = 0;
+
+	while (position < end)
+	{
+		representation = *position;
+
+		// Indexed field.
+		if (representation & 0x80)
+		{
+			if (-1 == hpack_decode_integer(&position, end, 7, &index) || -1 == hpack_lookup(table, index, name, value))
+			{
+				return -1;
+			}
+		}
+		//
+
+		// Dynamic table size update, only allowed at the start of a block.
+		else if (0x20 == (representation & 0xE0))
+		{
+			if (0 < fields || -1 == hpack_decode_integer(&position, end, 5, &index) || BD3WS_HPACKTableSize < index)
+			{
+				return -1;
+			}
+			table->max_size = index;
+			hpack_evict(table, 0);
+			continue;
+		}
+		//
+
+		// Literal field with an indexed or literal name. Incrementally indexed fields are added to the dynamic table.
+		else
+		{
+			if (-1 == hpack_decode_integer(&position, end, (representation & 0x40) ? 6 : 4, &index)
+				|| (0 != index && -1 == hpack_lookup(table, index, name, value))
+				|| (0 == index && -1 == hpack_decode_string(&position, end, name, sizeof(name)))
+				|| -1 == hpack_decode_string(&position, end, value, sizeof(value)))
+			{
+				return -1;
+			}
+
+			if (representation & 0x40)
+			{
+				hpack_insert(table, name, value);
+			}
+		}
+		//
+
+		http2_add_request_field(request, name, value);
+		++fields;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+	hpack_decode_integer: Decodes an HPACK integer with an N-bit prefix, 
+advancing the position. Returns 0 on success, or -1 if it is malformed.
+******************************************************************************/
+int hpack_decode_integer(const unsigned char** position, const unsigned char* end, int prefix, unsigned long* value)
+{
+	unsigned long maximum = (1 << prefix) - 1;
+	unsigned char byte = 0;
+	int shift = 0;
+
+	if (*position >= end)
+	{
+		return -1;
+	}
+
+	*value = *((*position)++) & maximum;
+	if (maximum > *value)
+	{
+		return 0;
+	}
+
+	do
+	{
+		if (*position >= end || 28 < shift)
+		{
+			return -1;
+		}
+		byte = *((*position)++);
+		*value += (unsigned long)(byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	return 0;
+}
 
-	// Open file.
-	file_handle = fopen(file_path, "r");
-	//
+/******************************************************************************
+	hpack_decode_string: Decodes an HPACK string literal (Huffman-coded or 
+not) into a buffer of the given size, advancing the position. Returns the 
+string length, or -1 if it is malformed or does not fit.
+******************************************************************************/
+int hpack_decode_string(const unsigned char** position, const unsigned char* end, char* string, unsigned long size)
+{
+	unsigned long length = 0;
+	unsigned long decoded = 0;
+	int huffman = 0;
+	int node = 0;
+	int next = 0;
+	int bits = 0;
+	int ones = 1;
+	int bit = 0;
 
-	// Check file existence to create proper response header.
-	if (NULL == file_handle)
-	{
-		char error_buffer[256];
-		strerror_r(errno, error_buffer, 256);
-		sprintf(buffer, "Cannot serve file: \"%s\"! Details: %s\n", file_path, error_buffer);
-		log(buffer, STDERR);
-		response_state = NOTFOUND;
-	}
-	else
+	if (*position >= end)
 	{
-		response_state = OK;
+		return -1;
 	}
-	//
 
-	// If HTTP 404 occurs, serve error 404 page.
-	if (NOTFOUND == response_state)
+	huffman = **position & 0x80;
+	if (-1 == hpack_decode_integer(position, end, 7, &length) || end - *position < length)
 	{
-		strcpy(file_path, BD3WS_FileHTTP404);
-		file_handle = fopen(file_path, "r");
-		stat(file_path, &file_stat);
+		return -1;
 	}
-	//
 
-	build_response_header(&file_stat, content_type, response_header, response_state);
-
-	// Send response header to client.
-	if (-1 == send(server.clients[client].socket, response_header, strlen(response_header), 0))
+	// Plain string.
+	if (!huffman)
 	{
-		char error_buffer[256];
-		strerror_r(errno, error_buffer, 256);
-		sprintf(buffer, "Cannot send response header to client! Details: %s\n", error_buffer);
-		log(buffer, STDERR);
-		fclose(file_handle);
-		return;
+		if (size <= length)
+		{
+			return -1;
+		}
+		memcpy(string, *position, length);
+		decoded = length;
 	}
 	//
 
-	// Read file and send it to client.
-	while (!feof(file_handle))
+	// Huffman-coded string: walk the tree bit by bit. The final partial code must be a prefix of EOS (all ones) shorter than a byte.
+	else
 	{
-		// Read requested file data.
-		bytes_read = fread(buffer, 1, BD3WS_MaxLengthData, file_handle);
-		//
-
-		// If there are no more bytes to read, quit serving file.
-		if (0 >= bytes_read)
+		for (unsigned long i = 0; i < length; ++i)
 		{
-			break;
+			for (int shift = 7; 0 <= shift; --shift)
+			{
+				bit = ((*position)[i] >> shift) & 1;
+				next = hpack_huffman_tree[node][bit];
+				if (0 > next)
+				{
+					if (256 == -next - 1 || size <= decoded + 1)
+					{
+						return -1;
+					}
+					string[decoded++] = -next - 1;
+					node = 0;
+					bits = 0;
+					ones = 1;
+				}
+				else
+				{
+					node = next;
+					++bits;
+					ones &= bit;
+				}
+			}
 		}
-		//
 
-		// Send requested file data to client.
-		if (-1 == send(server.clients[client].socket, buffer, BD3WS_MaxLengthData, 0))
+		if (7 < bits || !ones)
 		{
-			char error_buffer[256];
-			strerror_r(errno, error_buffer, 256);
-			sprintf(buffer, "Cannot send file data to client! Details: %s\n", error_buffer);
-			log(buffer, STDERR);
-			fclose(file_handle);
-			return;
+			return -1;
 		}
-		//
-
-		memset(buffer, 0, sizeof(buffer));
 	}
 	//
 
-	fclose(file_handle);
+	string[decoded] = '\0';
+	*position += length;
 
-	sprintf(buffer, "File \"%s\" sent successfully!\n", file_path);
-	log(buffer, STDOUT);
+	return decoded;
 }
 
 /******************************************************************************
-	build_response_header: Constructs the HTTP response header that will be 
-sent to a client.
+	hpack_lookup: Copies the name and value of a static or dynamic table entry 
+(buffers of BD3WS_HPACKMaxLengthString bytes). Returns 0 on success, or -1 if 
+there is no such entry.
 ******************************************************************************/
-void build_response_header(struct stat* file_stat, const char* content_type, char* response_header, BD3WS_HTTPResponseState response_state)
+int hpack_lookup(BD3WS_HPACKTable* table, unsigned long index, char* name, char* value)
 {
-	char buffer[BD3WS_MaxLengthData];
-
-	memset(buffer, 0, sizeof(buffer));
-
-	build_response_header_state(response_header, response_state);
-
-	strcat(response_header, "\n");
-	strcat(response_header, "Server: ");
-	strcat(response_header, BD3WS_ServerName);
-	strcat(response_header, " v");
-	strcat(response_header, BD3WS_ServerVersion);
-	strcat(response_header, "\n");
-
-	build_response_header_content(file_stat, content_type, response_header);
-
-	strcat(response_header, "\n\n");
+	unsigned long number_static = sizeof(BD3WS_HPACKStaticTable) / sizeof(BD3WS_HPACKStaticTable[0]);
 
-	strcat(buffer, "\n===========================================================\n");
-	strcat(buffer, "\t\t\tServer Response Header:");
-	strcat(buffer, "\n===========================================================\n");
-	strcat(buffer, response_header);
-	sprintf((buffer + strlen(buffer)), "\n===========================================================\n");
-	log(buffer, NONE);
-}
-
-/******************************************************************************
-	build_response_header_state: Constructs the HTTP status (200 OK, 404 NOT 
-FOUND, etc.) portion of the server HTTP response header.
-******************************************************************************/
-void build_response_header_state(char* response_header, BD3WS_HTTPResponseState response_state)
-{
-	// Determine HTTP response state of requested file.
-	if (OK == response_state)
+	if (1 <= index && number_static >= index)
 	{
-		strcat(response_header, HTTP_200_OK);
+		snprintf(name, BD3WS_HPACKMaxLengthString, "%s", BD3WS_HPACKStaticTable[index - 1][0]);
+		snprintf(value, BD3WS_HPACKMaxLengthString, "%s", BD3WS_HPACKStaticTable[index - 1][1]);
+		return 0;
 	}
-	else if (NOTFOUND == response_state)
+	else if (number_static < index && number_static + table->count >= index)
 	{
-		strcat(response_header, HTTP_404_NOTFOUND);
+		snprintf(name, BD3WS_HPACKMaxLengthString, "%s", table->names[index - number_static - 1]);
+		snprintf(value, BD3WS_HPACKMaxLengthString, "%s", table->values[index - number_static - 1]);
+		return 0;
 	}
-	//
+
+	return -1;
 }
 
 /******************************************************************************
-	build_response_header_content: Constructs the Content fields of the server 
-HTTP response header (Content-Type, Content-Length, etc.).
+	hpack_insert: Adds a field to the front of the dynamic table, evicting the 
+oldest entries to make room. A field larger than the table empties it.
 ******************************************************************************/
-void build_response_header_content(struct stat* file_stat, const char* content_type, char* response_header)
+void hpack_insert(BD3WS_HPACKTable* table, const char* name, const char* value)
 {
-	char file_size[16];
-
-	memset(file_size, 0, sizeof(file_size));
-
-	strcat(response_header, "Content-Type: ");
+	unsigned long size = strlen(name) + strlen(value) + 32;
+	char* name_copy = NULL;
+	char* value_copy = NULL;
 
-	// Content-Type: text/plain
-	if (0 == strcmp(CONTENT_TEXT_PLAIN, content_type))
+	hpack_evict(table, size);
+	if (table->max_size < size || NULL == (name_copy = strdup(name)) || NULL == (value_copy = strdup(value)))
 	{
-		strcat(response_header, CONTENT_TEXT_PLAIN);
-		// strcat(response_header, ";charset=UTF-8");
-		strcat(response_header, ";charset=Windows-1252");
+		free(name_copy);
+		return;
 	}
-	//
 
-	// Content-Type: text/html
-	else if (0 == strcmp(CONTENT_TEXT_HTML, content_type))
-	{
-		strcat(response_header, CONTENT_TEXT_HTML);
-		// strcat(response_header, ";charset=UTF-8");
-		strcat(response_header, ";charset=Windows-1252");
-	}
-	//
+	memmove(table->names + 1, table->names, table->count * sizeof(char*));
+	memmove(table->values + 1, table->values, table->count * sizeof(char*));
+	table->names[0] = name_copy;
+	table->values[0] = value_copy;
+	table->size += size;
+	++table->count;
+}
 
-	// Content-Type: text/css
-	else if (0 == strcmp(CONTENT_TEXT_CSS, content_type))
+/******************************************************************************
+	hpack_evict: Evicts the oldest dynamic table entries until room bytes more 
+fit within the maximum table size.
+******************************************************************************/
+void hpack_evict(BD3WS_HPACKTable* table, unsigned long room)
+{
+	while (0 < table->count && table->max_size < table->size + room)
 	{
-		strcat(response_header, CONTENT_TEXT_CSS);
+		--table->count;
+		table->size -= strlen(table->names[table->count]) + strlen(table->values[table->count]) + 32;
+		free(table->names[table->count]);
+		free(table->values[table->count]);
 	}
-	//
+}
 
-	// Content-Type: image/png
-	else if (0 == strcmp(CONTENT_IMAGE_PNG, content_type))
-	{
-		strcat(response_header, CONTENT_IMAGE_PNG);
-	}
-	//
+/******************************************************************************
+	hpack_encode_field: Appends a header field to an HPACK block: as an index 
+if the static table has the exact field, or else as a literal that is not 
+indexed (with an indexed name where possible). Responses never use the dynamic 
+table. Returns 0 on success, or -1 (leaving the block unchanged) if the field 
+does not fit.
+******************************************************************************/
+int hpack_encode_field(unsigned char* block, unsigned long* length, unsigned long capacity, const char* name, const char* value)
+{
+	unsigned long number_static = sizeof(BD3WS_HPACKStaticTable) / sizeof(BD3WS_HPACKStaticTable[0]);
+	unsigned long position = *length;
+	unsigned long index = 0;
 
-	// Content-Type: image/jpeg
-	else if (0 == strcmp(CONTENT_IMAGE_JPEG, content_type))
+	for (unsigned long i = 0; i < number_static; ++i)
 	{
-		strcat(response_header, CONTENT_IMAGE_JPEG);
+		if (0 == strcmp(name, BD3WS_HPACKStaticTable[i][0]))
+		{
+			if (0 == strcmp(value, BD3WS_HPACKStaticTable[i][1]))
+			{
+				return hpack_encode_integer(block, length, capacity, 7, 0x80, i + 1);
+			}
+			index = (0 == index) ? i + 1 : index;
+		}
 	}
-	//
 
-	// Content-Type: image/x-icon
-	else if (0 == strcmp(CONTENT_IMAGE_XICON, content_type))
+	if (-1 == hpack_encode_integer(block, &position, capacity, 4, 0x00, index)
+		|| (0 == index && (-1 == hpack_encode_integer(block, &position, capacity, 7, 0x00, strlen(name)) || capacity - position < strlen(name))))
 	{
-		strcat(response_header, CONTENT_IMAGE_XICON);
+		return -1;
 	}
-	//
-
-	// Content-Type: audio/webm
-	else if (0 == strcmp(CONTENT_AUDIO_WEBM, content_type))
+	if (0 == index)
 	{
-		strcat(response_header, CONTENT_AUDIO_WEBM);
+		memcpy(block + position, name, strlen(name));
+		position += strlen(name);
 	}
-	//
 
-	// Content-Tye: audio/ogg
-	else if (0 == strcmp(CONTENT_AUDIO_OGG, content_type))
+	if (-1 == hpack_encode_integer(block, &position, capacity, 7, 0x00, strlen(value)) || capacity - position < strlen(value))
 	{
-		strcat(response_header, CONTENT_AUDIO_OGG);
+		return -1;
 	}
-	//
+	memcpy(block + position, value, strlen(value));
+	*length = position + strlen(value);
 
-	// Content-Type: video/webm
-	else if (0 == strcmp(CONTENT_VIDEO_WEBM, content_type))
-	{
-		strcat(response_header, CONTENT_VIDEO_WEBM);
-	}
-	//
+	return 0;
+}
+
+/******************************************************************************
+	hpack_encode_integer: Appends an HPACK integer with an N-bit prefix, the 
+remaining bits of the first byte being the given flags. Returns 0 on success, 
+or -1 if it does not fit.
+******************************************************************************/
+int hpack_encode_integer(unsigned char* block, unsigned long* length, unsigned long capacity, int prefix, int flags, unsigned long value)
+{
+	unsigned long maximum = (1 << prefix) - 1;
+	unsigned long position = *length;
 
-	// Content-Type: video/ogg
-	else if (0 == strcmp(CONTENT_VIDEO_OGG, content_type))
+	if (capacity <= position)
 	{
-		strcat(response_header, CONTENT_VIDEO_OGG);
+		return -1;
 	}
-	//
 
-	// Content-Type: application/octet-stream
-	else if (0 == strcmp(CONTENT_APPLICATION_OCTETSTREAM, content_type))
+	if (maximum > value)
 	{
-		strcat(response_header, CONTENT_APPLICATION_OCTETSTREAM);
+		block[position++] = flags | value;
 	}
-	//
-
-	// Content-Type: */*
 	else
 	{
-		strcat(response_header, CONTENT_ANY);
+		block[position++] = flags | maximum;
+		for (value -= maximum; 128 <= value; value >>= 7)
+		{
+			if (capacity <= position)
+			{
+				return -1;
+			}
+			block[position++] = (value & 0x7F) | 0x80;
+		}
+		if (capacity <= position)
+		{
+			return -1;
+		}
+		block[position++] = value;
 	}
-	//
 
-	sprintf(file_size, "%d", file_stat->st_size);
-	strcat(response_header, "\nContent-Length: ");
-	strcat(response_header, file_size);
+	*length = position;
+
+	return 0;
 }
 
 /******************************************************************************
-	server_information: Constructs a string describing server program 
-meta-data (name, version, etc.).
+	decode_base64url: Decodes unpadded base64url text (as in HTTP2-Settings). 
+Returns the decoded length, or -1 if the text is invalid or does not fit.
 ******************************************************************************/
-void server_information(char* information)
+long decode_base64url(const char* text, unsigned char* data, unsigned long capacity)
 {
-	strcat(information, BD3WS_ServerName);
-	strcat(information, " ");
-	strcat(information, BD3WS_ServerVersion);
+	const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	const char* digit = NULL;
+	unsigned long bits = 0;
+	unsigned long length = 0;
+	int count = 0;
+
+	for (; '\0' != *text && '=' != *text; ++text)
+	{
+		if (NULL == (digit = strchr(alphabet, *text)))
+		{
+			return -1;
+		}
+
+		bits = (bits << 6) | (digit - alphabet);
+		count += 6;
+		if (8 <= count)
+		{
+			if (capacity <= length)
+			{
+				return -1;
+			}
+			count -= 8;
+			data[length++] = (bits >> count) & 0xFF;
+			bits &= (1 << count) - 1;
+		}
+	}
+
+	return length;
 }
 
 /******************************************************************************
-	log: Logs server activity in the system log file.
+	receive_client: Receives from a (non-blocking) client socket, waiting up 
+to BD3WS_ClientReceiveTimeout seconds for data to arrive. Returns the number 
+of bytes received, 0 at end of stream, or -1 on failure or timeout.
 ******************************************************************************/
-void log(const char* message, BD3WS_Output output)
+ssize_t receive_client(int socket, char* data, unsigned long length)
 {
-	// Lock the log mutex.
-	pthread_mutex_lock(&mutex_log);
-	//
+	struct pollfd descriptor;
+	ssize_t received = 0;
 
-	char log_message[BD3WS_MaxLengthData];
+	descriptor.fd = socket;
+	descriptor.events = POLLIN;
 
-	// Ensure that the log file is open.
-	if (NULL == log_handle)
+	while (-1 == (received = recv(socket, data, length, 0)) && (EAGAIN == errno || EWOULDBLOCK == errno))
 	{
-		// Ensure that if the log file is not open, it can be opened (or created, if necessary).
-		if (-1 == mkdir(BD3WS_LogDirectory, S_IRWXU | S_IRWXG | S_IROTH))
+		descriptor.revents = 0;
+		if (0 >= poll(&descriptor, 1, BD3WS_ClientReceiveTimeout * 1000))
 		{
-			// Unlock the log mutex before returning prematurely.
-			pthread_mutex_unlock(&mutex_log);
-			//
-
-			return;
+			return -1;
 		}
-		//
-
-		log_handle = fopen(BD3WS_Log, "w");
 	}
-	//
 
-	// Prepend a timestamp to the log message.
-	time_t log_time = time(NULL);
-	strftime(log_message, BD3WS_MaxLengthData, "%D %T", localtime(&log_time));
-	//
-	
+	return received;
+}
 
-	// Determine output to write to.
-	if (NONE == output)
-	{
-		// Print timestamp and raw message content only.
-		sprintf(log_message, "%s : %s", log_message, message);
-		//
-	}
-	else if (STDOUT == output)
-	{
-		// Denote message as an informational message.
-		sprintf(log_message, "%s (%s | Information): %s", log_message, BD3WS_ServerName, message);
-		//
+/******************************************************************************
+	write_fully: Writes all of a buffer to a socket, waiting for room in the 
+send buffer of non-blocking ones. Returns 0 on success, or -1 on failure.
+******************************************************************************/
+int write_fully(int socket, const char* data, unsigned long length)
+{
+	struct pollfd descriptor;
+	ssize_t written = 0;
 
-		// Write to stdout.
-		fprintf(stdout, "%s", log_message);
-		fflush(stdout);
-		//
-	}
-	else if (STDERR == output)
+	descriptor.fd = socket;
+	descriptor.events = POLLOUT;
+
+	while (0 < length)
 	{
-		// Denote message as an error message.
-		sprintf(log_message, "%s (%s | Error): %s", log_message, BD3WS_ServerName, message);
-		//
+		if (0 >= (written = send(socket, data, length, MSG_NOSIGNAL)))
+		{
+			if (-1 == written && EINTR == errno)
+			{
+				continue;
+			}
+			descriptor.revents = 0;
+			if (-1 == written && (EAGAIN == errno || EWOULDBLOCK == errno) && 0 < poll(&descriptor, 1, BD3WS_ClientReceiveTimeout * 1000))
+			{
+				continue;
+			}
+			return -1;
+		}
 
-		// Write to stdout.
-		fprintf(stdout, "%s", log_message);
-		fflush(stdout);
-		//
+		data += written;
+		length -= written;
 	}
-	//
-
-	// Write to log file.
-	fprintf(log_handle, "%s", log_message);
-	fflush(log_handle);
-	//
 
-	// Unlock the log mutex.
-	pthread_mutex_unlock(&mutex_log);
-	//
+	return 0;
 }
 
 /******************************************************************************
-	clean_file_path: Cleans up a given file path in-place. Currently, this
-simply means removing multiple successive path separators (forward slashes).
+	read_fully: Reads exactly length bytes from a blocking socket. Returns 0 on 
+success, or -1 on failure or end of stream.
 ******************************************************************************/
-void clean_file_path(char* file_path)
+int read_fully(int socket, char* data, unsigned long length)
 {
-	// Get the length of the file path.
-	unsigned int length = strlen(file_path);
-	///
-
-	// Initialize string iterators to the beginning of the string.
-	unsigned int trailing = 0;
-	unsigned int leading = 0;
-	//
+	ssize_t received = 0;
 
-	// Iterate through the string and remove redundant file path separators.
-	while (leading < length)
+	while (0 < length)
 	{
-		// If the iterators are offset from each other, redundant separators have been found and the string elements should be shifted.
-		if (trailing != leading)
-		{
-			file_path[trailing] = file_path[leading];
-		}
-		//
-
-		// If a path separator has been encountered, check for redundant separators immediately following it.
-		if (file_path[trailing] == '/')
+		if (0 >= (received = recv(socket, data, length, 0)))
 		{
-			// Move the leading iterator to the end of the redundant separator chain.
-			while (file_path[leading] == '/')
+			if (-1 == received && EINTR == errno)
 			{
-				++leading;
+				continue;
 			}
-			//
-
-			// Advance the trailing iterator to the new write-point (directly following the first, non-redundant separator).
-			++trailing;
-			//
+			return -1;
 		}
-		//
 
-		// If a path separator has not been encountered, continue iteration normally.
-		else
-		{
-			++trailing;
-			++leading;
-		}
-		//
+		data += received;
+		length -= received;
 	}
-	//
 
-	// Null-terminate the path.
-	file_path[trailing] = '\0';
-	//
+	return 0;
 }
\ No newline at end of file
@@ -3,16 +3,23 @@
 	BD3WS.h
 ******************************************************************************/
 
-// External header files.
+// External header files. The GNU extensions used (pipe2, accept4, strcasestr, 
+// strerror_r) must be requested before any system header is included.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <signal.h>
 #include <errno.h>
 #include <time.h>
+#include <strings.h>
+#include <ctype.h>
 //
 
 // Linux-specific header files.
@@ -20,7 +27,22 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <linux/openat2.h>
 #include <pthread.h>
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
 #endif
 //
 
@@ -32,39 +54,102 @@
 //
 
 // HTTP server response headers.
+const char* HTTP_101_SWITCHINGPROTOCOLS = "HTTP/1.1 101 Switching Protocols";
 const char* HTTP_200_OK = "HTTP/1.1 200 OK";
 const char* HTTP_404_NOTFOUND = "HTTP/1.1 404 NOT FOUND";
+const char* HTTP_502_BADGATEWAY = "HTTP/1.1 502 BAD GATEWAY";
 //
 
 // Media content types.
 const char* CONTENT_TEXT_PLAIN = "text/plain";
 const char* CONTENT_TEXT_HTML = "text/html";
+const char* CONTENT_TEXT_HTML_UTF8 = "text/html;charset=UTF-8";
 const char* CONTENT_TEXT_CSS = "text/css";
+const char* CONTENT_TEXT_JAVASCRIPT = "text/javascript";
 const char* CONTENT_IMAGE_JPEG = "image/jpeg";
 const char* CONTENT_IMAGE_PNG = "image/png";
+const char* CONTENT_IMAGE_GIF = "image/gif";
+const char* CONTENT_IMAGE_SVG = "image/svg+xml";
+const char* CONTENT_IMAGE_WEBP = "image/webp";
+const char* CONTENT_IMAGE_AVIF = "image/avif";
 const char* CONTENT_IMAGE_XICON = "image/x-icon";
 const char* CONTENT_AUDIO_WEBM = "audio/webm";
 const char* CONTENT_AUDIO_OGG = "audio/ogg";
 const char* CONTENT_VIDEO_WEBM = "video/webm";
 const char* CONTENT_VIDEO_OGG = "video/ogg";
+const char* CONTENT_APPLICATION_JSON = "application/json";
 const char* CONTENT_APPLICATION_OCTETSTREAM = "application/octet-stream";
 const char* CONTENT_ANY = "*/*";
 //
 
+// Extensions of alternative image representations looked for next to a 
+// requested image (logo.avif or logo.webp next to logo.png).
+const char* BD3WS_VariantExtensions[] = { "avif", "webp" };
+//
+
 // System constants.
 #define BD3WS_MaxLengthData 2048
 #define BD3WS_MaxNumberClients 128
+#define BD3WS_MaxNumberWorkers 64
+#define BD3WS_MaxNumberListeners 16
+#define BD3WS_MaxLengthAddress 256
+#define BD3WS_CacheNumberEntries 256
+#define BD3WS_CacheNumberProbes 4
+#define BD3WS_CacheMaxLengthEntry 65536
+#define BD3WS_DefaultDrainTimeout 60
+#define BD3WS_DefaultBacklog 1024
+#define BD3WS_DefaultDeferAccept 5
+#define BD3WS_DefaultFastOpen 256
+#define BD3WS_ClientReceiveTimeout 60
+#define BD3WS_UpgradeTimeout 10
+#define BD3WS_SchedulerQuantum 16384
+#define BD3WS_SchedulerSmallResponse 65536
+#define BD3WS_SchedulerThrottleInterval 10
+#define BD3WS_MaxNumberRoutes 16
+#define BD3WS_FastCGIPoolSize 4
+#define BD3WS_FastCGIMaxRequests 32
+#define BD3WS_FastCGIMaxLengthHeader 8192
+#define BD3WS_FastCGIMaxLengthParams 8192
+#define BD3WS_FastCGIMaxBuffered 4194304
+#define BD3WS_FastCGIConnectTimeout 1000
+#define BD3WS_FastCGIQueueTimeout 30
+#define BD3WS_MaxNumberHosts 32
+#define BD3WS_HostTableSize 64
+#define BD3WS_MaxNumberIndexFiles 8
+#define BD3WS_MaxLengthIndexFile 64
+#define BD3WS_DirectoryCacheNumberEntries 64
+#define BD3WS_MaxLengthListing 1048576
+#define BD3WS_NegativeCacheNumberEntries 1024
+#define BD3WS_NegativeCacheMaxLengthPath 256
+#define BD3WS_NegativeCacheLifetime 5
+#define BD3WS_MaxNumberVariants 4
+#define BD3WS_VariantCacheNumberEntries 256
+#define BD3WS_HTTP2MaxStreams 100
+#define BD3WS_HTTP2MaxFrameSize 16384
+#define BD3WS_HTTP2DefaultWindow 65535
+#define BD3WS_HTTP2MaxWindow 2147483647
+#define BD3WS_HTTP2MaxLengthHeaderBlock 65536
+#define BD3WS_HTTP2MaxBuffered 65536
+#define BD3WS_HTTP2IdleTimeout 60
+#define BD3WS_HTTP2LingerTimeout 5
+#define BD3WS_HPACKTableSize 4096
+#define BD3WS_HPACKMaxEntries 128
+#define BD3WS_HPACKMaxLengthString 8192
 
 const char* BD3WS_ServerName = "BD3WS";
 const char* BD3WS_ServerVersion = "0.1";
-const char* BD3WS_DefaultIP = "0.0.0.0";
-const char* BD3WS_DefaultPort = "33333";
+const char* BD3WS_DefaultAddress = "0.0.0.0:33333";
 const char* BD3WS_RootDirectory;
 const char* BD3WS_PublicDirectory = "public/";
 const char* BD3WS_SystemDirectory = "system/";
 const char* BD3WS_LogDirectory = "system/log/";
 const char* BD3WS_FileHTTP404 = "system/web/404.html";
+const char* BD3WS_FileDefault = "system/web/default.html";
+const char* BD3WS_DefaultIndexFiles = "index.html";
 const char* BD3WS_Log = "system/log/log.txt";
+const char* BD3WS_UpgradeSocket = "system/upgrade.sock";
+const char* BD3WS_UpgradeEnvironment = "BD3WS_UPGRADE_SOCKET";
+const char* BD3WS_HTTP2Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
 //
 
 // HTTP status codes.
@@ -72,9 +157,185 @@ typedef enum
 {
 	OK = 200,
 	NOTFOUND = 404,
+	BADGATEWAY = 502,
 } BD3WS_HTTPResponseState;
 //
 
+// FastCGI protocol (record types, roles and flags).
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_MaxLengthContent 65535
+//
+
+// HTTP/2 protocol (frame types, flags, settings and error codes).
+#define HTTP2_DATA 0
+#define HTTP2_HEADERS 1
+#define HTTP2_PRIORITY 2
+#define HTTP2_RST_STREAM 3
+#define HTTP2_SETTINGS 4
+#define HTTP2_PUSH_PROMISE 5
+#define HTTP2_PING 6
+#define HTTP2_GOAWAY 7
+#define HTTP2_WINDOW_UPDATE 8
+#define HTTP2_CONTINUATION 9
+#define HTTP2_FLAG_END_STREAM 0x1
+#define HTTP2_FLAG_ACK 0x1
+#define HTTP2_FLAG_END_HEADERS 0x4
+#define HTTP2_FLAG_PADDED 0x8
+#define HTTP2_FLAG_PRIORITY 0x20
+#define HTTP2_SETTINGS_HEADER_TABLE_SIZE 1
+#define HTTP2_SETTINGS_ENABLE_PUSH 2
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE 4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE 5
+#define HTTP2_NO_ERROR 0
+#define HTTP2_PROTOCOL_ERROR 1
+#define HTTP2_INTERNAL_ERROR 2
+#define HTTP2_FLOW_CONTROL_ERROR 3
+#define HTTP2_STREAM_CLOSED 5
+#define HTTP2_FRAME_SIZE_ERROR 6
+#define HTTP2_REFUSED_STREAM 7
+#define HTTP2_COMPRESSION_ERROR 9
+#define HTTP2_ENHANCE_YOUR_CALM 11
+//
+
+// HPACK static table (RFC 7541, Appendix A); index 1 is the first entry.
+const char* BD3WS_HPACKStaticTable[][2] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+//
+
+// HPACK Huffman code (RFC 7541, Appendix B): code and bit length of each 
+// symbol, with EOS as symbol 256.
+const unsigned int BD3WS_HuffmanCodes[257] =
+{
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	0x3fffffff
+};
+const unsigned char BD3WS_HuffmanLengths[257] =
+{
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+//
+
 // Output printing codes.
 typedef enum
 {
@@ -94,14 +355,375 @@ typedef struct
 } BD3WS_Client;
 //
 
-// Web server.
+// Shared content cache entry. The sequence number is odd while a writer owns 
+// the entry; readers copy the entry out and retry if the sequence changed. The 
+// owner is the pid of the writer holding the entry (0 if none), so that the 
+// supervisor can release entries held by a worker that died.
+typedef struct
+{
+	volatile unsigned int sequence;
+	volatile pid_t owner;
+	unsigned long hash;
+	char file_path[BD3WS_MaxLengthData];
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	time_t modified;
+	unsigned long length;
+	char content[BD3WS_CacheMaxLengthEntry];
+} BD3WS_CacheEntry;
+//
+
+// Shared content cache, mapped once by the supervisor and inherited by workers.
+typedef struct
+{
+	volatile unsigned long hits;
+	volatile unsigned long misses;
+	BD3WS_CacheEntry entries[BD3WS_CacheNumberEntries];
+} BD3WS_Cache;
+//
+
+// Client request.
 typedef struct
 {
+	char method[16];
+	char path[BD3WS_MaxLengthData];
+	char query[BD3WS_MaxLengthData];
+	char version[16];
+	char host[BD3WS_MaxLengthAddress];
+	char accept[BD3WS_MaxLengthData];
+	char headers[BD3WS_MaxLengthData];
+	char data[BD3WS_MaxLengthData];
+	char* body;
+	long body_received;
+	long content_length;
+} BD3WS_Request;
+//
+
+// Path recently found missing, so that repeated misses skip the file system.
+typedef struct
+{
+	unsigned long hash;
+	time_t expires;
+	char file_path[BD3WS_NegativeCacheMaxLengthPath];
+} BD3WS_NegativeEntry;
+//
+
+// Per-process cache of missing paths, bounded by replacing entries on collision.
+typedef struct
+{
+	pthread_mutex_t mutex;
+	BD3WS_NegativeEntry entries[BD3WS_NegativeCacheNumberEntries];
+} BD3WS_NegativeCache;
+//
+
+// Resolved directory request, valid as long as the directory is unmodified: 
+// the index file serving it, or else its generated listing (if any).
+typedef struct
+{
+	unsigned long hash;
+	char file_path[BD3WS_MaxLengthData];
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	int index;
+	char* listing;
+	unsigned long listing_length;
+} BD3WS_DirectoryEntry;
+//
+
+// Per-process cache of resolved directory requests, bounded by replacing 
+// entries on collision.
+typedef struct
+{
+	pthread_mutex_t mutex;
+	BD3WS_DirectoryEntry entries[BD3WS_DirectoryCacheNumberEntries];
+} BD3WS_DirectoryCache;
+//
+
+// Complete response (such as the 404 page) serialized once at startup.
+typedef struct
+{
+	char* name;
+	char* header;
+	char* content;
+	unsigned long header_length;
+	unsigned long content_length;
+} BD3WS_PreparedResponse;
+//
+
+// Name-based virtual host. Files are resolved beneath its document root 
+// descriptor, and cached under paths starting with the root, which keeps the 
+// content and negative caches of hosts with different roots apart.
+typedef struct
+{
+	char name[BD3WS_MaxLengthAddress];
+	char root[BD3WS_MaxLengthAddress];
+	char file_http404[BD3WS_MaxLengthAddress];
+	int directory;
+	BD3WS_PreparedResponse not_found;
+} BD3WS_Host;
+//
+
+// Representation of a resource, stored next to it under another extension.
+typedef struct
+{
+	char extension[16];
+	const char* content_type;
+	off_t size;
+} BD3WS_Variant;
+//
+
+// Variants of a file (the file itself being variant 0), valid as long as the 
+// file and its directory are unmodified.
+typedef struct
+{
+	unsigned long hash;
+	char file_path[BD3WS_MaxLengthData];
+	struct timespec modified;
+	struct timespec directory_modified;
+	int number_variants;
+	BD3WS_Variant variants[BD3WS_MaxNumberVariants];
+} BD3WS_VariantSet;
+//
+
+// Per-process cache of resolved variant sets.
+typedef struct
+{
+	pthread_mutex_t mutex;
+	BD3WS_VariantSet sets[BD3WS_VariantCacheNumberEntries];
+} BD3WS_VariantCache;
+//
+
+// Chunk of a streamed response body.
+typedef struct BD3WS_Chunk
+{
+	struct BD3WS_Chunk* next;
+	unsigned long length;
+	unsigned long sent;
+	char data[];
+} BD3WS_Chunk;
+//
+
+// Streamed response body, shared by a producer (such as a FastCGI upstream) 
+// and its consumer (the send scheduler or an HTTP/2 connection), which is woken 
+// through the wakeup descriptor. A producer that gives up on a stream marks it 
+// failed, and its consumer then resets the response instead of ending it. 
+// Freed once both have released it.
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t drained;
+	int wakeup;
+	BD3WS_Chunk* head;
+	BD3WS_Chunk* tail;
+	unsigned long buffered;
+	int finished;
+	int failed;
+	int abandoned;
+	int references;
+} BD3WS_Stream;
+//
+
+// Response transfers queued on the send scheduler. A transfer owns its client 
+// connection: the scheduler closes it and vacates the client once done.
+typedef struct BD3WS_Transfer
+{
+	int client;
+	char* name;
+	char* header;
+	unsigned long header_length;
+	unsigned long header_sent;
+	char* content;
+	int file;
+	BD3WS_Stream* stream;
+	int stream_finished;
+	off_t body_length;
+	off_t body_sent;
+	int small;
+	long deficit;
+	double tokens;
+	int blocked;
+	int throttled;
+	int waiting;
+	int failed;
+	struct BD3WS_Transfer* next;
+} BD3WS_Transfer;
+//
+
+// Send scheduler. Small responses are served ahead of bulk ones, and bulk 
+// responses share bandwidth by deficit round-robin. The global rate limit 
+// bucket is shared with HTTP/2 connections, under the mutex.
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	int wakeup[2];
+	BD3WS_Transfer* incoming;
+	BD3WS_Transfer* small;
+	BD3WS_Transfer* bulk;
+	long connection_rate;
+	long global_rate;
+	double global_tokens;
+	struct timespec global_refilled;
+	struct timespec refilled;
+} BD3WS_Scheduler;
+//
+
+// FastCGI request in flight on an upstream connection.
+typedef struct
+{
+	BD3WS_Stream* stream;
+	char header[BD3WS_FastCGIMaxLengthHeader];
+	unsigned long header_length;
+	unsigned long generation;
+	int header_done;
+	int failed;
+	int aborted;
+} BD3WS_FastCGIRequest;
+//
+
+// Persistent FastCGI upstream connection. Requests are multiplexed over it if 
+// the backend reports FCGI_MPXS_CONNS; request IDs index the requests array. 
+// The generation changes whenever the connection is closed, so that records 
+// for an old connection are never written to its replacement. A closed slot is 
+// marked connecting while a thread opens it outside the route mutex, and an 
+// open one is marked stalled while its reader waits for a slow client.
+typedef struct
+{
+	struct BD3WS_FastCGIRoute* route;
+	int socket;
+	int connecting;
+	int stalled;
+	int capacity;
+	int active;
+	unsigned long generation;
+	pthread_mutex_t write_mutex;
+	BD3WS_FastCGIRequest* requests[BD3WS_FastCGIMaxRequests];
+} BD3WS_FastCGIConnection;
+//
+
+// FastCGI route: requests under the path prefix are forwarded to the upstream 
+// at the address, over a pool of persistent connections.
+typedef struct BD3WS_FastCGIRoute
+{
+	char prefix[BD3WS_MaxLengthAddress];
+	char address[BD3WS_MaxLengthAddress];
+	pthread_mutex_t mutex;
+	pthread_cond_t available;
+	BD3WS_FastCGIConnection connections[BD3WS_FastCGIPoolSize];
+} BD3WS_FastCGIRoute;
+//
+
+// HPACK dynamic table of an HTTP/2 connection's header decoder. Entry 0 is the 
+// most recently inserted; size counts 32 bytes of overhead per entry.
+typedef struct
+{
+	char* names[BD3WS_HPACKMaxEntries];
+	char* values[BD3WS_HPACKMaxEntries];
+	int count;
+	unsigned long size;
+	unsigned long max_size;
+} BD3WS_HPACKTable;
+//
+
+// HTTP/2 stream: one request and its response on a shared connection. The 
+// response is described by a transfer like those of the send scheduler, but it 
+// is sent by the connection's own thread, in DATA frames.
+typedef struct
+{
+	unsigned int id;
+	BD3WS_Request request;
+	BD3WS_Transfer response;
+	long window;
+	int remote_closed;
+	int responding;
+	int headers_sent;
+	int head;
+	int done;
+	BD3WS_FastCGIConnection* upstream;
+	unsigned long upstream_generation;
+	int upstream_id;
+} BD3WS_HTTP2Stream;
+//
+
+// HTTP/2 connection (h2c). Frames are parsed from the input buffer, and frames 
+// to send are queued in the output buffer until the socket accepts them.
+typedef struct
+{
+	int client;
 	int socket;
-	char ip[INET6_ADDRSTRLEN];
-	unsigned short port;
-	struct addrinfo* info;
-	struct addrinfo hints;
+	int wakeup[2];
+	unsigned char input[2 * (9 + BD3WS_HTTP2MaxFrameSize)];
+	unsigned long input_length;
+	char* output;
+	unsigned long output_length;
+	unsigned long output_sent;
+	unsigned long output_capacity;
+	unsigned char* header_block;
+	unsigned long header_block_length;
+	unsigned int header_block_stream;
+	int header_block_end_stream;
+	BD3WS_HTTP2Stream* streams[BD3WS_HTTP2MaxStreams];
+	int number_streams;
+	int next_stream;
+	unsigned int last_stream_id;
+	long window;
+	long initial_window;
+	BD3WS_HPACKTable decoder;
+	int preface_received;
+	int goaway_sent;
+	int goaway_received;
+	int failed;
+	double tokens;
+	struct timespec refilled;
+	int throttled;
+	time_t active;
+} BD3WS_HTTP2Session;
+//
+
+// Listening sockets (TCP, or Unix domain for fronting by a local proxy).
+typedef struct
+{
+	int socket;
+	char address[BD3WS_MaxLengthAddress];
+	char unlink_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+} BD3WS_Listener;
+//
+
+// Options applied to the listening sockets; accepted connections inherit them. 
+// Buffer sizes of 0 keep the kernel defaults, and a zero defer_accept or 
+// fast_open turns the option off.
+typedef struct
+{
+	int backlog;
+	int send_buffer;
+	int receive_buffer;
+	int defer_accept;
+	int fast_open;
+	int no_delay;
+} BD3WS_SocketOptions;
+//
+
+// Web server.
+typedef struct
+{
+	BD3WS_Listener listeners[BD3WS_MaxNumberListeners];
+	int number_listeners;
+	int number_workers;
+	pid_t workers[BD3WS_MaxNumberWorkers];
+	int drain_timeout;
+	BD3WS_Host hosts[BD3WS_MaxNumberHosts];
+	int number_hosts;
+	int host_table[BD3WS_HostTableSize];
+	char index_files[BD3WS_MaxNumberIndexFiles][BD3WS_MaxLengthIndexFile];
+	int number_index_files;
+	int autoindex;
+	BD3WS_PreparedResponse default_page;
+	BD3WS_SocketOptions socket_options;
+	char** arguments;
+	BD3WS_FastCGIRoute routes[BD3WS_MaxNumberRoutes];
+	int number_routes;
 	// BD3WS_HTTPResponseState response_state;
 	BD3WS_Client clients[BD3WS_MaxNumberClients];
 } BD3WS_Server;
@@ -111,20 +733,129 @@ typedef struct
 void initialize(int argc, char** argv);
 void finalize(int exit_code);
 void process_CLA(int argc, char** argv);
+void add_listener(const char* address);
+void set_socket_option(const char* option);
+void add_virtual_host(const char* host);
+void set_index_files(const char* index_files);
+BD3WS_Host* find_host(const char* host);
+void tune_listener(BD3WS_Listener* listener);
+int resolve_address(const char* address, int passive, struct sockaddr_storage* storage, socklen_t* size);
 void setup_socket();
 void extract_connection_information();
+void serve_clients();
+void supervise_workers();
+pid_t spawn_worker(int worker);
+void handle_signal(int signal_number);
+int upgrade_server();
+void receive_listening_sockets(const char* upgrade_socket);
+int send_sockets(int connection, int* sockets, int count);
+int receive_sockets(int connection, int* sockets, int capacity);
+int count_active_clients();
 int accept_client();
 void* handle_client_request(void* client);
-void parse_client_request(int client, char* file_path, char* content_type);
-void send_server_response(int client, const char* file_name, const char* content_type);
-void build_response_header(struct stat* file_stat, const char* content_type, char* response_header, BD3WS_HTTPResponseState response_state);
+void parse_client_request(int client, BD3WS_Request* request);
+int get_request_header(BD3WS_Request* request, const char* name, char* value, unsigned long size);
+int send_server_response(int client, BD3WS_Host* host, const char* file_name, const char* accept);
+int prepare_server_response(BD3WS_Host* host, const char* file_name, const char* accept, BD3WS_Transfer* transfer);
+int resolve_path(const char* target, char* path, unsigned long size);
+int resolve_directory(BD3WS_Host* host, char* file_path, struct stat* directory_stat, char** listing, unsigned long* listing_length);
+char* build_directory_listing(BD3WS_Host* host, const char* relative_path, unsigned long* length);
+void write_listing_name(FILE* listing, const char* name, int link);
+int compare_listing_names(const void* first, const void* second);
+int open_beneath(int directory, const char* path, int flags);
+int stat_beneath(int directory, const char* path, struct stat* file_stat);
+int negative_lookup(const char* file_path);
+void negative_store(const char* file_path);
+void load_prepared_response(const char* file_path, BD3WS_HTTPResponseState response_state, BD3WS_PreparedResponse* response);
+int copy_prepared_response(BD3WS_PreparedResponse* response, BD3WS_Transfer* transfer);
+void resolve_variants(BD3WS_Host* host, const char* file_path, struct stat* file_stat, BD3WS_VariantSet* variants);
+int negotiate_variant(const char* accept, BD3WS_VariantSet* variants);
+double accept_quality(const char* accept, const char* content_type, int exact);
+const char* get_content_type(const char* file_path);
+void build_response_header(struct stat* file_stat, const char* content_type, const char* vary, char* response_header, BD3WS_HTTPResponseState response_state);
 void build_response_header_state(char* response_header, BD3WS_HTTPResponseState response_state);
-void build_response_header_content(struct stat* file_stat, const char* content_type, char* response_header);
+void build_response_header_content(struct stat* file_stat, const char* content_type, const char* vary, char* response_header);
+void build_gateway_error_header(char* response_header);
 void log(const char* format, int error);
+void clean_file_path(char* file_path);
+void scheduler_initialize();
+void schedule_transfer(BD3WS_Transfer* transfer);
+void* run_scheduler(void* unused);
+void scheduler_adopt();
+void scheduler_refill();
+long scheduler_take_tokens(long wanted);
+void scheduler_return_tokens(long unused);
+long scheduler_send(BD3WS_Transfer* transfer, long budget);
+void scheduler_demote();
+void scheduler_retire(BD3WS_Transfer** queue);
+void scheduler_wait();
+int transfer_pending(BD3WS_Transfer* transfer);
+BD3WS_Stream* stream_create(int wakeup);
+void stream_append(BD3WS_Stream* stream, const char* data, unsigned long length);
+void stream_finish(BD3WS_Stream* stream);
+int stream_full(BD3WS_Stream* stream);
+void stream_fail(BD3WS_Stream* stream);
+void stream_release(BD3WS_Stream* stream);
+void add_fastcgi_route(const char* route);
+BD3WS_FastCGIRoute* find_fastcgi_route(const char* path);
+int forward_fastcgi_request(int client, BD3WS_FastCGIRoute* route, BD3WS_Request* request);
+BD3WS_FastCGIConnection* fastcgi_begin_request(int client, BD3WS_FastCGIRoute* route, BD3WS_Request* request, BD3WS_Stream* stream, int* request_id, unsigned long* generation);
+BD3WS_FastCGIConnection* fastcgi_acquire(BD3WS_FastCGIRoute* route, BD3WS_FastCGIRequest* request, int* request_id, unsigned long* generation);
+int fastcgi_connect(BD3WS_FastCGIConnection* connection);
+void* run_fastcgi_reader(void* connection);
+void fastcgi_receive_output(BD3WS_FastCGIRequest* request, const char* data, unsigned long length);
+int fastcgi_translate_header(const char* header, char* response_header, unsigned long size);
+void fastcgi_end_request(BD3WS_FastCGIConnection* connection, int request_id);
+int fastcgi_send(BD3WS_FastCGIConnection* connection, unsigned long generation, int type, int request_id, const char* content, unsigned long length);
+int fastcgi_write_record(int socket, int type, int request_id, const char* content, unsigned long length);
+int fastcgi_add_param(char* params, unsigned long* length, const char* name, const char* value);
+void serve_http2(int client, BD3WS_Request* request, int upgraded);
+void http2_receive(BD3WS_HTTP2Session* session);
+void http2_handle_frame(BD3WS_HTTP2Session* session, int type, int flags, unsigned int stream_id, const unsigned char* payload, unsigned long length);
+void http2_end_headers(BD3WS_HTTP2Session* session);
+int http2_apply_settings(BD3WS_HTTP2Session* session, const unsigned char* settings, unsigned long length);
+void http2_start_response(BD3WS_HTTP2Session* session, BD3WS_HTTP2Stream* stream);
+int http2_generate(BD3WS_HTTP2Session* session);
+int http2_send_response(BD3WS_HTTP2Session* session, BD3WS_HTTP2Stream* stream);
+long http2_take_tokens(BD3WS_HTTP2Session* session, long wanted);
+int http2_write_headers(BD3WS_HTTP2Session* session, unsigned int stream_id, const char* response_header, int end_stream);
+unsigned char* http2_write_frame(BD3WS_HTTP2Session* session, int type, int flags, unsigned int stream_id, const void* payload, unsigned long length);
+void http2_write_integer_frame(BD3WS_HTTP2Session* session, int type, unsigned int stream_id, unsigned long first, unsigned long second, int count);
+int http2_flush(BD3WS_HTTP2Session* session);
+void http2_fail(BD3WS_HTTP2Session* session, int error_code);
+BD3WS_HTTP2Stream* http2_find_stream(BD3WS_HTTP2Session* session, unsigned int stream_id);
+void http2_close_stream(BD3WS_HTTP2Session* session, BD3WS_HTTP2Stream* stream, int error_code);
+void http2_add_request_field(BD3WS_Request* request, const char* name, const char* value);
+void hpack_initialize();
+int hpack_decode_block(BD3WS_HPACKTable* table, const unsigned char* block, unsigned long length, BD3WS_Request* request);
+int hpack_decode_integer(const unsigned char** position, const unsigned char* end, int prefix, unsigned long* value);
+int hpack_decode_string(const unsigned char** position, const unsigned char* end, char* string, unsigned long size);
+int hpack_lookup(BD3WS_HPACKTable* table, unsigned long index, char* name, char* value);
+void hpack_insert(BD3WS_HPACKTable* table, const char* name, const char* value);
+void hpack_evict(BD3WS_HPACKTable* table, unsigned long room);
+int hpack_encode_field(unsigned char* block, unsigned long* length, unsigned long capacity, const char* name, const char* value);
+int hpack_encode_integer(unsigned char* block, unsigned long* length, unsigned long capacity, int prefix, int flags, unsigned long value);
+long decode_base64url(const char* text, unsigned char* data, unsigned long capacity);
+ssize_t receive_client(int socket, char* data, unsigned long length);
+int write_fully(int socket, const char* data, unsigned long length);
+int read_fully(int socket, char* data, unsigned long length);
+void cache_initialize();
+unsigned long cache_hash(const char* file_path);
+long cache_lookup(const char* file_path, struct stat* file_stat, char* content, unsigned long capacity);
+void cache_store(const char* file_path, struct stat* file_stat, const char* content, unsigned long length);
+void cache_recover(pid_t pid);
 //
 
 // Global variables.
 BD3WS_Server server;
 pthread_mutex_t mutex_log = PTHREAD_MUTEX_INITIALIZER;
 FILE* log_handle;
+BD3WS_Cache* cache = NULL;
+BD3WS_Scheduler scheduler = { PTHREAD_MUTEX_INITIALIZER };
+BD3WS_VariantCache variant_cache = { PTHREAD_MUTEX_INITIALIZER };
+BD3WS_NegativeCache negative_cache = { PTHREAD_MUTEX_INITIALIZER };
+BD3WS_DirectoryCache directory_cache = { PTHREAD_MUTEX_INITIALIZER };
+volatile sig_atomic_t shutdown_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
+short hpack_huffman_tree[256][2];
 //
\ No newline at end of file
@@ -0,0 +1,707 @@
+/******************************************************************************
+	BD3WS Web Server
+	BD3WS_test.c
+******************************************************************************/
+
+// The server is compiled into the test program as is, with its entry point renamed.
+#define main BD3WS_main
+#include "BD3WS.c"
+#undef main
+//
+
+// Walking scratch directory trees.
+#include <ftw.h>
+//
+
+int number_checks = 0;
+int number_failures = 0;
+
+/******************************************************************************
+	check: Counts a check, reporting it if it did not pass.
+******************************************************************************/
+void check(int passed, const char* description)
+{
+	++number_checks;
+	if (!passed)
+	{
+		++number_failures;
+		printf("FAILED: %s\n", description);
+	}
+}
+
+/******************************************************************************
+	create_file: Creates a file (with a line of content) beneath a directory.
+******************************************************************************/
+void create_file(const char* directory, const char* name)
+{
+	char file_path[BD3WS_MaxLengthData];
+	FILE* file = NULL;
+
+	snprintf(file_path, sizeof(file_path), "%s%s", directory, name);
+	if (NULL != (file = fopen(file_path, "w")))
+	{
+		fprintf(file, "%s\n", name);
+		fclose(file);
+	}
+}
+
+/******************************************************************************
+	remove_entry: Removes one entry of a directory tree (for nftw()).
+******************************************************************************/
+int remove_entry(const char* path, const struct stat* path_stat, int flag, struct FTW* walk)
+{
+	return remove(path);
+}
+
+/******************************************************************************
+	test_hpack_integer: Checks HPACK integer decoding against the examples of
+RFC 7541 (Appendix C.1), and its handling of truncated and overlong input.
+******************************************************************************/
+void test_hpack_integer()
+{
+	const unsigned char ten[] = { 0x0A };
+	const unsigned char large[] = { 0x1F, 0x9A, 0x0A };
+	const unsigned char octet[] = { 0x2A };
+	const unsigned char truncated[] = { 0x1F, 0x9A };
+	const unsigned char overlong[] = { 0x1F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+	const unsigned char* position = NULL;
+	unsigned long value = 0;
+
+	position = ten;
+	check(0 == hpack_decode_integer(&position, ten + sizeof(ten), 5, &value) && 10 == value && ten + 1 == position, "HPACK integer 10 (5-bit prefix)");
+
+	position = large;
+	check(0 == hpack_decode_integer(&position, large + sizeof(large), 5, &value) && 1337 == value && large + 3 == position, "HPACK integer 1337 (5-bit prefix)");
+
+	position = octet;
+	check(0 == hpack_decode_integer(&position, octet + sizeof(octet), 8, &value) && 42 == value, "HPACK integer 42 (8-bit prefix)");
+
+	position = truncated;
+	check(-1 == hpack_decode_integer(&position, truncated + sizeof(truncated), 5, &value), "HPACK integer cut short");
+
+	position = overlong;
+	check(-1 == hpack_decode_integer(&position, overlong + sizeof(overlong), 5, &value), "HPACK integer too large");
+}
+
+/******************************************************************************
+	test_hpack_string: Checks HPACK string decoding, plain and Huffman-coded
+(RFC 7541, Appendix C.4), including invalid Huffman padding.
+******************************************************************************/
+void test_hpack_string()
+{
+	const unsigned char plain[] = { 0x0A, 'c', 'u', 's', 't', 'o', 'm', '-', 'k', 'e', 'y' };
+	const unsigned char host[] = { 0x8C, 0xF1, 0xE3, 0xC2, 0xE5, 0xF2, 0x3A, 0x6B, 0xA0, 0xAB, 0x90, 0xF4, 0xFF };
+	const unsigned char cache_control[] = { 0x86, 0xA8, 0xEB, 0x10, 0x64, 0x9C, 0xBF };
+	const unsigned char zero_padding[] = { 0x81, 0x00 };
+	const unsigned char long_padding[] = { 0x82, 0x1F, 0xFF };
+	const unsigned char* position = NULL;
+	char string[BD3WS_HPACKMaxLengthString];
+
+	hpack_initialize();
+
+	position = plain;
+	check(10 == hpack_decode_string(&position, plain + sizeof(plain), string, sizeof(string)) && 0 == strcmp(string, "custom-key") && plain + sizeof(plain) == position,
+		"HPACK plain string");
+
+	position = host;
+	check(15 == hpack_decode_string(&position, host + sizeof(host), string, sizeof(string)) && 0 == strcmp(string, "www.example.com"), "HPACK Huffman string www.example.com");
+
+	position = cache_control;
+	check(8 == hpack_decode_string(&position, cache_control + sizeof(cache_control), string, sizeof(string)) && 0 == strcmp(string, "no-cache"), "HPACK Huffman string no-cache");
+
+	position = host;
+	check(-1 == hpack_decode_string(&position, host + sizeof(host), string, 8), "HPACK Huffman string longer than the buffer");
+
+	position = host;
+	check(-1 == hpack_decode_string(&position, host + sizeof(host) - 1, string, sizeof(string)), "HPACK Huffman string cut short");
+
+	position = zero_padding;
+	check(-1 == hpack_decode_string(&position, zero_padding + sizeof(zero_padding), string, sizeof(string)), "HPACK Huffman padding that is not a prefix of EOS");
+
+	position = long_padding;
+	check(-1 == hpack_decode_string(&position, long_padding + sizeof(long_padding), string, sizeof(string)), "HPACK Huffman padding longer than 7 bits");
+}
+
+
+/******************************************************************************
+	test_hpack_block: Checks that dynamic table size updates are only taken at 
+the start of a header block.
+******************************************************************************/
+void test_hpack_block()
+{
+	const unsigned char leading[] = { 0x20, 0x3F, 0xE1, 0x1F, 0x82 };
+	const unsigned char trailing[] = { 0x82, 0x20 };
+	BD3WS_HPACKTable table;
+	BD3WS_Request request;
+
+	memset(&table, 0, sizeof(table));
+	memset(&request, 0, sizeof(request));
+	table.max_size = BD3WS_HPACKTableSize;
+	check(0 == hpack_decode_block(&table, leading, sizeof(leading), &request) && BD3WS_HPACKTableSize == table.max_size && 0 == strcmp(request.method, "GET"),
+		"HPACK table size updates at the start of a block");
+
+	memset(&request, 0, sizeof(request));
+	check(-1 == hpack_decode_block(&table, trailing, sizeof(trailing), &request), "HPACK table size update after a field refused");
+}
+
+/******************************************************************************
+	test_accept_quality: Checks q-value parsing and the choice of the most
+specific matching media range.
+******************************************************************************/
+void test_accept_quality()
+{
+	const char* accept = "image/webp;q=0.8, image/*; q=0.5,*/*;Q=0.1";
+
+	check(0.8 == accept_quality(accept, "image/webp", 0), "Accept: exact media range");
+	check(0.5 == accept_quality(accept, "image/avif", 0), "Accept: type/* media range");
+	check(0.1 == accept_quality(accept, "text/html", 0), "Accept: */* media range");
+	check(0 == accept_quality(accept, "image/avif", 1), "Accept: wildcards ignored for exact matches");
+	check(0.8 == accept_quality(accept, "IMAGE/WEBP", 1), "Accept: media types compared without case");
+	check(0 == accept_quality("text/html", "image/png", 0), "Accept: no matching media range");
+	check(0 == accept_quality("image/webp;q=0, */*", "image/webp", 0), "Accept: q=0 refuses a media type");
+	check(1 == accept_quality("image/webp;level=1;q=2", "image/webp", 0), "Accept: q-values capped at 1");
+	check(1 == accept_quality("image/png", "image/png", 0), "Accept: q-value defaults to 1");
+	check(1 == accept_quality("", "image/png", 0) && 0 == accept_quality("", "image/png", 1), "Accept: empty header value");
+}
+
+
+/******************************************************************************
+	test_resolve_path: Checks percent-decoding and dot-segment removal of
+request paths, and the rejection of malformed ones.
+******************************************************************************/
+void test_resolve_path()
+{
+	const char* cases[][2] =
+	{
+		{ "/", "" },
+		{ "/index.html", "index.html" },
+		{ "/a/./b//c/", "a/b/c" },
+		{ "/a/b/../c", "a/c" },
+		{ "/../../etc/passwd", "etc/passwd" },
+		{ "/a/%2e%2e/%2E%2E/b", "b" },
+		{ "/%61pp/x", "app/x" },
+		{ "/a%2fb", "a/b" },
+		{ "/white%20space", "white space" }
+	};
+	char long_path[2 * BD3WS_MaxLengthData];
+	char path[BD3WS_MaxLengthData];
+	char description[BD3WS_MaxLengthData];
+
+	for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+	{
+		sprintf(description, "resolve_path(\"%s\") is \"%s\"", cases[i][0], cases[i][1]);
+		check(0 == resolve_path(cases[i][0], path, sizeof(path)) && 0 == strcmp(path, cases[i][1]), description);
+	}
+
+	check(-1 == resolve_path("/a%00b", path, sizeof(path)), "resolve_path refuses encoded null bytes");
+	check(-1 == resolve_path("/%zz", path, sizeof(path)), "resolve_path refuses bad escapes");
+	check(-1 == resolve_path("/a%2", path, sizeof(path)), "resolve_path refuses cut escapes");
+	check(-1 == resolve_path("/abcdef/ghi", path, 8), "resolve_path refuses results longer than the buffer");
+
+	memset(long_path, 'a', sizeof(long_path) - 1);
+	long_path[0] = '/';
+	long_path[sizeof(long_path) - 1] = '\0';
+	check(-1 == resolve_path(long_path, path, sizeof(path)), "resolve_path refuses overlong paths");
+}
+
+
+/******************************************************************************
+	test_find_host: Checks virtual host lookup by Host header value, including
+name normalization and entries displaced by collisions in the host table.
+******************************************************************************/
+void test_find_host()
+{
+	char name[BD3WS_MaxLengthData];
+
+	strcpy(server.hosts[0].root, BD3WS_PublicDirectory);
+	server.number_hosts = 1;
+
+	add_virtual_host("example.com=sites/example");
+	add_virtual_host("Other.ORG=sites/other/,missing.html");
+	for (int i = 0; i < BD3WS_MaxNumberHosts - 3; ++i)
+	{
+		sprintf(name, "host%d.test=sites/%d", i, i);
+		add_virtual_host(name);
+	}
+
+	check(&(server.hosts[1]) == find_host("example.com") && 0 == strcmp(server.hosts[1].root, "sites/example/"), "Host example.com");
+	check(&(server.hosts[1]) == find_host("EXAMPLE.com:8080"), "Host names compared without case or port");
+	check(&(server.hosts[1]) == find_host("example.com."), "Host names compared without the trailing dot");
+	check(&(server.hosts[2]) == find_host("other.org") && 0 == strcmp(server.hosts[2].root, "sites/other/") && 0 == strcmp(server.hosts[2].file_http404, "missing.html"),
+		"Host other.org with its own 404 page");
+	check(&(server.hosts[0]) == find_host("unknown.test"), "Unknown hosts served by the default host");
+	check(&(server.hosts[0]) == find_host("[::1]:33333"), "Address literals served by the default host");
+	check(&(server.hosts[0]) == find_host(""), "Requests without a host served by the default host");
+
+	for (int i = 0; i < BD3WS_MaxNumberHosts - 3; ++i)
+	{
+		sprintf(name, "host%d.test", i);
+		check(&(server.hosts[3 + i]) == find_host(name), "Every host found in a full table");
+	}
+}
+
+
+/******************************************************************************
+	test_fastcgi_translate_header: Checks the translation of CGI header blocks
+into HTTP response headers, and the refusal of those that do not fit.
+******************************************************************************/
+void test_fastcgi_translate_header()
+{
+	char response_header[BD3WS_FastCGIMaxLengthHeader + BD3WS_MaxLengthAddress];
+	char header[BD3WS_FastCGIMaxLengthHeader];
+	char expected[BD3WS_MaxLengthData];
+	int length = 0;
+
+	sprintf(expected, "HTTP/1.1 200 OK\r\nServer: %s v%s\r\nContent-Type: text/plain\r\nX-Mixed: 1\r\nConnection: close\r\n\r\n", BD3WS_ServerName, BD3WS_ServerVersion);
+	length = fastcgi_translate_header("Content-Type: text/plain\r\nX-Mixed: 1", response_header, sizeof(response_header));
+	check(strlen(expected) == length && 0 == strcmp(response_header, expected), "FastCGI header without a status");
+
+	length = fastcgi_translate_header("Content-Type: text/plain\nX-Mixed: 1", response_header, sizeof(response_header));
+	check(strlen(expected) == length && 0 == strcmp(response_header, expected), "FastCGI header line endings normalized");
+
+	length = fastcgi_translate_header("Status: 404 Not Found\r\nContent-Type: text/html", response_header, sizeof(response_header));
+	check(0 < length && 0 == strncmp(response_header, "HTTP/1.1 404 Not Found\r\n", 24) && NULL == strstr(response_header, "Status:")
+		&& NULL != strstr(response_header, "\r\nContent-Type: text/html\r\n"), "FastCGI Status field becomes the status line");
+
+	length = fastcgi_translate_header("Location: /elsewhere", response_header, sizeof(response_header));
+	check(0 < length && 0 == strncmp(response_header, "HTTP/1.1 302 Found\r\n", 20) && NULL != strstr(response_header, "\r\nLocation: /elsewhere\r\n"),
+		"FastCGI bare Location field redirects");
+
+	length = fastcgi_translate_header("X-Status: 500\r\nContent-Type: text/plain", response_header, sizeof(response_header));
+	check(0 < length && 0 == strncmp(response_header, "HTTP/1.1 200 OK\r\n", 17), "FastCGI Status field only matched at the start of a line");
+
+	for (int i = 0; i < sizeof(header) / 2 - 1; ++i)
+	{
+		memcpy(header + 2 * i, "x\n", 2);
+	}
+	header[sizeof(header) - 2] = '\0';
+	check(-1 == fastcgi_translate_header(header, response_header, sizeof(response_header)), "FastCGI header growing past the response header refused");
+
+	check(-1 == fastcgi_translate_header("Content-Type: text/plain", response_header, 32), "FastCGI header longer than the buffer refused");
+}
+
+
+/******************************************************************************
+	create_session: Creates an HTTP/2 session as serve_http2() does, without a 
+client socket; frames it queues stay in its output buffer.
+******************************************************************************/
+BD3WS_HTTP2Session* create_session()
+{
+	BD3WS_HTTP2Session* session = calloc(1, sizeof(BD3WS_HTTP2Session));
+
+	session->socket = -1;
+	session->window = BD3WS_HTTP2DefaultWindow;
+	session->initial_window = BD3WS_HTTP2DefaultWindow;
+	session->decoder.max_size = BD3WS_HPACKTableSize;
+
+	return session;
+}
+
+/******************************************************************************
+	destroy_session: Releases a session made by create_session().
+******************************************************************************/
+void destroy_session(BD3WS_HTTP2Session* session)
+{
+	while (0 < session->number_streams)
+	{
+		http2_close_stream(session, session->streams[0], -1);
+	}
+	free(session->output);
+	free(session->header_block);
+	free(session);
+}
+
+/******************************************************************************
+	frame_error: Returns the error code of the first RST_STREAM or GOAWAY 
+frame queued on a session for a stream, or -1 if there is none.
+******************************************************************************/
+long frame_error(BD3WS_HTTP2Session* session, int type, unsigned int stream_id)
+{
+	const unsigned char* frame = (const unsigned char*)session->output;
+	const unsigned char* code = NULL;
+	unsigned long length = 0;
+
+	for (unsigned long offset = 0; offset + 9 <= session->output_length; offset += 9 + length)
+	{
+		length = (frame[offset] << 16) | (frame[offset + 1] << 8) | frame[offset + 2];
+		if (type == frame[offset + 3] && stream_id == (((frame[offset + 5] & 0x7F) << 24) | (frame[offset + 6] << 16) | (frame[offset + 7] << 8) | frame[offset + 8]))
+		{
+			code = frame + offset + 9 + ((HTTP2_GOAWAY == type) ? 4 : 0);
+			return ((long)code[0] << 24) | (code[1] << 16) | (code[2] << 8) | code[3];
+		}
+	}
+
+	return -1;
+}
+
+/******************************************************************************
+	test_http2_frames: Checks how HTTP/2 frames that break the protocol are 
+answered: with a stream error where the RFC allows it, or by failing the 
+connection.
+******************************************************************************/
+void test_http2_frames()
+{
+	const unsigned char get[] = { 0x82 };
+	const unsigned char root[] = { 0x84 };
+	const unsigned char get_root[] = { 0x82, 0x84 };
+	const unsigned char body[] = { 'b', 'o', 'd', 'y' };
+	unsigned char settings[6] = { 0, 0, 0, 0, 0, 0 };
+	BD3WS_HTTP2Session* session = NULL;
+	BD3WS_HTTP2Stream* stream = NULL;
+
+	// CONTINUATION without a header block in progress.
+	session = create_session();
+	http2_handle_frame(session, HTTP2_CONTINUATION, HTTP2_FLAG_END_HEADERS, 1, get, sizeof(get));
+	check(session->failed && HTTP2_PROTOCOL_ERROR == frame_error(session, HTTP2_GOAWAY, 0) && 0 == session->number_streams,
+		"HTTP/2 CONTINUATION without a header block fails the connection");
+	destroy_session(session);
+	//
+
+	// A new initial window size taking an open stream's window past 2^31-1.
+	session = create_session();
+	stream = calloc(1, sizeof(BD3WS_HTTP2Stream));
+	stream->id = 1;
+	stream->window = BD3WS_HTTP2MaxWindow - 10;
+	stream->response.file = -1;
+	session->streams[session->number_streams++] = stream;
+	session->last_stream_id = 1;
+	settings[1] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+	settings[3] = ((BD3WS_HTTP2DefaultWindow + 11) >> 16) & 0xFF;
+	settings[4] = ((BD3WS_HTTP2DefaultWindow + 11) >> 8) & 0xFF;
+	settings[5] = (BD3WS_HTTP2DefaultWindow + 11) & 0xFF;
+	check(-1 == http2_apply_settings(session, settings, sizeof(settings)) && HTTP2_FLOW_CONTROL_ERROR == frame_error(session, HTTP2_GOAWAY, 0)
+		&& BD3WS_HTTP2MaxWindow - 10 == stream->window, "HTTP/2 initial window size overflowing a stream window fails the connection");
+	destroy_session(session);
+
+	session = create_session();
+	settings[5] = (BD3WS_HTTP2DefaultWindow + 10) & 0xFF;
+	stream = calloc(1, sizeof(BD3WS_HTTP2Stream));
+	stream->id = 1;
+	stream->window = BD3WS_HTTP2MaxWindow - 10;
+	stream->response.file = -1;
+	session->streams[session->number_streams++] = stream;
+	check(0 == http2_apply_settings(session, settings, sizeof(settings)) && BD3WS_HTTP2MaxWindow == stream->window, "HTTP/2 initial window size up to the largest window");
+	destroy_session(session);
+	//
+
+	// DATA on a stream half closed by the client, and on one that is closed.
+	session = create_session();
+	stream = calloc(1, sizeof(BD3WS_HTTP2Stream));
+	stream->id = 3;
+	stream->remote_closed = 1;
+	stream->response.file = -1;
+	session->streams[session->number_streams++] = stream;
+	session->last_stream_id = 3;
+	http2_handle_frame(session, HTTP2_DATA, 0, 3, body, sizeof(body));
+	check(!session->failed && HTTP2_STREAM_CLOSED == frame_error(session, HTTP2_RST_STREAM, 3) && 0 == session->number_streams,
+		"HTTP/2 DATA on a half-closed stream resets it");
+
+	http2_handle_frame(session, HTTP2_DATA, 0, 1, body, sizeof(body));
+	check(!session->failed && HTTP2_STREAM_CLOSED == frame_error(session, HTTP2_RST_STREAM, 1), "HTTP/2 DATA on a closed stream resets it");
+	destroy_session(session);
+	//
+
+	// Requests without a method or path are malformed; well-formed ones are refused after GOAWAY.
+	session = create_session();
+	http2_handle_frame(session, HTTP2_HEADERS, HTTP2_FLAG_END_HEADERS | HTTP2_FLAG_END_STREAM, 1, get, sizeof(get));
+	check(!session->failed && HTTP2_PROTOCOL_ERROR == frame_error(session, HTTP2_RST_STREAM, 1), "HTTP/2 request without a path is malformed");
+
+	http2_handle_frame(session, HTTP2_HEADERS, HTTP2_FLAG_END_HEADERS | HTTP2_FLAG_END_STREAM, 3, root, sizeof(root));
+	check(!session->failed && HTTP2_PROTOCOL_ERROR == frame_error(session, HTTP2_RST_STREAM, 3), "HTTP/2 request without a method is malformed");
+
+	session->goaway_sent = 1;
+	http2_handle_frame(session, HTTP2_HEADERS, HTTP2_FLAG_END_HEADERS | HTTP2_FLAG_END_STREAM, 5, get_root, sizeof(get_root));
+	check(!session->failed && HTTP2_REFUSED_STREAM == frame_error(session, HTTP2_RST_STREAM, 5) && 0 == session->number_streams,
+		"HTTP/2 request after GOAWAY refused");
+	destroy_session(session);
+	//
+}
+
+/******************************************************************************
+	test_rate_limits: Checks that HTTP/2 response data takes from the 
+connection's rate limit bucket and from the global one shared with the send 
+scheduler, and that sessions are throttled once either runs dry.
+******************************************************************************/
+void test_rate_limits()
+{
+	BD3WS_HTTP2Session* session = create_session();
+	long granted = 0;
+
+	// The global bucket, filled to one quantum, is shared; bytes that are not sent are given back.
+	scheduler.global_rate = 10 * BD3WS_SchedulerQuantum;
+	check(BD3WS_SchedulerQuantum == scheduler_take_tokens(4 * BD3WS_SchedulerQuantum), "Global rate limit grants up to a full bucket");
+	check(BD3WS_SchedulerQuantum / 2 > http2_take_tokens(session, BD3WS_SchedulerQuantum) && session->throttled, "HTTP/2 data throttled by the global rate limit");
+
+	scheduler_return_tokens(1000);
+	session->throttled = 0;
+	granted = http2_take_tokens(session, 1000);
+	check(1000 == granted && !session->throttled, "HTTP/2 data sent with tokens given back to the global bucket");
+	scheduler.global_rate = 0;
+	//
+
+	// Each connection has its own bucket.
+	scheduler.connection_rate = 10 * BD3WS_SchedulerQuantum;
+	session->tokens = 1000;
+	clock_gettime(CLOCK_MONOTONIC, &(session->refilled));
+	granted = http2_take_tokens(session, BD3WS_SchedulerQuantum);
+	check(1000 <= granted && BD3WS_SchedulerQuantum / 2 > granted && session->throttled, "HTTP/2 data throttled by the connection rate limit");
+	scheduler.connection_rate = 0;
+	//
+
+	session->throttled = 0;
+	check(BD3WS_SchedulerQuantum == http2_take_tokens(session, BD3WS_SchedulerQuantum) && !session->throttled, "HTTP/2 data not throttled without rate limits");
+	destroy_session(session);
+}
+
+/******************************************************************************
+	test_fastcgi_slow_client: Checks that a client that never reads does not 
+hold up another request multiplexed on the same upstream connection: a reader 
+thread is fed by a fake backend, and the slow request is given up on (and 
+aborted upstream) once its stream is full. Both kinds of consumers then reset 
+the response instead of ending it.
+******************************************************************************/
+void test_fastcgi_slow_client()
+{
+	static BD3WS_FastCGIRoute route;
+	const char* header = "Content-Type: text/plain\r\n\r\n";
+	char* data = calloc(1, FCGI_MaxLengthContent);
+	unsigned char record[8];
+	struct timeval timeout = { 2, 0 };
+	struct pollfd backend_poll;
+	BD3WS_FastCGIConnection* connection = &(route.connections[0]);
+	BD3WS_FastCGIRequest* requests[2];
+	BD3WS_Stream* streams[2];
+	BD3WS_HTTP2Session* session = NULL;
+	BD3WS_HTTP2Stream* stream = NULL;
+	BD3WS_Transfer transfer;
+	pthread_t reader;
+	int sockets[2];
+	int wakeup[2];
+	int written = 1;
+	int finished = 0;
+	int aborted = 0;
+
+	// A connection multiplexing two requests, whose backend end is kept by the test.
+	socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
+	setsockopt(sockets[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	pipe2(wakeup, O_NONBLOCK | O_CLOEXEC);
+
+	strcpy(route.address, "unix:/test");
+	pthread_mutex_init(&(route.mutex), NULL);
+	pthread_cond_init(&(route.available), NULL);
+	connection->route = &route;
+	connection->socket = sockets[1];
+	connection->capacity = 2;
+	connection->active = 2;
+	pthread_mutex_init(&(connection->write_mutex), NULL);
+	for (int i = 0; i < 2; ++i)
+	{
+		requests[i] = calloc(1, sizeof(BD3WS_FastCGIRequest));
+		requests[i]->stream = streams[i] = stream_create(wakeup[1]);
+		connection->requests[i] = requests[i];
+	}
+	pthread_create(&reader, NULL, run_fastcgi_reader, connection);
+	//
+
+	// More output for the first request than its stream holds, then a complete response for the second. A reader waiting for the 
+	// first client would stop reading, and the writes would time out.
+	written = written && 0 == fastcgi_write_record(sockets[0], FCGI_STDOUT, 1, header, strlen(header));
+	for (int i = 0; written && i <= BD3WS_FastCGIMaxBuffered / FCGI_MaxLengthContent + 1; ++i)
+	{
+		written = 0 == fastcgi_write_record(sockets[0], FCGI_STDOUT, 1, data, FCGI_MaxLengthContent);
+	}
+	written = written && 0 == fastcgi_write_record(sockets[0], FCGI_STDOUT, 2, header, strlen(header));
+	written = written && 0 == fastcgi_write_record(sockets[0], FCGI_STDOUT, 2, NULL, 0);
+	written = written && 0 == fastcgi_write_record(sockets[0], FCGI_END_REQUEST, 2, data, 8);
+
+	for (int i = 0; i < 200 && !finished; ++i)
+	{
+		pthread_mutex_lock(&(streams[1]->mutex));
+		finished = streams[1]->finished;
+		pthread_mutex_unlock(&(streams[1]->mutex));
+		usleep(10000);
+	}
+	check(written && finished, "FastCGI request completed while another client does not read");
+	check(streams[0]->failed && !streams[1]->failed, "FastCGI request of the slow client given up on");
+
+	backend_poll.fd = sockets[0];
+	backend_poll.events = POLLIN;
+	while (!aborted && 0 < poll(&backend_poll, 1, 1000) && 0 == read_fully(sockets[0], (char*)record, sizeof(record)))
+	{
+		aborted = FCGI_ABORT_REQUEST == record[1] && 1 == ((record[2] << 8) | record[3]);
+	}
+	check(aborted, "FastCGI request of the slow client aborted upstream");
+	//
+
+	// An HTTP/2 stream and a scheduled transfer reset the response of a stream given up on.
+	session = create_session();
+	stream = calloc(1, sizeof(BD3WS_HTTP2Stream));
+	stream->id = 1;
+	stream->responding = 1;
+	stream->headers_sent = 1;
+	stream->window = BD3WS_HTTP2DefaultWindow;
+	stream->response.file = -1;
+	stream->response.stream = stream_create(wakeup[1]);
+	session->streams[session->number_streams++] = stream;
+	stream_fail(session->streams[0]->response.stream);
+	stream_release(session->streams[0]->response.stream);
+	check(1 == http2_send_response(session, stream) && HTTP2_INTERNAL_ERROR == frame_error(session, HTTP2_RST_STREAM, 1) && 0 == session->number_streams,
+		"HTTP/2 response reset once its upstream gives up");
+	destroy_session(session);
+
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.file = -1;
+	transfer.stream = streams[0];
+	check(streams[0]->failed && 0 == scheduler_send(&transfer, BD3WS_SchedulerQuantum) && ECONNABORTED == transfer.failed,
+		"Scheduled response failed once its upstream gives up");
+	//
+
+	// The clients go away, and so does the backend.
+	for (int i = 0; i < 2; ++i)
+	{
+		pthread_mutex_lock(&(streams[i]->mutex));
+		streams[i]->abandoned = 1;
+		pthread_cond_broadcast(&(streams[i]->drained));
+		pthread_mutex_unlock(&(streams[i]->mutex));
+	}
+	close(sockets[0]);
+	pthread_join(reader, NULL);
+	stream_release(streams[0]);
+	stream_release(streams[1]);
+	close(wakeup[0]);
+	close(wakeup[1]);
+	free(data);
+}
+
+/******************************************************************************
+	test_directories: Checks how directory requests are resolved beneath a 
+scratch document root: the order of the index files, the default page of the 
+document root, HTML escaping in generated listings, and the invalidation of 
+cached directory lookups when a directory changes.
+******************************************************************************/
+void test_directories()
+{
+	char root[] = "/tmp/BD3WS_test.XXXXXX";
+	char directory[BD3WS_MaxLengthData];
+	char file_path[BD3WS_MaxLengthData];
+	struct timespec times[2];
+	struct stat directory_stat;
+	BD3WS_Host* host = &(server.hosts[0]);
+	BD3WS_Transfer transfer;
+	char* listing = NULL;
+	unsigned long listing_length = 0;
+
+	if (NULL == mkdtemp(root))
+	{
+		check(0, "Scratch document root created");
+		return;
+	}
+
+	// Scratch document root, without an index file of its own.
+	sprintf(directory, "%s/", root);
+	strcpy(host->root, directory);
+	host->directory = open(host->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	load_prepared_response(BD3WS_FileHTTP404, NOTFOUND, &(host->not_found));
+	load_prepared_response(BD3WS_FileDefault, OK, &(server.default_page));
+	set_index_files("index.html,index.htm");
+	server.autoindex = 0;
+
+	sprintf(file_path, "%sboth", directory);
+	mkdir(file_path, S_IRWXU);
+	create_file(directory, "both/index.htm");
+	create_file(directory, "both/index.html");
+	sprintf(file_path, "%ssecond", directory);
+	mkdir(file_path, S_IRWXU);
+	create_file(directory, "second/index.htm");
+	sprintf(file_path, "%splain", directory);
+	mkdir(file_path, S_IRWXU);
+	sprintf(file_path, "%slisted", directory);
+	mkdir(file_path, S_IRWXU);
+	create_file(directory, "listed/<script>.txt");
+	create_file(directory, "listed/a&b.txt");
+	sprintf(file_path, "%slater", directory);
+	mkdir(file_path, S_IRWXU);
+	//
+
+	// The first index file in the list that exists is served.
+	sprintf(file_path, "%sboth", directory);
+	stat(file_path, &directory_stat);
+	check(0 == resolve_directory(host, file_path, &directory_stat, &listing, &listing_length) && 0 == strcmp(file_path + strlen(directory), "both/index.html"),
+		"Index files tried in the order given");
+
+	sprintf(file_path, "%ssecond", directory);
+	stat(file_path, &directory_stat);
+	check(1 == resolve_directory(host, file_path, &directory_stat, &listing, &listing_length) && 0 == strcmp(file_path + strlen(directory), "second/index.htm"),
+		"Later index files used when the first is missing");
+	//
+
+	// Without an index file or autoindex, only the document root falls back on the default page.
+	memset(&transfer, 0, sizeof(transfer));
+	check(0 == prepare_server_response(host, "/", "", &transfer) && NULL != transfer.name && 0 == strcmp(transfer.name, server.default_page.name),
+		"Document root without an index file served the default page");
+	free(transfer.header);
+	free(transfer.name);
+	free(transfer.content);
+
+	memset(&transfer, 0, sizeof(transfer));
+	check(0 == prepare_server_response(host, "/plain/", "", &transfer) && NULL != transfer.name && 0 == strcmp(transfer.name, host->not_found.name),
+		"Subdirectory without an index file not found");
+	free(transfer.header);
+	free(transfer.name);
+	free(transfer.content);
+	//
+
+	// Generated listings escape entry names.
+	listing = build_directory_listing(host, "listed", &listing_length);
+	check(NULL != listing && NULL != strstr(listing, "&lt;script&gt;.txt</a>") && NULL != strstr(listing, "a&amp;b.txt</a>") && NULL == strstr(listing, "<script>"),
+		"Directory listing escapes entry names");
+	free(listing);
+	listing = NULL;
+	//
+
+	// Cached lookups hold while the directory is unchanged, and are redone once its modification time changes.
+	times[0].tv_sec = times[1].tv_sec = 1000000000;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	sprintf(file_path, "%slater", directory);
+	utimensat(AT_FDCWD, file_path, times, 0);
+	stat(file_path, &directory_stat);
+	check(-1 == resolve_directory(host, file_path, &directory_stat, &listing, &listing_length), "Directory without an index file");
+
+	create_file(directory, "later/index.html");
+	utimensat(AT_FDCWD, file_path, times, 0);
+	stat(file_path, &directory_stat);
+	check(-1 == resolve_directory(host, file_path, &directory_stat, &listing, &listing_length), "Directory lookup cached while the directory is unchanged");
+
+	times[0].tv_sec = times[1].tv_sec = 1000000001;
+	utimensat(AT_FDCWD, file_path, times, 0);
+	stat(file_path, &directory_stat);
+	check(0 == resolve_directory(host, file_path, &directory_stat, &listing, &listing_length) && 0 == strcmp(file_path + strlen(directory), "later/index.html"),
+		"Directory lookup redone once the directory changes");
+	//
+
+	close(host->directory);
+	host->directory = -1;
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/******************************************************************************
+	main: Runs the checks and reports the outcome.
+******************************************************************************/
+int main(int argc, char **argv)
+{
+	test_hpack_integer();
+	test_hpack_string();
+	test_hpack_block();
+	test_accept_quality();
+	test_resolve_path();
+	test_find_host();
+	test_fastcgi_translate_header();
+	test_http2_frames();
+	test_rate_limits();
+	test_fastcgi_slow_client();
+	test_directories();
+
+	printf("%d of %d checks passed.\n", number_checks - number_failures, number_checks);
+
+	return (0 == number_failures) ? 0 : 1;
+}
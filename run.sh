@@ -1,11 +1,19 @@
 # 		This compiles and conditionally runs the BD3WS program.  It also allows
 #	for specification of the "-d" command-line argument which will run BD3WS
-#	with gdb attached.
+#	with gdb attached, and of the "-t" command-line argument which will instead 
+#	compile and run the checks in BD3WS_test.c.
 
 #!/bin/bash
 
 echo -e "--------------------------------------------"
 
+# Compile and run the checks instead of the server.
+if [ "$1" = "-t" ]; then
+	echo -e "Compiling checks..."
+	gcc -g -w -std=gnu99 -pthread -o BD3WS_test BD3WS_test.c && ./BD3WS_test
+	exit $?
+fi
+
 # Attempt compilation.
 echo -e "Compiling..."
 gcc -g -w -std=gnu99 -pthread -o BD3WS BD3WS.c